@@ -0,0 +1,189 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+"""
+End-to-end benchmark of the USB MIDI driver against the Linux USB MIDI driver
+(snd-usb-audio), using the echo device in bench/src/main.c.
+
+For each cable, measures over ALSA rawmidi:
+
+latency    - Round trip time of single note on messages, sent one at a time.
+             Reports percentiles.
+throughput - Sustained rate of 3 byte channel messages sent as fast as
+             possible, counted when echoed back.
+sysex      - Sustained rate of sysex data bytes, sent as back to back
+             messages, counted when echoed back.
+
+Build and run the device on native_sim, then attach it over USB/IP:
+
+  west build -b native_sim bench -d build_bench && build_bench/zephyr/zephyr.exe
+  sudo modprobe vhci-hcd && sudo usbip attach -r localhost -b 1-1
+  ./bench/alsa_bench.py
+
+The device also works on real hardware, with --name if its product string is
+not the default one of bench/prj.conf.
+"""
+import argparse
+import ctypes
+import ctypes.util
+import re
+import threading
+import time
+
+DEFAULT_NAME = 'zephyr-usb-midi-bench'
+
+
+class RawMidi:
+    """A rawmidi subdevice, i.e a cable, opened for input and output."""
+
+    lib = None
+
+    def __init__(self, name):
+        if RawMidi.lib is None:
+            path = ctypes.util.find_library('asound')
+            if not path:
+                raise SystemExit('libasound not found, install alsa-lib')
+            RawMidi.lib = ctypes.CDLL(path)
+            RawMidi.lib.snd_rawmidi_read.restype = ctypes.c_ssize_t
+            RawMidi.lib.snd_rawmidi_write.restype = ctypes.c_ssize_t
+            RawMidi.lib.snd_strerror.restype = ctypes.c_char_p
+        self.name = name
+        self.input = ctypes.c_void_p()
+        self.output = ctypes.c_void_p()
+        rc = self.lib.snd_rawmidi_open(ctypes.byref(self.input), ctypes.byref(self.output),
+                                       name.encode(), 0)
+        if rc < 0:
+            raise SystemExit(f'Failed to open {name}: {self.lib.snd_strerror(rc).decode()}')
+        self.buf = ctypes.create_string_buffer(4096)
+
+    def write(self, data):
+        rc = self.lib.snd_rawmidi_write(self.output, data, len(data))
+        if rc != len(data):
+            raise SystemExit(f'Failed to write to {self.name}: {rc}')
+        self.lib.snd_rawmidi_drain(self.output)
+
+    def write_nodrain(self, data):
+        """Writes without waiting for the data to have been sent."""
+        rc = self.lib.snd_rawmidi_write(self.output, data, len(data))
+        if rc != len(data):
+            raise SystemExit(f'Failed to write to {self.name}: {rc}')
+
+    def read(self):
+        """Blocks until at least one byte has been received."""
+        rc = self.lib.snd_rawmidi_read(self.input, self.buf, len(self.buf))
+        if rc < 0:
+            raise SystemExit(f'Failed to read from {self.name}: {rc}')
+        return self.buf.raw[:rc]
+
+    def read_exactly(self, num_bytes, timeout_s):
+        """Polls, so that the measured latency does not include a wakeup."""
+        data = b''
+        end = time.monotonic() + timeout_s
+        self.lib.snd_rawmidi_nonblock(self.input, 1)
+        try:
+            while len(data) < num_bytes:
+                rc = self.lib.snd_rawmidi_read(self.input, self.buf, num_bytes - len(data))
+                if rc > 0:
+                    data += self.buf.raw[:rc]
+                elif time.monotonic() > end:
+                    raise SystemExit(f'Timed out waiting for the echo on {self.name}')
+        finally:
+            self.lib.snd_rawmidi_nonblock(self.input, 0)
+        return data
+
+    def close(self):
+        self.lib.snd_rawmidi_close(self.input)
+        self.lib.snd_rawmidi_close(self.output)
+
+
+def find_card(name):
+    with open('/proc/asound/cards') as f:
+        for line in f:
+            match = re.match(r'\s*(\d+) \[.*\]: .* - (.*)$', line)
+            if match and name in match.group(2):
+                return int(match.group(1))
+    raise SystemExit(f'No sound card named {name} found, is the device attached?')
+
+
+def count_subdevices(card):
+    with open(f'/proc/asound/card{card}/midi0') as f:
+        return len(re.findall(r'^Output \d+', f.read(), re.MULTILINE)) or 1
+
+
+def percentile(sorted_values, p):
+    return sorted_values[min(len(sorted_values) - 1, int(p / 100 * len(sorted_values)))]
+
+
+def bench_latency(midi, num_messages):
+    rtts_us = []
+    for i in range(num_messages):
+        msg = bytes([0x90, i & 0x7f, 1 + (i >> 7) % 127])
+        start = time.perf_counter_ns()
+        midi.write(msg)
+        echo = midi.read_exactly(3, 1.0)
+        rtts_us.append((time.perf_counter_ns() - start) / 1000)
+        if echo != msg:
+            raise SystemExit(f'Unexpected echo {echo.hex()} of {msg.hex()} on {midi.name}')
+    rtts_us.sort()
+    return {p: percentile(rtts_us, p) for p in (50, 90, 99, 100)}
+
+
+def bench_stream(midi, data, num_bytes_per_event):
+    """Sends data as fast as possible and returns the echoed events/s."""
+    received = [0]
+
+    def reader():
+        while received[0] < len(data):
+            received[0] += len(midi.read())
+
+    thread = threading.Thread(target=reader, daemon=True)
+    start = time.perf_counter()
+    thread.start()
+    chunk_size = 1024
+    for i in range(0, len(data), chunk_size):
+        midi.write_nodrain(data[i:i + chunk_size])
+    thread.join(timeout=60)
+    elapsed = time.perf_counter() - start
+    if thread.is_alive():
+        raise SystemExit(f'Timed out waiting for the echo on {midi.name}, '
+                         f'{received[0]} of {len(data)} bytes received')
+    return len(data) / num_bytes_per_event / elapsed
+
+
+def channel_messages(num_events):
+    return b''.join(bytes([0xb0 | (i % 16), i & 0x7f, (i >> 7) & 0x7f])
+                    for i in range(num_events))
+
+
+def sysex_messages(num_messages, msg_size):
+    body = bytes(i & 0x7f for i in range(msg_size - 2))
+    return (b'\xf0' + body + b'\xf7') * num_messages
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0])
+    parser.add_argument('--name', default=DEFAULT_NAME, help='The USB product string')
+    parser.add_argument('--cables', type=int, help='The number of cables, by default all')
+    parser.add_argument('--latency-messages', type=int, default=2000)
+    parser.add_argument('--throughput-events', type=int, default=100000)
+    parser.add_argument('--sysex-messages', type=int, default=200)
+    parser.add_argument('--sysex-size', type=int, default=1024)
+    args = parser.parse_args()
+
+    card = find_card(args.name)
+    num_cables = args.cables or count_subdevices(card)
+
+    print(f'{"cable":>5} {"p50 us":>9} {"p90 us":>9} {"p99 us":>9} {"max us":>9} '
+          f'{"events/s":>10} {"sysex B/s":>10}')
+    for cable in range(num_cables):
+        midi = RawMidi(f'hw:{card},0,{cable}')
+        latency = bench_latency(midi, args.latency_messages)
+        events_per_s = bench_stream(midi, channel_messages(args.throughput_events), 3)
+        sysex_bytes_per_s = bench_stream(midi, sysex_messages(args.sysex_messages,
+                                                              args.sysex_size), 1)
+        midi.close()
+        print(f'{cable:>5} {latency[50]:>9.0f} {latency[90]:>9.0f} {latency[99]:>9.0f} '
+              f'{latency[100]:>9.0f} {events_per_s:>10.0f} {sysex_bytes_per_s:>10.0f}')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,121 @@
+/*
+ * Echo device for the end-to-end benchmark, see alsa_bench.py. Every message
+ * received on a cable, including sysex, is sent back on the same cable.
+ * Received data is processed in the main thread with flow control, so the
+ * host is throttled instead of data being dropped when the echo falls behind.
+ */
+#include <zephyr/kernel.h>
+#include <zephyr/usb/usb_device.h>
+#include <usb_midi/usb_midi.h>
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(usb_midi_bench);
+
+#define NUM_CABLES MIN(CONFIG_USB_MIDI_NUM_INPUTS, CONFIG_USB_MIDI_NUM_OUTPUTS)
+
+/* Sysex bytes of a cable waiting to be echoed, three at a time. */
+struct sysex_echo_t {
+	uint8_t bytes[3];
+	int num_bytes;
+};
+
+static struct sysex_echo_t sysex_echoes[NUM_CABLES];
+
+static K_SEM_DEFINE(rx_sem, 0, 1);
+
+static void echo(uint8_t cable_num, uint8_t *bytes)
+{
+	int rc = usb_midi_tx_buffer_add_wait(cable_num, bytes, K_FOREVER);
+	if (rc != 0) {
+		LOG_ERR("Failed to echo on cable %d with error %d", cable_num, rc);
+	}
+}
+
+static void sysex_echo_add(uint8_t cable_num, uint8_t byte)
+{
+	struct sysex_echo_t *sysex_echo = &sysex_echoes[cable_num];
+	sysex_echo->bytes[sysex_echo->num_bytes++] = byte;
+	if (sysex_echo->num_bytes == 3 || byte == 0xf7) {
+		for (int i = sysex_echo->num_bytes; i < 3; i++) {
+			sysex_echo->bytes[i] = 0;
+		}
+		echo(cable_num, sysex_echo->bytes);
+		sysex_echo->num_bytes = 0;
+	}
+}
+
+static void midi_message_cb(uint8_t *bytes, uint8_t num_bytes, uint8_t cable_num)
+{
+	if (cable_num >= NUM_CABLES) {
+		return;
+	}
+	uint8_t msg[3] = {0, 0, 0};
+	for (int i = 0; i < num_bytes; i++) {
+		msg[i] = bytes[i];
+	}
+	echo(cable_num, msg);
+}
+
+static void sysex_start_cb(uint8_t cable_num)
+{
+	if (cable_num < NUM_CABLES) {
+		sysex_echoes[cable_num].num_bytes = 0;
+		sysex_echo_add(cable_num, 0xf0);
+	}
+}
+
+static void sysex_data_cb(uint8_t *data_bytes, uint8_t num_data_bytes, uint8_t cable_num)
+{
+	if (cable_num >= NUM_CABLES) {
+		return;
+	}
+	for (int i = 0; i < num_data_bytes; i++) {
+		sysex_echo_add(cable_num, data_bytes[i]);
+	}
+}
+
+static void sysex_end_cb(uint8_t cable_num)
+{
+	if (cable_num < NUM_CABLES) {
+		sysex_echo_add(cable_num, 0xf7);
+	}
+}
+
+static void sysex_abort_cb(uint8_t cable_num)
+{
+	/* Terminate the echoed message, so that the host sees the abort too */
+	sysex_end_cb(cable_num);
+}
+
+static void rx_queued_cb()
+{
+	k_sem_give(&rx_sem);
+}
+
+static void available_cb(int is_available)
+{
+	LOG_INF("USB MIDI device is %s", is_available ? "available" : "unavailable");
+}
+
+void main(void)
+{
+	struct usb_midi_cb_t callbacks = {.available_cb = available_cb,
+					  .midi_message_cb = midi_message_cb,
+					  .sysex_start_cb = sysex_start_cb,
+					  .sysex_data_cb = sysex_data_cb,
+					  .sysex_end_cb = sysex_end_cb,
+					  .sysex_abort_cb = sysex_abort_cb,
+					  .rx_queued_cb = rx_queued_cb};
+	usb_midi_register_callbacks(&callbacks);
+
+	int enable_rc = usb_enable(NULL);
+	__ASSERT(enable_rc == 0, "Failed to enable USB");
+
+	while (1) {
+		k_sem_take(&rx_sem, K_FOREVER);
+		/* Echo everything received so far in as few transfers as possible */
+		while (usb_midi_rx_process(1) > 0) {
+		}
+		usb_midi_tx_buffer_send();
+	}
+}
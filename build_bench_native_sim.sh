@@ -0,0 +1 @@
+west build -b native_sim bench -d build_bench -- -DCMAKE_EXPORT_COMPILE_COMMANDS=1
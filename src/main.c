@@ -14,9 +14,23 @@ struct k_work button_press_work;
 struct k_work event_tx_work;
 struct k_work_delayable rx_led_off_work;
 struct k_work_delayable tx_led_off_work;
-static void send_next_sysex_chunk();
+#ifdef CONFIG_TX_CLOCK_ENABLED
+struct k_work clock_start_work;
+#endif
 
 /************************ App state ************************/
+
+/* A sysex message being transmitted. */
+struct sysex_tx_t {
+	/* Reports the progress of the echo */
+	struct usb_midi_tx_token token;
+	int byte_count;
+	int msg_size;
+	int in_progress;
+	int cable_num;
+	int64_t start_time;
+};
+
 struct sample_app_state_t {
 	int usb_midi_is_available;
 	int tx_note_off;
@@ -24,26 +38,27 @@ struct sample_app_state_t {
 	int sysex_rx_byte_count;
 	uint8_t sysex_rx_bytes[CONFIG_SYSEX_ECHO_MAX_LENGTH];
 	int64_t sysex_rx_start_time;
-
-	int sysex_tx_is_echo;
-	int sysex_tx_byte_count;
-	int sysex_tx_msg_size;
-	int sysex_tx_in_progress;
-	int sysex_tx_cable_num;
-	int64_t sysex_tx_start_time;
+	/* The echoed message, sent straight from sysex_rx_bytes */
+	struct usb_midi_iov sysex_echo_iov;
+
+	/*
+	 * The generated test message and the echo can be transmitted simultaneously
+	 * on different cables.
+	 */
+	struct sysex_tx_t sysex_tx_test;
+	struct sysex_tx_t sysex_tx_echo;
 };
 
+static void sysex_tx_token_cb(struct usb_midi_tx_token *token, uint32_t num_bytes, int status);
+
 static struct sample_app_state_t sample_app_state = {.usb_midi_is_available = 0,
 							 .sysex_rx_byte_count = 0,
-							 .sysex_tx_in_progress = 0,
 							 .sysex_rx_start_time = 0,
-						     .sysex_tx_byte_count = 0,
-							 .sysex_tx_start_time = 0,
-							 .sysex_tx_is_echo = 0,
-						     .sysex_tx_in_progress = 0,
-							 .sysex_tx_cable_num = 0,
+							 .sysex_tx_test = {.token = {.cb = sysex_tx_token_cb,
+										     .user_data = &sample_app_state.sysex_tx_test}},
+							 .sysex_tx_echo = {.token = {.cb = sysex_tx_token_cb,
+										     .user_data = &sample_app_state.sysex_tx_echo}},
 						     .tx_note_off = 0,
-							 .sysex_rx_byte_count = 0
 							 };
 
 static void log_sysex_transfer_time(int is_tx, int cable_num, int num_bytes, int time_ms) {
@@ -52,14 +67,25 @@ static void log_sysex_transfer_time(int is_tx, int cable_num, int num_bytes, int
 		num_bytes, (int)time_ms, (int)bytes_per_s);
 }
 
-static void sysex_tx_will_start(int is_echo, int msg_size, int cable_num) {
-	__ASSERT_NO_MSG(sample_app_state.sysex_tx_in_progress == 0);
-	sample_app_state.sysex_tx_in_progress = 1;
-	sample_app_state.sysex_tx_is_echo = is_echo;
-	sample_app_state.sysex_tx_byte_count = 0;
-	sample_app_state.sysex_tx_msg_size = msg_size;
-	sample_app_state.sysex_tx_cable_num = cable_num;
-	sample_app_state.sysex_tx_start_time = k_uptime_get();
+static int sysex_tx_is_in_progress_on_cable(int cable_num) {
+	// Sysex messages must not be interleaved on a cable
+	struct sysex_tx_t *sysex_txs[] = {&sample_app_state.sysex_tx_test,
+					  &sample_app_state.sysex_tx_echo};
+	for (int i = 0; i < ARRAY_SIZE(sysex_txs); i++) {
+		if (sysex_txs[i]->in_progress && sysex_txs[i]->cable_num == cable_num) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void sysex_tx_will_start(struct sysex_tx_t *sysex_tx, int msg_size, int cable_num) {
+	__ASSERT_NO_MSG(sysex_tx->in_progress == 0);
+	sysex_tx->in_progress = 1;
+	sysex_tx->byte_count = 0;
+	sysex_tx->msg_size = msg_size;
+	sysex_tx->cable_num = cable_num;
+	sysex_tx->start_time = k_uptime_get();
 }
 
 /************************ LEDs ************************/
@@ -102,7 +128,8 @@ static void flash_rx_led()
 
 void on_event_tx(struct k_work *item)
 {
-	if (sample_app_state.usb_midi_is_available && !sample_app_state.sysex_tx_in_progress) {
+	if (sample_app_state.usb_midi_is_available && !sample_app_state.sysex_tx_test.in_progress &&
+	    !sample_app_state.sysex_tx_echo.in_progress) {
 		uint8_t note = CONFIG_TX_PERIODIC_NOTE_NUMBER;
 		uint8_t vel = CONFIG_TX_PERIODIC_NOTE_VELOCITY;
 		uint8_t msg[3] = {sample_app_state.tx_note_off ? 0x80 : 0x90, note, vel };
@@ -112,11 +139,27 @@ void on_event_tx(struct k_work *item)
 	}
 }
 
+#ifdef CONFIG_TX_CLOCK_ENABLED
+void on_clock_start(struct k_work *item)
+{
+	usb_midi_clock_set_tempo(1000 * CONFIG_TX_CLOCK_TEMPO_BPM);
+	int rc = usb_midi_clock_start(0);
+	if (rc != 0) {
+		LOG_ERR("Failed to start MIDI clock with error %d", rc);
+	}
+}
+#endif
+
 void on_button_press(struct k_work *item)
 {
-	if (sample_app_state.usb_midi_is_available && !sample_app_state.sysex_tx_in_progress) {
-		sysex_tx_will_start(0, CONFIG_SYSEX_TX_TEST_MSG_SIZE, CONFIG_SYSEX_TX_TEST_MSG_CABLE_NUM);
-		send_next_sysex_chunk();
+	struct sysex_tx_t *sysex_tx = &sample_app_state.sysex_tx_test;
+	if (sample_app_state.usb_midi_is_available &&
+	    !sysex_tx_is_in_progress_on_cable(CONFIG_SYSEX_TX_TEST_MSG_CABLE_NUM)) {
+		sysex_tx_will_start(sysex_tx, CONFIG_SYSEX_TX_TEST_MSG_SIZE,
+				    CONFIG_SYSEX_TX_TEST_MSG_CABLE_NUM);
+		// The message is generated by fill_sysex_test_msg as the bus takes it.
+		flash_tx_led();
+		usb_midi_tx_producer_resume(CONFIG_SYSEX_TX_TEST_MSG_CABLE_NUM);
 	}
 }
 
@@ -190,6 +233,12 @@ static void sysex_data_cb(uint8_t *data_bytes, uint8_t num_data_bytes, uint8_t c
 	sample_app_state.sysex_rx_byte_count += num_data_bytes;
 }
 
+static void sysex_abort_cb(uint8_t cable_num)
+{
+	LOG_WRN("Received sysex aborted on cable %d", cable_num);
+	sample_app_state.sysex_rx_byte_count = 0;
+}
+
 static void sysex_end_cb(uint8_t cable_num)
 {
 	if (sample_app_state.sysex_rx_byte_count < CONFIG_SYSEX_ECHO_MAX_LENGTH) {
@@ -200,9 +249,25 @@ static void sysex_end_cb(uint8_t cable_num)
 	log_sysex_transfer_time(0, cable_num, sample_app_state.sysex_rx_byte_count, dt_ms);
 	flash_rx_led();
 #ifdef CONFIG_SYSEX_ECHO_ENABLED
+	struct sysex_tx_t *sysex_tx = &sample_app_state.sysex_tx_echo;
+	if (sysex_tx_is_in_progress_on_cable(cable_num)) {
+		LOG_WRN("Not echoing received sysex, previous message in progress");
+		return;
+	}
 	LOG_INF("Echoing received sysex");
-	sysex_tx_will_start(1, sample_app_state.sysex_rx_byte_count < CONFIG_SYSEX_ECHO_MAX_LENGTH ? sample_app_state.sysex_rx_byte_count : CONFIG_SYSEX_ECHO_MAX_LENGTH, cable_num);
-	send_next_sysex_chunk();
+	int msg_size = sample_app_state.sysex_rx_byte_count < CONFIG_SYSEX_ECHO_MAX_LENGTH ? sample_app_state.sysex_rx_byte_count : CONFIG_SYSEX_ECHO_MAX_LENGTH;
+	sysex_tx_will_start(sysex_tx, msg_size, cable_num);
+	sample_app_state.sysex_echo_iov.data = sample_app_state.sysex_rx_bytes;
+	sample_app_state.sysex_echo_iov.len = msg_size;
+	// The whole message is handed over at once. The token callback is invoked when it has been sent.
+	int tx_rc = usb_midi_tx_sysexv(cable_num, &sample_app_state.sysex_echo_iov, 1, &sysex_tx->token);
+	if (tx_rc != 0) {
+		LOG_ERR("Failed to echo sysex with error %d", tx_rc);
+		sysex_tx->in_progress = 0;
+		return;
+	}
+	sysex_tx->byte_count = msg_size;
+	flash_tx_led();
 #endif
 }
 
@@ -212,76 +277,80 @@ static void usb_midi_available_cb(int is_available)
 	set_usb_midi_available_led(is_available);
 	if (is_available) {
 		sample_app_state.tx_note_off = 0;
-		sample_app_state.sysex_tx_in_progress = 0;
 	}
+#ifdef CONFIG_TX_CLOCK_ENABLED
+	if (is_available) {
+		/* The driver accepts messages once this callback has returned. */
+		k_work_submit(&clock_start_work);
+	} else {
+		usb_midi_clock_stop();
+	}
+#endif
 }
 
-static uint8_t get_next_sysex_tx_byte() {
-	if (sample_app_state.sysex_tx_is_echo) {
-		return sample_app_state.sysex_rx_bytes[sample_app_state.sysex_tx_byte_count];
+static uint8_t get_sysex_tx_byte(struct sysex_tx_t *sysex_tx, int byte_idx) {
+	if (byte_idx == 0) {
+		return 0xf0;
+	}
+	else if (byte_idx == sysex_tx->msg_size - 1) {
+		return 0xf7;
 	} 
 	else {
-		if (sample_app_state.sysex_tx_byte_count == 0) {
-			return 0xf0;
-		}
-		else if (sample_app_state.sysex_tx_byte_count == sample_app_state.sysex_tx_msg_size - 1) {
-			return 0xf7;
-		} 
-		else {
-			return sample_app_state.sysex_tx_byte_count % 100;
-		}	
-	}
+		return byte_idx % 100;
+	}	
 }
 
-static void send_next_sysex_chunk() {
-	__ASSERT_NO_MSG(sample_app_state.sysex_tx_in_progress);
-	flash_tx_led();
-
-	while (1) {
-		if (usb_midi_tx_buffer_is_full()) {
-			// tx packet is full. send it. 
-			usb_midi_tx_buffer_send();
-			// nothing further for now. wait for tx done callback before
-			// filling the next packet.
-			break;
-		}
-
-		int sysex_msg_size = sample_app_state.sysex_tx_msg_size;
-
-		uint8_t chunk[3] = {0, 0, 0};
-		for (int i = 0; i < 3; i++) {
-			uint8_t next_sysex_byte = get_next_sysex_tx_byte();
-			chunk[i] = next_sysex_byte;
-			sample_app_state.sysex_tx_byte_count++;
+static size_t fill_sysex_test_msg(uint8_t cable_num, uint8_t *dst_words, size_t max_events, void *ctx) {
+	struct sysex_tx_t *sysex_tx = ctx;
+	if (!sysex_tx->in_progress) {
+		return 0;
+	}
+	if (usb_midi_ump_is_active()) {
+		// The event packets written below are USB MIDI 1.0 packets.
+		LOG_WRN("sysex test message not supported with MIDI 2.0");
+		sysex_tx->in_progress = 0;
+		return 0;
+	}
 
-			if (sample_app_state.sysex_tx_byte_count == sysex_msg_size) {
-				break;
-			}
+	// Generate the next sysex bytes straight into the tx buffer, one event
+	// packet (i.e up to 3 sysex bytes) at a time.
+	size_t num_events = 0;
+	while (num_events < max_events && sysex_tx->byte_count < sysex_tx->msg_size) {
+		uint8_t chunk[3];
+		uint32_t chunk_size = MIN(3, sysex_tx->msg_size - sysex_tx->byte_count);
+		for (int i = 0; i < chunk_size; i++) {
+			chunk[i] = get_sysex_tx_byte(sysex_tx, sysex_tx->byte_count + i);
 		}
+		num_events += usb_midi_events_from_sysex(cable_num, chunk, &chunk_size,
+							 &dst_words[4 * num_events], 1);
+		sysex_tx->byte_count += chunk_size;
+	}
 
-		// Enqueue three byte sysex chunk for transmission
-		// TODO: check if this suceeds or not? Currently, this check is not needed
-		// since each MIDI message is put into a 4 byte packet and the tx buffer size
-		// is a multiple of 4. 
-		usb_midi_tx_buffer_add(sample_app_state.sysex_tx_cable_num, chunk);
-
-		if (sample_app_state.sysex_tx_byte_count == sysex_msg_size) {
-			// No more data to add to tx packet. Send it, then we're done.
-			usb_midi_tx_buffer_send();
-			flash_tx_led();
-			u_int64_t dt_ms = k_uptime_get() - sample_app_state.sysex_tx_start_time;
-			log_sysex_transfer_time(1, sample_app_state.sysex_tx_cable_num, sysex_msg_size, dt_ms);
-			sample_app_state.sysex_tx_in_progress = 0;
-			break;
-		}
+	if (sysex_tx->byte_count == sysex_tx->msg_size) {
+		// The whole message has been generated.
+		flash_tx_led();
+		u_int64_t dt_ms = k_uptime_get() - sysex_tx->start_time;
+		log_sysex_transfer_time(1, sysex_tx->cable_num, sysex_tx->msg_size, dt_ms);
+		sysex_tx->in_progress = 0;
 	}
+	return num_events;
 }
 
-static void usb_midi_tx_done_cb()
+static void sysex_tx_token_cb(struct usb_midi_tx_token *token, uint32_t num_bytes, int status)
 {
-	if (sample_app_state.sysex_tx_in_progress) {
-		send_next_sysex_chunk();
+	struct sysex_tx_t *sysex_tx = token->user_data;
+	if (!sysex_tx->in_progress) {
+		return;
+	}
+	sysex_tx->in_progress = 0;
+	if (status != 0) {
+		LOG_WRN("sysex tx aborted with status %d", status);
+		return;
 	}
+	// The whole message has been sent.
+	flash_tx_led();
+	u_int64_t dt_ms = k_uptime_get() - sysex_tx->start_time;
+	log_sysex_transfer_time(1, sysex_tx->cable_num, sysex_tx->msg_size, dt_ms);
 }
 
 /****************** Sample app ******************/
@@ -298,15 +367,20 @@ void main(void)
 	k_work_init(&event_tx_work, on_event_tx);
 	k_work_init_delayable(&rx_led_off_work, on_rx_led_off);
 	k_work_init_delayable(&tx_led_off_work, on_tx_led_off);
+#ifdef CONFIG_TX_CLOCK_ENABLED
+	k_work_init(&clock_start_work, on_clock_start);
+#endif
 
 	/* Register USB MIDI callbacks */
 	struct usb_midi_cb_t callbacks = {.available_cb = usb_midi_available_cb,
-					  .tx_done_cb = usb_midi_tx_done_cb,
 					  .midi_message_cb = midi_message_cb,
 					  .sysex_data_cb = sysex_data_cb,
 					  .sysex_end_cb = sysex_end_cb,
+					  .sysex_abort_cb = sysex_abort_cb,
 					  .sysex_start_cb = sysex_start_cb};
 	usb_midi_register_callbacks(&callbacks);
+	usb_midi_tx_register_producer(CONFIG_SYSEX_TX_TEST_MSG_CABLE_NUM, fill_sysex_test_msg,
+				      &sample_app_state.sysex_tx_test);
 
 	/* Init USB */
 	int enable_rc = usb_enable(NULL);
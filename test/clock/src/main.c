@@ -0,0 +1,145 @@
+/*
+ * Runs the clock and MTC generators against the kernel timer on native_sim.
+ * Messages are recorded by wrapping the driver function the generators send
+ * with (see CMakeLists.txt), and counted over a stretch of simulated time.
+ */
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+#include <usb_midi/usb_midi.h>
+
+#define CABLE 1
+#define MAX_MESSAGES 64
+
+/* Messages sent, only the first MAX_MESSAGES are kept */
+static uint8_t messages[MAX_MESSAGES][2];
+static uint32_t num_messages;
+
+int __wrap_usb_midi_tx_priority(uint8_t cable_number, uint8_t *midi_bytes)
+{
+	zassert_equal(cable_number, CABLE, "Unexpected cable");
+	if (num_messages < MAX_MESSAGES) {
+		memcpy(messages[num_messages], midi_bytes, 2);
+	}
+	num_messages++;
+	return 0;
+}
+
+/* The time carried by 8 quarter frames starting at a given message */
+static void mtc_time_decode(uint32_t first, struct usb_midi_mtc_time *time, uint8_t *rate)
+{
+	uint8_t values[8];
+	for (int i = 0; i < 8; i++) {
+		zassert_equal(messages[first + i][0], 0xf1, "Expected a quarter frame");
+		zassert_equal(messages[first + i][1] >> 4, i, "Unexpected quarter frame piece");
+		values[i] = messages[first + i][1] & 0xf;
+	}
+	time->frames = values[0] | (values[1] << 4);
+	time->seconds = values[2] | (values[3] << 4);
+	time->minutes = values[4] | (values[5] << 4);
+	time->hours = values[6] | ((values[7] & 0x1) << 4);
+	*rate = values[7] >> 1;
+}
+
+static void before(void *fixture)
+{
+	usb_midi_clock_stop();
+	usb_midi_mtc_stop();
+	num_messages = 0;
+}
+
+/* Tests run in name order, so this one runs before any tempo is set */
+ZTEST(usb_midi_clock, test_clock_default_tempo)
+{
+	/* 120 BPM is 48 clocks per second */
+	zassert_ok(usb_midi_clock_start(CABLE));
+	k_msleep(1000);
+	zassert_ok(usb_midi_clock_stop());
+	zassert_within(num_messages - 2, 49, 1, "Expected 120 BPM without a tempo");
+}
+
+ZTEST(usb_midi_clock, test_clock_tempo)
+{
+	/* 140 BPM is 56 clocks per second, a period that is not a whole number of ticks */
+	zassert_ok(usb_midi_clock_set_tempo(140000));
+	zassert_ok(usb_midi_clock_start(CABLE));
+	k_msleep(10000);
+	zassert_ok(usb_midi_clock_stop());
+
+	zassert_equal(messages[0][0], 0xfa, "Start should be sent first");
+	zassert_equal(messages[1][0], 0xf8, "Clocks should follow");
+	/* Start, the clock due at the start time and one per period after it, and Stop */
+	zassert_within(num_messages - 2, 561, 1, "Clock period rounding should not drift");
+	zassert_equal(usb_midi_clock_stop(), -EALREADY, "Clock is already stopped");
+}
+
+ZTEST(usb_midi_clock, test_clock_tempo_range)
+{
+	zassert_equal(usb_midi_clock_set_tempo(999), -EINVAL, "Tempo too low");
+	zassert_equal(usb_midi_clock_set_tempo(1000001), -EINVAL, "Tempo too high");
+	zassert_ok(usb_midi_clock_set_tempo(120000));
+}
+
+ZTEST(usb_midi_clock, test_mtc_drop_frame_rate)
+{
+	/* 29.97 fps is 4 * 30000 / 1001 quarter frames per second, 1200 in 10.01 s */
+	struct usb_midi_mtc_time time = {0};
+	usb_midi_mtc_set_frame_rate(USB_MIDI_MTC_29_97_FPS_DROP_FRAME);
+	zassert_ok(usb_midi_mtc_start(CABLE, &time));
+	k_msleep(10010);
+	usb_midi_mtc_stop();
+	zassert_within(num_messages, 1201, 1, "Quarter frame period rounding should not drift");
+}
+
+ZTEST(usb_midi_clock, test_mtc_frame_rate_change)
+{
+	struct usb_midi_mtc_time time = {0};
+	usb_midi_mtc_set_frame_rate(USB_MIDI_MTC_25_FPS);
+	zassert_ok(usb_midi_mtc_start(CABLE, &time));
+	k_msleep(1000);
+	/* The new period applies while running */
+	usb_midi_mtc_set_frame_rate(USB_MIDI_MTC_30_FPS);
+	uint32_t num_at_change = num_messages;
+	k_msleep(1000);
+	usb_midi_mtc_stop();
+	zassert_within(num_at_change, 101, 1, "Expected 100 quarter frames per second");
+	zassert_within(num_messages - num_at_change, 120, 1, "Expected 120 quarter frames per second");
+}
+
+ZTEST(usb_midi_clock, test_mtc_drop_frame_advance)
+{
+	struct usb_midi_mtc_time time;
+	uint8_t rate;
+	usb_midi_mtc_set_frame_rate(USB_MIDI_MTC_29_97_FPS_DROP_FRAME);
+
+	/* Frames 0 and 1 are skipped at the start of a minute */
+	struct usb_midi_mtc_time start = {.hours = 1, .minutes = 0, .seconds = 59, .frames = 28};
+	zassert_ok(usb_midi_mtc_start(CABLE, &start));
+	k_msleep(200);
+	usb_midi_mtc_stop();
+	zassert_true(num_messages >= 16, "Expected two full times");
+	mtc_time_decode(0, &time, &rate);
+	zassert_equal(rate, USB_MIDI_MTC_29_97_FPS_DROP_FRAME, "Unexpected rate");
+	zassert_mem_equal(&time, &start, sizeof(time), "The start time should be sent first");
+	mtc_time_decode(8, &time, &rate);
+	zassert_equal(time.hours, 1, "Unexpected hours");
+	zassert_equal(time.minutes, 1, "Unexpected minutes");
+	zassert_equal(time.seconds, 0, "Unexpected seconds");
+	zassert_equal(time.frames, 2, "Frames 0 and 1 should be dropped");
+
+	/* Except at the start of every 10th minute */
+	num_messages = 0;
+	start.minutes = 9;
+	zassert_ok(usb_midi_mtc_start(CABLE, &start));
+	k_msleep(200);
+	usb_midi_mtc_stop();
+	mtc_time_decode(8, &time, &rate);
+	zassert_equal(time.minutes, 10, "Unexpected minutes");
+	zassert_equal(time.seconds, 0, "Unexpected seconds");
+	zassert_equal(time.frames, 0, "Frame 0 should be kept at a 10th minute");
+
+	zassert_equal(usb_midi_mtc_start(CABLE, &(struct usb_midi_mtc_time){.frames = 30}),
+		      -EINVAL, "Frame out of range");
+}
+
+ZTEST_SUITE(usb_midi_clock, NULL, NULL, before, NULL, NULL);
@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+"""
+Compares the cycles per event of two runs of the usb_midi cycles suite and
+fails if a benchmark got slower than a threshold.
+
+A run is either the console output of the suite (e.g handler.log) or the
+recording.csv twister writes next to it.
+
+Usage: compare_cycles.py baseline.log new.log [--threshold 2]
+"""
+import argparse
+import csv
+import re
+import sys
+
+LINE_RE = re.compile(r'usb_midi_cycles (\S+) events=(\d+) cycles=(\d+)')
+
+
+def read_run(path):
+    """Returns {benchmark: cycles per event}."""
+    with open(path, errors='replace') as f:
+        text = f.read()
+    if path.endswith('.csv'):
+        rows = [(row['benchmark'], row['events'], row['cycles'])
+                for row in csv.DictReader(text.splitlines())]
+    else:
+        rows = LINE_RE.findall(text)
+    if not rows:
+        sys.exit(f'No usb_midi_cycles results found in {path}')
+    # A later result of a benchmark, e.g of another test configuration, replaces an earlier one
+    return {name: int(cycles) / int(events) for name, events, cycles in rows}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0])
+    parser.add_argument('baseline')
+    parser.add_argument('new')
+    parser.add_argument('--threshold', type=float, default=2,
+                        help='The max allowed increase in percent')
+    args = parser.parse_args()
+
+    baseline = read_run(args.baseline)
+    new = read_run(args.new)
+
+    num_regressions = 0
+    print(f'{"Benchmark":<28}{"Baseline":>10}{"New":>10}{"Change":>9}')
+    for name in sorted(set(baseline) | set(new)):
+        if name not in baseline or name not in new:
+            print(f'{name:<28}{baseline.get(name, 0):>10.2f}{new.get(name, 0):>10.2f}'
+                  f'{"n/a":>9}')
+            continue
+        change = 100 * (new[name] - baseline[name]) / baseline[name] if baseline[name] else 0
+        is_regression = change > args.threshold
+        num_regressions += is_regression
+        print(f'{name:<28}{baseline[name]:>10.2f}{new[name]:>10.2f}{change:>8.1f}%'
+              f'{" !" if is_regression else ""}')
+    if num_regressions:
+        sys.exit(f'{num_regressions} benchmark(s) got more than {args.threshold}% slower')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,244 @@
+/*
+ * Measures the cycles per event of the driver's hot paths on the target, to
+ * catch code generation regressions that the host tests can't see.
+ *
+ * Cycles are read from the DWT cycle counter with CONFIG_CORTEX_M_DWT=y,
+ * which is the most accurate on hardware. Otherwise k_cycle_get_32 is used,
+ * which on QEMU with icount counts instructions rather than real cycles,
+ * but is stable between runs and so still shows regressions.
+ *
+ * Each benchmark prints a line
+ *   usb_midi_cycles <benchmark> events=<n> cycles=<n> per_event=<n.nn>
+ * with the lowest cycle count of a few runs. Compare two runs with
+ * compare_cycles.py.
+ */
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+#include "usb_midi_packet.h"
+
+#ifdef CONFIG_CORTEX_M_DWT
+#include <soc.h>
+#endif
+
+/* Events per run and runs per benchmark */
+#define NUM_EVENTS 2048
+#define NUM_RUNS 5
+/* The bulk transfer size of a full speed device */
+#define TRANSFER_SIZE 64
+
+static const uint8_t channel_msgs[][3] = {
+	{0x90, 0x3c, 0x64}, /* Note on */
+	{0x80, 0x3c, 0x00}, /* Note off */
+	{0xb3, 0x07, 0x7f}, /* Control change */
+	{0xe5, 0x00, 0x40}, /* Pitch bend */
+	{0xd1, 0x30, 0x00}, /* Channel pressure */
+	{0xa2, 0x3c, 0x20}, /* Poly pressure */
+	{0xc0, 0x05, 0x00}, /* Program change */
+	{0xf8, 0x00, 0x00}, /* Clock */
+};
+
+static uint8_t packets[NUM_EVENTS * 4];
+static uint8_t sysex[NUM_EVENTS];
+static uint8_t transfer[TRANSFER_SIZE];
+static uint32_t transfer_size;
+static struct usb_midi_cable_state_t cable_states[16];
+/* Keeps the callbacks from being optimized away */
+static volatile uint32_t num_parsed_bytes;
+
+static void message_cb(uint8_t *bytes, uint8_t num_bytes, uint8_t cable_num)
+{
+	num_parsed_bytes += num_bytes;
+}
+
+static void sysex_start_cb(uint8_t cable_num)
+{
+	num_parsed_bytes++;
+}
+
+static void sysex_data_cb(uint8_t *data_bytes, uint8_t num_data_bytes, uint8_t cable_num)
+{
+	num_parsed_bytes += num_data_bytes;
+}
+
+static void sysex_end_cb(uint8_t cable_num)
+{
+	num_parsed_bytes++;
+}
+
+static struct usb_midi_parse_cb_t parse_cb = {
+	.message_cb = message_cb,
+	.sysex_start_cb = sysex_start_cb,
+	.sysex_data_cb = sysex_data_cb,
+	.sysex_end_cb = sysex_end_cb,
+	.cable_states = cable_states,
+	.num_cable_states = ARRAY_SIZE(cable_states),
+};
+
+static inline uint32_t cycles_now()
+{
+#ifdef CONFIG_CORTEX_M_DWT
+	return DWT->CYCCNT;
+#else
+	return k_cycle_get_32();
+#endif
+}
+
+static void cycles_init()
+{
+#ifdef CONFIG_CORTEX_M_DWT
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+}
+
+/* Runs fn a few times and prints the lowest cycle count of a run. */
+static void bench(const char *name, void (*fn)(void))
+{
+	uint32_t min_cycles = UINT32_MAX;
+	for (int i = 0; i < NUM_RUNS; i++) {
+		uint32_t start = cycles_now();
+		fn();
+		min_cycles = MIN(min_cycles, cycles_now() - start);
+	}
+	uint32_t hundredths = (uint64_t)min_cycles * 100 / NUM_EVENTS;
+	printk("usb_midi_cycles %s events=%u cycles=%u per_event=%u.%02u\n", name, NUM_EVENTS,
+	       min_cycles, hundredths / 100, hundredths % 100);
+}
+
+static void packet_from_midi_bytes()
+{
+	struct usb_midi_packet_t packet;
+	for (int i = 0; i < NUM_EVENTS; i++) {
+		usb_midi_packet_from_midi_bytes((uint8_t *)channel_msgs[i % ARRAY_SIZE(channel_msgs)],
+						i % 16, &packet);
+		/* Keep the packet from being optimized away */
+		num_parsed_bytes += packet.num_midi_bytes;
+	}
+}
+
+static void parse_packet()
+{
+	for (int i = 0; i < NUM_EVENTS; i++) {
+		usb_midi_parse_packet(&packets[4 * i], &parse_cb);
+	}
+}
+
+static void parse_transfer()
+{
+	for (int i = 0; i < NUM_EVENTS * 4; i += TRANSFER_SIZE) {
+		usb_midi_parse_transfer(&packets[i], TRANSFER_SIZE, &parse_cb);
+	}
+}
+
+/*
+ * Builds packets and appends them to a transfer buffer. This is only the
+ * packet code of usb_midi_tx_buffer_add, without its locking, tokens,
+ * coalescing or rate limiting: the driver needs a USB device controller,
+ * which QEMU does not emulate.
+ */
+static void packet_append()
+{
+	struct usb_midi_packet_t packet;
+	for (int i = 0; i < NUM_EVENTS; i++) {
+		usb_midi_packet_from_midi_bytes((uint8_t *)channel_msgs[i % ARRAY_SIZE(channel_msgs)],
+						i % 16, &packet);
+		if (transfer_size == TRANSFER_SIZE) {
+			transfer_size = 0;
+		}
+		for (int j = 0; j < 4; j++) {
+			transfer[transfer_size++] = packet.bytes[j];
+		}
+	}
+}
+
+/* Encodes a sysex message one transfer at a time. Events are sysex bytes. */
+static void packets_from_sysex()
+{
+	uint32_t num_encoded_bytes = 0;
+	while (num_encoded_bytes < NUM_EVENTS) {
+		uint32_t num_packets;
+		num_encoded_bytes += usb_midi_packets_from_sysex(
+			&sysex[num_encoded_bytes], NUM_EVENTS - num_encoded_bytes, 0, transfer,
+			TRANSFER_SIZE / 4, &num_packets);
+	}
+}
+
+static void fill_channel_packets()
+{
+	struct usb_midi_packet_t packet;
+	for (int i = 0; i < NUM_EVENTS; i++) {
+		usb_midi_packet_from_midi_bytes((uint8_t *)channel_msgs[i % ARRAY_SIZE(channel_msgs)],
+						i % 16, &packet);
+		memcpy(&packets[4 * i], packet.bytes, 4);
+	}
+}
+
+/* Fills the packets with one sysex message. Events are packets, three sysex bytes each. */
+static void fill_sysex_packets()
+{
+	uint32_t num_packets;
+	uint32_t num_bytes = 3 * NUM_EVENTS;
+	uint32_t num_encoded_bytes = 0;
+	uint8_t chunk[3 * TRANSFER_SIZE];
+	uint32_t pos = 0;
+	while (num_encoded_bytes < num_bytes) {
+		uint32_t num_chunk_bytes = MIN(sizeof(chunk), num_bytes - num_encoded_bytes);
+		for (int i = 0; i < num_chunk_bytes; i++) {
+			uint32_t idx = num_encoded_bytes + i;
+			chunk[i] = idx == 0 ? 0xf0 : idx == num_bytes - 1 ? 0xf7 : idx & 0x7f;
+		}
+		num_encoded_bytes += usb_midi_packets_from_sysex(chunk, num_chunk_bytes, 0,
+								 &packets[pos], NUM_EVENTS - pos / 4,
+								 &num_packets);
+		pos += 4 * num_packets;
+	}
+	zassert_equal(pos, sizeof(packets), "Unexpected number of sysex packets");
+}
+
+static void *setup(void)
+{
+	cycles_init();
+	sysex[0] = 0xf0;
+	for (int i = 1; i < NUM_EVENTS - 1; i++) {
+		sysex[i] = i & 0x7f;
+	}
+	sysex[NUM_EVENTS - 1] = 0xf7;
+	return NULL;
+}
+
+static void before(void *fixture)
+{
+	memset(cable_states, 0, sizeof(cable_states));
+	transfer_size = 0;
+}
+
+ZTEST(usb_midi_cycles, test_packet_from_midi_bytes)
+{
+	bench("packet_from_midi_bytes", packet_from_midi_bytes);
+}
+
+ZTEST(usb_midi_cycles, test_parse_channel_packets)
+{
+	fill_channel_packets();
+	bench("parse_packet_channel", parse_packet);
+	bench("parse_transfer_channel", parse_transfer);
+	zassert_true(num_parsed_bytes > 0, "No messages parsed");
+}
+
+ZTEST(usb_midi_cycles, test_parse_sysex_packets)
+{
+	fill_sysex_packets();
+	/* Each run parses the same message, which starts and ends it */
+	bench("parse_packet_sysex", parse_packet);
+	bench("parse_transfer_sysex", parse_transfer);
+}
+
+ZTEST(usb_midi_cycles, test_packet_append)
+{
+	bench("packet_append", packet_append);
+	bench("packets_from_sysex", packets_from_sysex);
+}
+
+ZTEST_SUITE(usb_midi_cycles, NULL, setup, before, NULL, NULL);
@@ -0,0 +1,178 @@
+/*
+ * Runs the DIN bridge against the UART emulator. Data from the host is
+ * passed to the bridge the way the driver does for a received transfer,
+ * and data for the host is recorded by wrapping the driver functions the
+ * bridge enqueues it with (see CMakeLists.txt).
+ */
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/serial/uart_emul.h>
+#include <zephyr/ztest.h>
+#include <usb_midi/usb_midi.h>
+#include "usb_midi_din.h"
+
+#define DIN_CABLE 0
+/* Long enough for the emulator to move the data and the receive timeout to expire */
+#define SETTLE_MS 20
+
+static const struct device *uart = DEVICE_DT_GET(DT_NODELABEL(euart0));
+
+/* Data enqueued for the host */
+static uint8_t usb_bytes[128];
+static uint32_t num_usb_bytes;
+static uint32_t num_usb_sends;
+
+int __wrap_usb_midi_tx_buffer_add(uint8_t cable_number, uint8_t *midi_bytes)
+{
+	zassert_equal(cable_number, DIN_CABLE, "Unexpected cable");
+	uint8_t num_bytes = 3;
+	if (midi_bytes[0] >= 0xf8 || midi_bytes[0] == 0xf6) {
+		num_bytes = 1;
+	} else if ((midi_bytes[0] & 0xe0) == 0xc0 || midi_bytes[0] == 0xf1 ||
+		   midi_bytes[0] == 0xf3) {
+		num_bytes = 2;
+	}
+	memcpy(&usb_bytes[num_usb_bytes], midi_bytes, num_bytes);
+	num_usb_bytes += num_bytes;
+	return 0;
+}
+
+int __wrap_usb_midi_tx_buffer_add_sysex(uint8_t cable_number, const uint8_t *sysex_bytes,
+					uint32_t num_bytes)
+{
+	zassert_equal(cable_number, DIN_CABLE, "Unexpected cable");
+	zassert_true(num_bytes == 3 || sysex_bytes[num_bytes - 1] == 0xf7,
+		     "Sysex should be enqueued in full packets");
+	memcpy(&usb_bytes[num_usb_bytes], sysex_bytes, num_bytes);
+	num_usb_bytes += num_bytes;
+	return num_bytes;
+}
+
+int __wrap_usb_midi_tx_buffer_send(void)
+{
+	num_usb_sends++;
+	return 0;
+}
+
+/* A transfer from the host, as passed to the bridge by the driver */
+static void host_send(const uint32_t *words, uint32_t num_words)
+{
+	uint8_t transfer[64];
+	for (int i = 0; i < num_words; i++) {
+		transfer[4 * i] = words[i] >> 24;
+		transfer[4 * i + 1] = words[i] >> 16;
+		transfer[4 * i + 2] = words[i] >> 8;
+		transfer[4 * i + 3] = words[i];
+	}
+	usb_midi_din_rx_transfer(transfer, 4 * num_words);
+}
+
+static void before(void *fixture)
+{
+	num_usb_bytes = 0;
+	num_usb_sends = 0;
+	k_msleep(SETTLE_MS);
+	uart_emul_flush_tx_data(uart);
+	usb_midi_din_stats_reset(DIN_CABLE);
+}
+
+ZTEST(usb_midi_din, test_host_to_din)
+{
+	/* Packets as header, MIDI bytes */
+	const uint32_t words[] = {
+		0x09903c64, /* Note on */
+		0x09903e40, /* Note on, same status */
+		0x0ff80000, /* Clock, keeps running status */
+		0x0990407f, /* Note on, same status */
+		0x19903c64, /* Cable 1 is not bridged */
+		0x04f00102, /* Sysex start */
+		0x05f70000, /* Sysex end, cancels running status */
+		0x09903c00, /* Note on */
+		0x00000000, /* Padding */
+	};
+	host_send(words, ARRAY_SIZE(words));
+	k_msleep(SETTLE_MS);
+
+	const uint8_t expected_running_status[] = {0x90, 0x3c, 0x64, 0x3e, 0x40, 0xf8, 0x40, 0x7f,
+						   0xf0, 0x01, 0x02, 0xf7, 0x90, 0x3c, 0x00};
+	const uint8_t expected_all_status[] = {0x90, 0x3c, 0x64, 0x90, 0x3e, 0x40, 0xf8, 0x90,
+					       0x40, 0x7f, 0xf0, 0x01, 0x02, 0xf7, 0x90, 0x3c,
+					       0x00};
+	const uint8_t *expected = IS_ENABLED(CONFIG_USB_MIDI_DIN_TX_RUNNING_STATUS)
+					  ? expected_running_status
+					  : expected_all_status;
+	uint32_t num_expected = IS_ENABLED(CONFIG_USB_MIDI_DIN_TX_RUNNING_STATUS)
+					? sizeof(expected_running_status)
+					: sizeof(expected_all_status);
+
+	uint8_t din_bytes[64];
+	uint32_t num_din_bytes = uart_emul_get_tx_data(uart, din_bytes, sizeof(din_bytes));
+	zassert_equal(num_din_bytes, num_expected, "Unexpected number of bytes sent to DIN");
+	zassert_mem_equal(din_bytes, expected, num_expected, "Unexpected bytes sent to DIN");
+
+	struct usb_midi_din_stats stats;
+	zassert_ok(usb_midi_din_stats_get(DIN_CABLE, &stats));
+	zassert_equal(stats.num_tx_bytes, num_expected, "Sent bytes should be counted");
+	zassert_equal(stats.num_running_status_bytes,
+		      IS_ENABLED(CONFIG_USB_MIDI_DIN_TX_RUNNING_STATUS) ? 2 : 0,
+		      "Left out status bytes should be counted");
+	zassert_equal(stats.num_tx_dropped, 0, "No bytes should be dropped");
+}
+
+ZTEST(usb_midi_din, test_host_to_din_full)
+{
+	/* Note ons on alternating channels, so that no status byte is left out */
+	uint32_t words[16];
+	for (int i = 0; i < ARRAY_SIZE(words); i++) {
+		words[i] = 0x09903c64 | ((i & 1) << 16) | (i << 8);
+	}
+	host_send(words, ARRAY_SIZE(words));
+	k_msleep(SETTLE_MS);
+
+	/* The messages that fit in the buffer are sent, the rest are dropped whole. */
+	uint32_t num_fit = CONFIG_USB_MIDI_DIN_TX_BUF_SIZE / 3;
+	uint8_t din_bytes[64];
+	uint32_t num_din_bytes = uart_emul_get_tx_data(uart, din_bytes, sizeof(din_bytes));
+	zassert_equal(num_din_bytes, 3 * num_fit, "Only whole messages should be sent to DIN");
+	for (int i = 0; i < num_fit; i++) {
+		zassert_equal(din_bytes[3 * i], 0x90 | (i & 1), "Unexpected status byte");
+		zassert_equal(din_bytes[3 * i + 1], 0x3c + i, "Unexpected note");
+	}
+
+	struct usb_midi_din_stats stats;
+	zassert_ok(usb_midi_din_stats_get(DIN_CABLE, &stats));
+	zassert_equal(stats.num_tx_dropped, 3 * (ARRAY_SIZE(words) - num_fit),
+		      "Dropped bytes should be counted");
+}
+
+ZTEST(usb_midi_din, test_din_to_host)
+{
+	const uint8_t din_bytes[] = {
+		0x90, 0x3c, 0x64, 0x3e, 0x40,		    /* Note on, then running status */
+		0xf0, 0x01, 0x02, 0xf8, 0x03, 0x04, 0xf7, /* Sysex with a clock in it */
+		0xb0, 0x07, 0x7f, 0xc1, 0x05,		    /* Control and program change */
+	};
+	uart_emul_put_rx_data(uart, din_bytes, sizeof(din_bytes));
+	k_msleep(SETTLE_MS);
+
+	const uint8_t expected[] = {0x90, 0x3c, 0x64, 0x90, 0x3e, 0x40, 0xf0, 0x01, 0x02, 0xf8,
+				    0x03, 0x04, 0xf7, 0xb0, 0x07, 0x7f, 0xc1, 0x05};
+	zassert_equal(num_usb_bytes, sizeof(expected), "Unexpected number of bytes for the host");
+	zassert_mem_equal(usb_bytes, expected, sizeof(expected), "Unexpected bytes for the host");
+	zassert_true(num_usb_sends > 0, "Enqueued data should be sent");
+
+	struct usb_midi_din_stats stats;
+	zassert_ok(usb_midi_din_stats_get(DIN_CABLE, &stats));
+	zassert_equal(stats.num_rx_bytes, sizeof(din_bytes), "Received bytes should be counted");
+	zassert_equal(stats.num_rx_dropped, 0, "No messages should be dropped");
+}
+
+ZTEST(usb_midi_din, test_stats_of_unbridged_cable)
+{
+	struct usb_midi_din_stats stats;
+	zassert_equal(usb_midi_din_stats_get(1, &stats), -EINVAL, "Cable 1 is not bridged");
+	zassert_equal(usb_midi_din_stats_reset(1), -EINVAL, "Cable 1 is not bridged");
+}
+
+ZTEST_SUITE(usb_midi_din, NULL, NULL, before, NULL, NULL);
@@ -0,0 +1,2 @@
+# Regenerate the corpus with: gcc usb_midi_corpus_gen.c -o corpus_gen && ./corpus_gen corpus
+gcc -O2 usb_midi_parse_bench.c ../usb_midi/src/usb_midi_packet.c; ./a.out corpus/*.bin
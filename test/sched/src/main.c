@@ -0,0 +1,107 @@
+/*
+ * Runs the TX scheduler against the kernel timer on native_sim. Messages are
+ * recorded by wrapping the driver functions the scheduler enqueues them with
+ * (see CMakeLists.txt), which can also act as a busy endpoint with a full
+ * buffer.
+ */
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+#include <usb_midi/usb_midi.h>
+
+#define CABLE 0
+#define MAX_MESSAGES 32
+
+/* The note numbers of the messages enqueued, in order */
+static uint8_t notes[MAX_MESSAGES];
+static uint32_t num_notes;
+static uint32_t num_sends;
+/* The number of calls to reject as full */
+static uint32_t num_full_adds;
+
+int __wrap_usb_midi_tx_buffer_add(uint8_t cable_number, uint8_t *midi_bytes)
+{
+	zassert_equal(cable_number, CABLE, "Unexpected cable");
+	if (num_full_adds > 0) {
+		num_full_adds--;
+		return -1;
+	}
+	zassert_true(num_notes < MAX_MESSAGES, "Too many messages");
+	notes[num_notes++] = midi_bytes[1];
+	return 0;
+}
+
+int __wrap_usb_midi_tx_buffer_send(void)
+{
+	num_sends++;
+	return 0;
+}
+
+static uint64_t ms_from_now(uint32_t ms)
+{
+	return k_cycle_get_64() + k_ms_to_cyc_ceil64(ms);
+}
+
+static void before(void *fixture)
+{
+	usb_midi_tx_at_clear();
+	num_notes = 0;
+	num_sends = 0;
+	num_full_adds = 0;
+}
+
+ZTEST(usb_midi_sched, test_deadline_order)
+{
+	/* Scheduled in reverse, two messages per deadline */
+	uint64_t start = ms_from_now(10);
+	for (int i = 15; i >= 0; i--) {
+		uint8_t midi_bytes[3] = {0x90, i, 100};
+		zassert_ok(usb_midi_tx_at(CABLE, midi_bytes, start + (i / 2) * k_ms_to_cyc_ceil64(1)));
+	}
+	k_msleep(30);
+
+	/* Ties are sent in the order they were scheduled, i.e odd first */
+	zassert_equal(num_notes, 16, "Expected all messages");
+	for (int i = 0; i < 16; i++) {
+		zassert_equal(notes[i], i ^ 1, "Unexpected order at %d", i);
+	}
+	zassert_true(num_sends > 0, "Enqueued messages should be sent");
+}
+
+ZTEST(usb_midi_sched, test_busy_retry)
+{
+	/* Rejects the first add, the add after the send and the first add on the next tick */
+	num_full_adds = 3;
+	/* All due at once, with the endpoint busy for a while */
+	uint64_t deadline = ms_from_now(5);
+	for (int i = 0; i < 12; i++) {
+		uint8_t midi_bytes[3] = {0x90, i, 100};
+		zassert_ok(usb_midi_tx_at(CABLE, midi_bytes, deadline));
+	}
+	k_msleep(30);
+
+	zassert_equal(num_full_adds, 0, "Adds should be retried");
+	zassert_equal(num_notes, 12, "Expected all messages");
+	for (int i = 0; i < 12; i++) {
+		zassert_equal(notes[i], i, "Messages put back should keep their order");
+	}
+}
+
+ZTEST(usb_midi_sched, test_invalid_and_full)
+{
+	zassert_equal(usb_midi_tx_at(CABLE, (uint8_t[]){0x12, 1, 2}, 0), -EINVAL, "Data byte");
+	zassert_equal(usb_midi_tx_at(CABLE, (uint8_t[]){0xf0, 1, 2}, 0), -EINVAL, "Sysex start");
+	zassert_equal(usb_midi_tx_at(CABLE, (uint8_t[]){0xf7, 0, 0}, 0), -EINVAL, "Sysex end");
+
+	uint64_t deadline = ms_from_now(20);
+	for (int i = 0; i < CONFIG_USB_MIDI_TX_SCHED_SIZE; i++) {
+		zassert_ok(usb_midi_tx_at(CABLE, (uint8_t[]){0x80, i, 0}, deadline));
+	}
+	zassert_equal(usb_midi_tx_at(CABLE, (uint8_t[]){0x80, 0, 0}, deadline), -ENOMEM,
+		      "The heap should be full");
+	usb_midi_tx_at_clear();
+	k_msleep(30);
+	zassert_equal(num_notes, 0, "Cleared messages should not be sent");
+}
+
+ZTEST_SUITE(usb_midi_sched, NULL, NULL, before, NULL, NULL);
@@ -0,0 +1,444 @@
+/*
+ * Runs the coalescing of enqueued messages, the rate limiter, the retries
+ * of failed IN transfers and raw packets on native_sim.
+ * IN transfers are recorded by wrapping the device controller function the
+ * driver sends them with (see CMakeLists.txt), and are completed by calling
+ * the endpoint callback of the driver, as the USB stack does. OUT transfers
+ * are received the same way.
+ */
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/iterable_sections.h>
+#include <zephyr/usb/usb_device.h>
+#include <zephyr/ztest.h>
+#include <usb_midi/usb_midi.h>
+
+#define CABLE 0
+#define MAX_WRITES 16
+/* The rate limit used by the tests, 10 ms per 3 byte message */
+#define BYTES_PER_S 300
+#define MS_PER_MESSAGE 10
+
+static struct usb_cfg_data *midi_cfg;
+
+/* IN transfers sent */
+static uint8_t written[MAX_WRITES][64];
+static uint32_t written_sizes[MAX_WRITES];
+static int64_t written_ticks[MAX_WRITES];
+static uint32_t num_writes;
+/* Bit n is set if IN endpoint n has a transfer in flight */
+static uint32_t busy_eps;
+/* The number of transfers to fail like a controller error */
+static int num_failing_writes;
+/* Non-zero to complete every transfer right after it is sent */
+static int auto_complete;
+
+static void complete_in(void);
+static void complete_work_handler(struct k_work *work)
+{
+	complete_in();
+}
+static K_WORK_DEFINE(complete_work, complete_work_handler);
+
+int __wrap_usb_write(uint8_t ep, const uint8_t *data, uint32_t data_len, uint32_t *bytes_ret)
+{
+	if (busy_eps & BIT(USB_EP_GET_IDX(ep))) {
+		return -EAGAIN;
+	}
+	if (num_failing_writes > 0) {
+		num_failing_writes--;
+		return -EIO;
+	}
+	zassert_true(num_writes < MAX_WRITES, "Too many transfers");
+	memcpy(written[num_writes], data, data_len);
+	written_sizes[num_writes] = data_len;
+	written_ticks[num_writes] = k_uptime_ticks();
+	num_writes++;
+	busy_eps |= BIT(USB_EP_GET_IDX(ep));
+	if (bytes_ret) {
+		*bytes_ret = data_len;
+	}
+	if (auto_complete) {
+		k_work_submit(&complete_work);
+	}
+	return 0;
+}
+
+int __wrap_usb_dc_ep_mps(uint8_t ep)
+{
+	return 64;
+}
+
+/* The OUT transfer to receive */
+static const uint8_t *out_transfer;
+static uint32_t out_transfer_size;
+
+int __wrap_usb_read(uint8_t ep, uint8_t *data, uint32_t max_data_len, uint32_t *read_bytes)
+{
+	zassert_true(out_transfer_size <= max_data_len, "Transfer too large");
+	memcpy(data, out_transfer, out_transfer_size);
+	*read_bytes = out_transfer_size;
+	return 0;
+}
+
+/* Receives an OUT transfer, as the USB stack does from the controller interrupt */
+static void receive_out(const uint8_t *bytes, uint32_t num_bytes)
+{
+	out_transfer = bytes;
+	out_transfer_size = num_bytes;
+	for (int i = 0; i < midi_cfg->num_endpoints; i++) {
+		uint8_t ep = midi_cfg->endpoint[i].ep_addr;
+		if (!USB_EP_DIR_IS_IN(ep)) {
+			midi_cfg->endpoint[i].ep_cb(ep, USB_DC_EP_DATA_OUT);
+			return;
+		}
+	}
+	zassert_unreachable("No OUT endpoint");
+}
+
+/* Completes the transfers in flight, as the USB stack does from the controller interrupt */
+static void complete_in(void)
+{
+	for (int i = 0; i < midi_cfg->num_endpoints; i++) {
+		uint8_t ep = midi_cfg->endpoint[i].ep_addr;
+		if (USB_EP_DIR_IS_IN(ep) && (busy_eps & BIT(USB_EP_GET_IDX(ep)))) {
+			busy_eps &= ~BIT(USB_EP_GET_IDX(ep));
+			midi_cfg->endpoint[i].ep_cb(ep, USB_DC_EP_DATA_IN);
+		}
+	}
+}
+
+static int num_token_calls;
+static uint32_t token_num_bytes;
+static int token_status;
+
+static void token_cb(struct usb_midi_tx_token *token, uint32_t num_bytes, int status)
+{
+	num_token_calls++;
+	token_num_bytes = num_bytes;
+	token_status = status;
+}
+
+static void *setup(void)
+{
+	/* The driver is the only class */
+	STRUCT_SECTION_FOREACH(usb_cfg_data, cfg) {
+		midi_cfg = cfg;
+	}
+	zassert_not_null(midi_cfg, "No USB MIDI config data");
+	return NULL;
+}
+
+static void before(void *fixture)
+{
+	/* Drops everything enqueued or held by the previous test */
+	auto_complete = 0;
+	midi_cfg->cb_usb_status(midi_cfg, USB_DC_RESET, NULL);
+	k_msleep(1);
+	zassert_ok(usb_midi_tx_rate_limit_set(CABLE, 0, 0));
+	zassert_ok(usb_midi_tx_rate_limit_stats_reset(CABLE));
+	usb_midi_recovery_stats_reset();
+	busy_eps = 0;
+	num_failing_writes = 0;
+	num_writes = 0;
+	num_token_calls = 0;
+	midi_cfg->cb_usb_status(midi_cfg, USB_DC_CONFIGURED, NULL);
+}
+
+/* Keeps the endpoint busy with a transfer, so that the next messages are enqueued */
+static void make_busy(void)
+{
+	zassert_ok(usb_midi_tx_buffer_add(CABLE, (uint8_t[]){0x90, 0x3c, 0x64}));
+	usb_midi_tx_buffer_send();
+	zassert_equal(num_writes, 1, "Expected a transfer");
+}
+
+/************************ Coalescing ************************/
+
+ZTEST(usb_midi_tx, test_coalesce_replaces_in_place)
+{
+	struct usb_midi_tx_token token = {.cb = token_cb};
+	make_busy();
+	zassert_ok(usb_midi_tx_buffer_add(CABLE, (uint8_t[]){0xb0, 7, 1}));
+	zassert_ok(usb_midi_tx_buffer_add(CABLE, (uint8_t[]){0x90, 0x3d, 0x64}));
+	/* Goes ahead of the enqueued messages, which moves them */
+	zassert_ok(usb_midi_tx_priority(CABLE, (uint8_t[]){0xf8, 0, 0}));
+	zassert_ok(usb_midi_tx_buffer_add(CABLE, (uint8_t[]){0xb0, 7, 2}));
+	zassert_ok(usb_midi_tx_buffer_add(CABLE, (uint8_t[]){0xe0, 0, 0x10}));
+	/* Bank select values form a sequence */
+	zassert_ok(usb_midi_tx_buffer_add(CABLE, (uint8_t[]){0xb0, 0, 1}));
+	zassert_ok(usb_midi_tx_buffer_add(CABLE, (uint8_t[]){0xb0, 0, 2}));
+	zassert_ok(usb_midi_tx_buffer_add(CABLE, (uint8_t[]){0xe0, 0, 0x20}));
+	/* A message enqueued with a token is sent as is */
+	zassert_ok(usb_midi_tx_buffer_add_with_token(CABLE, (uint8_t[]){0xb0, 10, 1}, &token));
+	zassert_ok(usb_midi_tx_buffer_add(CABLE, (uint8_t[]){0xb0, 10, 2}));
+	zassert_ok(usb_midi_tx_buffer_add(CABLE, (uint8_t[]){0xb0, 10, 3}));
+	usb_midi_tx_buffer_send();
+	complete_in();
+
+	const uint8_t expected[] = {
+		0x0f, 0xf8, 0x00, 0x00, /* Priority */
+		0x0b, 0xb0, 0x07, 0x02, /* Replaced, keeps its place */
+		0x09, 0x90, 0x3d, 0x64,
+		0x0e, 0xe0, 0x00, 0x20, /* Replaced twice */
+		0x0b, 0xb0, 0x00, 0x01,
+		0x0b, 0xb0, 0x00, 0x02,
+		0x0b, 0xb0, 0x0a, 0x01, /* With the token */
+		0x0b, 0xb0, 0x0a, 0x03,
+	};
+	zassert_equal(num_writes, 2, "Expected a second transfer");
+	zassert_equal(written_sizes[1], sizeof(expected), "Unexpected transfer size");
+	zassert_mem_equal(written[1], expected, sizeof(expected), "Unexpected transfer");
+	complete_in();
+	zassert_equal(num_token_calls, 1, "The token should be reported");
+}
+
+ZTEST(usb_midi_tx, test_coalesce_keys)
+{
+	/*
+	 * Slots are shared by keys with the same hash. Whichever keys collide,
+	 * each key must end up with its latest value, in the place of its first
+	 * message, and never overwrite the message of another key.
+	 */
+	make_busy();
+	for (int value = 1; value <= 2; value++) {
+		for (int controller = 1; controller <= 8; controller++) {
+			uint8_t midi_bytes[3] = {0xb1, controller, value};
+			zassert_ok(usb_midi_tx_buffer_add(CABLE, midi_bytes));
+		}
+	}
+	usb_midi_tx_buffer_send();
+	complete_in();
+
+	zassert_equal(num_writes, 2, "Expected a second transfer");
+	uint32_t num_packets = written_sizes[1] / 4;
+	zassert_true(num_packets >= 8 && num_packets < 16, "Expected coalesced messages");
+	int last_first = -1;
+	for (int controller = 1; controller <= 8; controller++) {
+		int first = -1;
+		int last = -1;
+		for (int i = 0; i < num_packets; i++) {
+			const uint8_t *packet = &written[1][4 * i];
+			zassert_equal(packet[1], 0xb1, "Unexpected message");
+			if (packet[2] == controller) {
+				first = first < 0 ? i : first;
+				last = i;
+			}
+		}
+		zassert_true(first > last_first, "Controller %d lost its place", controller);
+		zassert_equal(written[1][4 * last + 3], 2, "Controller %d lost its latest value",
+			      controller);
+		last_first = first;
+	}
+}
+
+/************************ Rate limiting ************************/
+
+ZTEST(usb_midi_tx, test_rate_limit_order_and_refill)
+{
+	auto_complete = 1;
+	zassert_ok(usb_midi_tx_rate_limit_set(CABLE, BYTES_PER_S, 3));
+	int64_t start_ticks = k_uptime_ticks();
+	/* One message fits the burst, the next ones fill the hold ring */
+	for (int i = 0; i < 1 + CONFIG_USB_MIDI_TX_RATE_LIMIT_HOLD_SIZE; i++) {
+		uint8_t midi_bytes[3] = {0x90, i, 0x64};
+		zassert_ok(usb_midi_tx_buffer_add(CABLE, midi_bytes));
+		usb_midi_tx_buffer_send();
+	}
+	zassert_equal(usb_midi_tx_buffer_add(CABLE, (uint8_t[]){0x90, 0x7f, 0x64}), -ENOMEM,
+		      "The hold ring should be full");
+	/* Wraps around the ring once 2 held messages have been sent */
+	k_msleep(2 * MS_PER_MESSAGE + MS_PER_MESSAGE / 2);
+	int num_messages = 1 + CONFIG_USB_MIDI_TX_RATE_LIMIT_HOLD_SIZE;
+	for (int i = 0; i < 2; i++, num_messages++) {
+		uint8_t midi_bytes[3] = {0x90, num_messages, 0x64};
+		zassert_ok(usb_midi_tx_buffer_add(CABLE, midi_bytes));
+	}
+	k_msleep(num_messages * MS_PER_MESSAGE);
+
+	/* Held messages are sent in order, one per refill of the bucket */
+	zassert_equal(num_writes, num_messages, "Expected every message in its own transfer");
+	k_ticks_t period_ticks = k_ms_to_ticks_ceil32(MS_PER_MESSAGE);
+	for (int i = 0; i < num_messages; i++) {
+		zassert_equal(written_sizes[i], 4, "Unexpected transfer size");
+		zassert_equal(written[i][2], i, "Unexpected message order");
+		zassert_within(written_ticks[i] - start_ticks, i * period_ticks, 2,
+			       "Message %d not sent when its tokens were available", i);
+	}
+
+	struct usb_midi_rate_limit_stats stats;
+	zassert_ok(usb_midi_tx_rate_limit_stats_get(CABLE, &stats));
+	zassert_equal(stats.num_held, num_messages - 1, "Unexpected number of held messages");
+	zassert_equal(stats.max_held, CONFIG_USB_MIDI_TX_RATE_LIMIT_HOLD_SIZE,
+		      "Unexpected max number of held messages");
+	zassert_equal(stats.num_rejected, 1, "Unexpected number of rejected messages");
+	zassert_equal(stats.num_currently_held, 0, "Every message should be sent");
+}
+
+ZTEST(usb_midi_tx, test_rate_limit_discard)
+{
+	struct usb_midi_tx_token token = {.cb = token_cb};
+	zassert_ok(usb_midi_tx_rate_limit_set(CABLE, BYTES_PER_S, 3));
+	zassert_ok(usb_midi_tx_buffer_add(CABLE, (uint8_t[]){0x90, 0x3c, 0x64}));
+	zassert_ok(usb_midi_tx_buffer_add_with_token(CABLE, (uint8_t[]){0x90, 0x3d, 0x64}, &token));
+
+	/* A reset drops the held message and reports its USB bytes to the token */
+	midi_cfg->cb_usb_status(midi_cfg, USB_DC_RESET, NULL);
+	zassert_equal(num_token_calls, 1, "The token should be reported");
+	zassert_equal(token_num_bytes, 4, "Unexpected number of bytes");
+	zassert_equal(token_status, -ECONNRESET, "Unexpected status");
+
+	struct usb_midi_rate_limit_stats stats;
+	zassert_ok(usb_midi_tx_rate_limit_stats_get(CABLE, &stats));
+	zassert_equal(stats.num_currently_held, 0, "The held message should be dropped");
+}
+
+ZTEST(usb_midi_tx, test_rate_limit_invalid)
+{
+	zassert_equal(usb_midi_tx_rate_limit_set(CONFIG_USB_MIDI_NUM_OUTPUTS, BYTES_PER_S, 3),
+		      -EINVAL, "Invalid cable");
+	zassert_equal(usb_midi_tx_rate_limit_set(CABLE, BYTES_PER_S, 2), -EINVAL,
+		      "A burst must fit the longest message");
+}
+
+/************************ Retries ************************/
+
+ZTEST(usb_midi_tx, test_retry_backoff_per_pair)
+{
+	int64_t start_ticks = k_uptime_ticks();
+	/* The pair of cable 0 fails 3 times, the last retry is due 1 + 2 + 4 ms after the start */
+	num_failing_writes = 3;
+	zassert_ok(usb_midi_tx_buffer_add(CABLE, (uint8_t[]){0x90, 0x3c, 0x64}));
+	usb_midi_tx_buffer_send();
+	k_msleep(4);
+	zassert_equal(num_failing_writes, 0, "Expected 2 retries");
+	zassert_equal(num_writes, 0, "The data should wait for its backoff");
+
+	/* The secondary pair fails once, its retry is due 1 ms later */
+	num_failing_writes = 1;
+	zassert_ok(usb_midi_tx_buffer_add(1, (uint8_t[]){0x90, 0x3d, 0x64}));
+	usb_midi_tx_buffer_send();
+	k_msleep(10);
+
+	/* Each pair is retried when its own backoff has passed */
+	zassert_equal(num_writes, 2, "Expected both transfers");
+	zassert_equal(written[0][0], 0x19, "The secondary pair should be retried first");
+	zassert_equal(written[1][0], 0x09, "Unexpected transfer");
+	zassert_true(written_ticks[1] - start_ticks >= k_ms_to_ticks_floor64(7),
+		     "A pair should not be retried before its backoff has passed");
+
+	struct usb_midi_recovery_stats stats;
+	usb_midi_recovery_stats_get(&stats);
+	zassert_equal(stats.num_tx_retries, 4, "Unexpected number of retries");
+	zassert_equal(stats.num_tx_failures, 0, "No transfer should be dropped");
+}
+
+ZTEST(usb_midi_tx, test_retry_drop)
+{
+	struct usb_midi_tx_token token = {.cb = token_cb};
+	num_failing_writes = 1000;
+	zassert_ok(usb_midi_tx_buffer_add_with_token(CABLE, (uint8_t[]){0x90, 0x3c, 0x64}, &token));
+	usb_midi_tx_buffer_send();
+	/* Long enough for all backoffs, which double from 1 ms */
+	k_msleep((1 << CONFIG_USB_MIDI_TX_RETRIES) + 10);
+
+	zassert_equal(num_token_calls, 1, "The token should be reported");
+	zassert_equal(token_status, -EIO, "The token should get the error");
+	struct usb_midi_recovery_stats stats;
+	usb_midi_recovery_stats_get(&stats);
+	zassert_equal(stats.num_tx_retries, CONFIG_USB_MIDI_TX_RETRIES, "Unexpected number of retries");
+	zassert_equal(stats.num_tx_failures, 1, "The transfer should be dropped");
+
+	/* The next transfer goes out right away */
+	num_failing_writes = 0;
+	zassert_ok(usb_midi_tx_buffer_add(CABLE, (uint8_t[]){0x90, 0x3d, 0x64}));
+	zassert_ok(usb_midi_tx_buffer_send());
+	zassert_equal(num_writes, 1, "Expected a transfer");
+}
+
+/************************ Raw packets ************************/
+
+ZTEST(usb_midi_tx, test_tx_packets_own_pair)
+{
+	/* Enqueued on the secondary pair, without sending */
+	zassert_ok(usb_midi_tx_buffer_add(1, (uint8_t[]){0x90, 0x3d, 0x64}));
+
+	uint32_t words[] = {0x643c9009, 0x003c8008};
+	zassert_equal(usb_midi_tx_packets(words, ARRAY_SIZE(words)), 2, "Expected 2 packets");
+	zassert_equal(num_writes, 1, "Only the pair of the packets should be sent");
+	zassert_equal(written_sizes[0], 8, "Unexpected transfer size");
+	zassert_mem_equal(written[0], ((uint8_t[]){0x09, 0x90, 0x3c, 0x64, 0x08, 0x80, 0x3c, 0x00}),
+			  8, "The packets should be sent as they are");
+
+	zassert_ok(usb_midi_tx_buffer_send());
+	zassert_equal(num_writes, 2, "Expected the secondary pair");
+	zassert_equal(written[1][0], 0x19, "Unexpected transfer");
+}
+
+ZTEST(usb_midi_tx, test_tx_packets_busy)
+{
+	uint32_t words[20];
+	for (int i = 0; i < ARRAY_SIZE(words); i++) {
+		words[i] = 0x643c9009;
+	}
+	make_busy();
+	/* Fills the buffer of the busy endpoint, then stops */
+	zassert_equal(usb_midi_tx_packets(words, ARRAY_SIZE(words)), 16, "Expected a full buffer");
+	complete_in();
+	zassert_equal(num_writes, 2, "Expected the buffer to be sent");
+	zassert_equal(written_sizes[1], 64, "Unexpected transfer size");
+}
+
+ZTEST(usb_midi_tx, test_tx_packets_invalid)
+{
+	uint32_t words[] = {0x643c9009, 0x643c9029};
+	zassert_equal(usb_midi_tx_packets(words, ARRAY_SIZE(words)), -EINVAL, "Invalid cable");
+	words[1] = 0x643c9000;
+	zassert_equal(usb_midi_tx_packets(words, ARRAY_SIZE(words)), -EINVAL, "Invalid CIN");
+	zassert_equal(num_writes, 0, "Nothing should be sent");
+}
+
+static int num_raw_calls;
+static uint32_t raw_words[16];
+static uint32_t num_raw_words;
+static int raw_is_handled;
+static int num_messages;
+
+static int rx_raw_cb(const uint32_t *words, uint32_t num_words)
+{
+	num_raw_calls++;
+	memcpy(raw_words, words, 4 * num_words);
+	num_raw_words = num_words;
+	return raw_is_handled;
+}
+
+static void message_cb(uint8_t *bytes, uint8_t num_bytes, uint8_t cable_num)
+{
+	num_messages++;
+}
+
+ZTEST(usb_midi_tx, test_rx_raw)
+{
+	struct usb_midi_cb_t callbacks = {.midi_message_cb = message_cb, .rx_raw_cb = rx_raw_cb};
+	static const uint8_t transfer[] = {0x09, 0x90, 0x3c, 0x64, 0x08, 0x80, 0x3c, 0x00};
+	num_raw_calls = 0;
+	num_messages = 0;
+	usb_midi_register_callbacks(&callbacks);
+
+	raw_is_handled = 0;
+	receive_out(transfer, sizeof(transfer));
+	zassert_equal(num_raw_calls, 1, "Expected the raw callback");
+	zassert_equal(num_raw_words, 2, "Expected 2 packets");
+	zassert_equal(raw_words[0], 0x643c9009, "The header should be the least significant byte");
+	zassert_equal(raw_words[1], 0x003c8008, "Unexpected packet");
+	zassert_equal(num_messages, 2, "An unhandled transfer should be parsed");
+
+	raw_is_handled = 1;
+	receive_out(transfer, sizeof(transfer));
+	zassert_equal(num_raw_calls, 2, "Expected the raw callback");
+	zassert_equal(num_messages, 2, "A handled transfer should not be parsed");
+
+	usb_midi_register_callbacks(&(struct usb_midi_cb_t){0});
+}
+
+ZTEST_SUITE(usb_midi_tx, NULL, setup, before, NULL, NULL);
@@ -0,0 +1,176 @@
+/*
+ * Generates the RX benchmark corpus in test/corpus. Each file is a sequence
+ * of bulk OUT transfers as sent by a host, each stored as a 16 bit little
+ * endian length followed by the transfer bytes.
+ *
+ * Profiles:
+ *
+ * coremidi_sysex - Large sysex messages as sent by CoreMIDI, with single byte
+ *                  CIN 0xf packets every now and then in the middle of the
+ *                  message and timing clock interleaved. Full 64 byte transfers.
+ * windows_padded - Short channel messages, each in its own transfer padded
+ *                  with empty packets to 64 bytes, plus occasional sysex.
+ * mpe_dense      - An MPE controller playing 10 simultaneous notes on member
+ *                  channels 2-16, with per note pitch bend, CC 74 and channel
+ *                  pressure, packed into full 64 byte transfers.
+ *
+ * Usage: gcc usb_midi_corpus_gen.c -o corpus_gen && ./corpus_gen corpus
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#define TRANSFER_SIZE 64
+#define CORPUS_SIZE (16 * 1024)
+
+struct corpus_t {
+    FILE *file;
+    uint32_t num_bytes;
+    uint8_t transfer[TRANSFER_SIZE];
+    uint32_t transfer_size;
+};
+
+static uint32_t rng_state = 12345;
+static uint32_t rng()
+{
+    rng_state = rng_state * 1103515245 + 12345;
+    return (rng_state >> 16) & 0x7fff;
+}
+
+static void flush_transfer(struct corpus_t *corpus, int pad)
+{
+    if (corpus->transfer_size == 0) {
+        return;
+    }
+    if (pad) {
+        memset(&corpus->transfer[corpus->transfer_size], 0, TRANSFER_SIZE - corpus->transfer_size);
+        corpus->transfer_size = TRANSFER_SIZE;
+    }
+    uint8_t header[2] = { corpus->transfer_size & 0xff, corpus->transfer_size >> 8 };
+    fwrite(header, 1, 2, corpus->file);
+    fwrite(corpus->transfer, 1, corpus->transfer_size, corpus->file);
+    corpus->num_bytes += 2 + corpus->transfer_size;
+    corpus->transfer_size = 0;
+}
+
+static void add_packet(struct corpus_t *corpus, uint8_t cable_num, uint8_t cin,
+                       uint8_t b0, uint8_t b1, uint8_t b2)
+{
+    uint8_t *packet = &corpus->transfer[corpus->transfer_size];
+    packet[0] = (cable_num << 4) | cin;
+    packet[1] = b0;
+    packet[2] = b1;
+    packet[3] = b2;
+    corpus->transfer_size += 4;
+    if (corpus->transfer_size == TRANSFER_SIZE) {
+        flush_transfer(corpus, 0);
+    }
+}
+
+/* Adds a sysex message of a given size, optionally with CoreMIDI quirks. */
+static void add_sysex(struct corpus_t *corpus, uint8_t cable_num, int msg_size, int coremidi_quirks)
+{
+    uint8_t bytes[3];
+    int num_bytes = 0;
+    for (int i = 0; i < msg_size; i++) {
+        uint8_t byte = i == 0 ? 0xf0 : (i == msg_size - 1 ? 0xf7 : rng() & 0x7f);
+        if (coremidi_quirks && num_bytes == 0 && i > 0 && i < msg_size - 1 && rng() % 50 == 0) {
+            /* A single data byte */
+            add_packet(corpus, cable_num, 0xf, byte, 0, 0);
+            continue;
+        }
+        if (coremidi_quirks && num_bytes == 0 && rng() % 100 == 0) {
+            /* Timing clock between sysex packets */
+            add_packet(corpus, cable_num, 0xf, 0xf8, 0, 0);
+        }
+        bytes[num_bytes++] = byte;
+        if (byte == 0xf7) {
+            add_packet(corpus, cable_num, 0x4 + num_bytes, bytes[0],
+                       num_bytes > 1 ? bytes[1] : 0, num_bytes > 2 ? bytes[2] : 0);
+            num_bytes = 0;
+        } else if (num_bytes == 3) {
+            add_packet(corpus, cable_num, 0x4, bytes[0], bytes[1], bytes[2]);
+            num_bytes = 0;
+        }
+    }
+}
+
+static void gen_coremidi_sysex(struct corpus_t *corpus)
+{
+    while (corpus->num_bytes < CORPUS_SIZE) {
+        add_sysex(corpus, 0, 256 + rng() % 2048, 1);
+    }
+    flush_transfer(corpus, 0);
+}
+
+static void gen_windows_padded(struct corpus_t *corpus)
+{
+    while (corpus->num_bytes < CORPUS_SIZE) {
+        uint8_t channel = rng() % 16;
+        uint8_t note = 36 + rng() % 48;
+        switch (rng() % 8) {
+        case 0:
+            add_sysex(corpus, 0, 6 + rng() % 64, 0);
+            break;
+        case 1:
+            add_packet(corpus, 0, 0xb, 0xb0 | channel, rng() & 0x7f, rng() & 0x7f);
+            break;
+        case 2:
+            add_packet(corpus, 0, 0xf, 0xf8, 0, 0);
+            break;
+        default:
+            add_packet(corpus, 0, 0x9, 0x90 | channel, note, 1 + rng() % 127);
+            break;
+        }
+        flush_transfer(corpus, 1);
+    }
+}
+
+static void gen_mpe_dense(struct corpus_t *corpus)
+{
+    uint8_t notes[10];
+    for (int i = 0; i < 10; i++) {
+        notes[i] = 48 + i * 3;
+        add_packet(corpus, 0, 0x9, 0x91 + i, notes[i], 100);
+    }
+    while (corpus->num_bytes < CORPUS_SIZE) {
+        for (int i = 0; i < 10; i++) {
+            uint8_t status_channel = 1 + i;
+            uint16_t bend = 8192 + (int)(rng() % 512) - 256;
+            add_packet(corpus, 0, 0xe, 0xe0 | status_channel, bend & 0x7f, bend >> 7);
+            add_packet(corpus, 0, 0xb, 0xb0 | status_channel, 74, rng() & 0x7f);
+            add_packet(corpus, 0, 0xd, 0xd0 | status_channel, rng() & 0x7f, 0);
+            if (rng() % 64 == 0) {
+                add_packet(corpus, 0, 0x8, 0x80 | status_channel, notes[i], 0);
+                notes[i] = 36 + rng() % 48;
+                add_packet(corpus, 0, 0x9, 0x90 | status_channel, notes[i], 1 + rng() % 127);
+            }
+        }
+    }
+    flush_transfer(corpus, 0);
+}
+
+static int gen_corpus(const char *dir, const char *name, void (*gen)(struct corpus_t *))
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s.bin", dir, name);
+    struct corpus_t corpus = { .file = fopen(path, "wb") };
+    if (!corpus.file) {
+        printf("Failed to open %s\n", path);
+        return 1;
+    }
+    gen(&corpus);
+    fclose(corpus.file);
+    printf("%s: %u bytes\n", path, corpus.num_bytes);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *dir = argc > 1 ? argv[1] : "corpus";
+    int rc = 0;
+    rc |= gen_corpus(dir, "coremidi_sysex", gen_coremidi_sysex);
+    rc |= gen_corpus(dir, "windows_padded", gen_windows_padded);
+    rc |= gen_corpus(dir, "mpe_dense", gen_mpe_dense);
+    return rc;
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include "../usb_midi/src/usb_midi_packet.h"
+#include "../usb_midi/src/usb_midi_ump.h"
 
 int num_failed_assertions = 0;
 
@@ -91,17 +92,65 @@ static void test_packet_from_midi_bytes()
     }
 }
 
+static void test_packets_from_sysex()
+{
+    uint8_t cable_num = 5;
+    uint8_t sysex[20];
+    sysex[0] = 0xf0;
+    for (int i = 1; i < sizeof(sysex); i++) {
+        sysex[i] = i;
+    }
+
+    /* Messages of every length should encode like 3 byte chunks passed to usb_midi_packet_from_midi_bytes */
+    for (int msg_size = 2; msg_size <= sizeof(sysex); msg_size++) {
+        uint8_t msg[20];
+        for (int i = 0; i < msg_size; i++) {
+            msg[i] = i == msg_size - 1 ? 0xf7 : sysex[i];
+        }
+        uint8_t packets[4 * 8];
+        uint32_t num_packets = 0;
+        uint32_t num_encoded = usb_midi_packets_from_sysex(msg, msg_size, cable_num, packets, 8, &num_packets);
+        assert(num_encoded == msg_size, "A complete sysex message should be encoded");
+        assert(num_packets == (msg_size + 2) / 3, "Unexpected sysex packet count");
+        for (int i = 0; i < num_packets; i++) {
+            uint8_t chunk[3] = {0, 0, 0};
+            for (int j = 0; j < 3 && 3 * i + j < msg_size; j++) {
+                chunk[j] = msg[3 * i + j];
+            }
+            struct usb_midi_packet_t packet;
+            usb_midi_packet_from_midi_bytes(chunk, cable_num, &packet);
+            for (int j = 0; j < 4; j++) {
+                assert(packets[4 * i + j] == packet.bytes[j], "Unexpected sysex packet byte");
+            }
+        }
+    }
+
+    /* Unterminated spans should only be encoded in multiples of 3 */
+    uint8_t packets[4 * 8];
+    uint32_t num_packets = 0;
+    uint32_t num_encoded = usb_midi_packets_from_sysex(sysex, 8, cable_num, packets, 8, &num_packets);
+    assert(num_encoded == 6 && num_packets == 2, "Incomplete chunks should not be encoded");
+
+    /* Encoding should stop when the destination is full */
+    num_encoded = usb_midi_packets_from_sysex(sysex, sizeof(sysex), cable_num, packets, 3, &num_packets);
+    assert(num_encoded == 9 && num_packets == 3, "Encoding should stop when the destination is full");
+}
+
 struct parser_test_result_t {
     uint8_t num_non_sysex_messages;
     uint8_t non_sysex_messages[256][3];
     uint8_t sysex_write_pos;
     uint8_t sysex_messages[256];
+    uint8_t num_sysex_data_callbacks;
+    uint8_t num_sysex_aborts;
 };
 
 static struct parser_test_result_t parser_test_result;
 static void reset_parser_test_state() {
     parser_test_result.num_non_sysex_messages = 0;
     parser_test_result.sysex_write_pos = 0;
+    parser_test_result.num_sysex_data_callbacks = 0;
+    parser_test_result.num_sysex_aborts = 0;
 }
 
 static void usb_midi_message_cb(uint8_t *bytes, uint8_t num_bytes, uint8_t cable_num)
@@ -121,6 +170,7 @@ static void usb_midi_sysex_start_cb(uint8_t cable_num)
 
 static void usb_midi_sysex_data_cb(uint8_t* data_bytes, uint8_t num_data_bytes, uint8_t cable_num)
 {
+    parser_test_result.num_sysex_data_callbacks++;
     for (int i = 0; i < num_data_bytes; i++) {
         parser_test_result.sysex_messages[parser_test_result.sysex_write_pos] = data_bytes[i];
         parser_test_result.sysex_write_pos++;
@@ -133,11 +183,17 @@ static void usb_midi_sysex_end_cb(uint8_t cable_num)
     parser_test_result.sysex_write_pos++;
 }
 
+static void usb_midi_sysex_abort_cb(uint8_t cable_num)
+{
+    parser_test_result.num_sysex_aborts++;
+}
+
 static struct usb_midi_parse_cb_t parse_cb = {
         .message_cb = usb_midi_message_cb,
         .sysex_start_cb = usb_midi_sysex_start_cb,
         .sysex_data_cb = usb_midi_sysex_data_cb,
         .sysex_end_cb = usb_midi_sysex_end_cb,
+        .sysex_abort_cb = usb_midi_sysex_abort_cb,
     };
 
 struct parser_test_case_t {
@@ -210,11 +266,334 @@ static void test_parse_sysex() {
     }
 }
 
+static void test_parse_transfer() {
+    /* A transfer mixing channel messages, sysex runs and a cable switch. */
+    uint8_t transfer[][4] = {
+        { 0x19, 0x91, 0x40, 0x7f }, /* Note on, cable 1 */
+        { 0x14, 0xf0, 0x01, 0x02 }, /* F0 d d */
+        { 0x14, 0x03, 0x04, 0x05 }, /* d d d */
+        { 0x14, 0x06, 0x07, 0x08 }, /* d d d */
+        { 0x14, 0x09, 0x0a, 0x0b }, /* d d d */
+        { 0x1f, 0xf8, 0x00, 0x00 }, /* Timing clock */
+        { 0x14, 0x0c, 0x0d, 0x0e }, /* d d d */
+        { 0x24, 0x0f, 0x10, 0x11 }, /* d d d, cable 2 */
+        { 0x17, 0x12, 0x13, 0xf7 }, /* d d F7 */
+        { 0x00, 0x00, 0x00, 0x00 }, /* Padding */
+    };
+    uint8_t num_packets = sizeof(transfer) / 4;
+
+    /* Parse packet by packet */
+    reset_parser_test_state();
+    for (int i = 0; i < num_packets; i++) {
+        usb_midi_parse_packet(transfer[i], &parse_cb);
+    }
+    struct parser_test_result_t expected = parser_test_result;
+
+    /* Parse the whole transfer */
+    reset_parser_test_state();
+    enum usb_midi_error_t error = usb_midi_parse_transfer((uint8_t *)transfer, sizeof(transfer), &parse_cb);
+    assert(error == USB_MIDI_SUCCESS, "Padding packets should not be reported as errors");
+    uint8_t padding[4] = { 0x00, 0x00, 0x00, 0x00 };
+    uint8_t num_non_sysex_messages = parser_test_result.num_non_sysex_messages;
+    assert(usb_midi_parse_packet(padding, &parse_cb) == USB_MIDI_SUCCESS &&
+           parser_test_result.num_non_sysex_messages == num_non_sysex_messages,
+           "Padding packets should be ignored");
+    assert(parser_test_result.num_non_sysex_messages == expected.num_non_sysex_messages,
+           "Parsing a transfer should yield the same non-sysex messages as parsing packets");
+    assert(parser_test_result.sysex_write_pos == expected.sysex_write_pos,
+           "Parsing a transfer should yield the same sysex bytes as parsing packets");
+    assert(parser_test_result.num_sysex_data_callbacks == 5,
+           "Consecutive sysex continuation packets should be delivered in one callback");
+    for (int i = 0; i < expected.num_non_sysex_messages; i++) {
+        for (int j = 0; j < 3; j++) {
+            assert(parser_test_result.non_sysex_messages[i][j] == expected.non_sysex_messages[i][j],
+                   "Parsing a transfer should yield the same non-sysex messages as parsing packets");
+        }
+    }
+    for (int i = 0; i < expected.sysex_write_pos; i++) {
+        assert(parser_test_result.sysex_messages[i] == expected.sysex_messages[i],
+               "Parsing a transfer should yield the same sysex bytes as parsing packets");
+    }
+}
+
+static void test_parse_byte_stream() {
+    /* Messages sent as single bytes (CIN 0xf), using running status and mixed with sysex packets. */
+    uint8_t transfer[][4] = {
+        { 0x1f, 0x92, 0x00, 0x00 }, /* Note on status, cable 1 */
+        { 0x1f, 0x40, 0x00, 0x00 },
+        { 0x1f, 0xf8, 0x00, 0x00 }, /* Timing clock in the middle of a message */
+        { 0x1f, 0x7f, 0x00, 0x00 }, /* Note on complete */
+        { 0x1f, 0x41, 0x00, 0x00 }, /* Running status */
+        { 0x1f, 0x00, 0x00, 0x00 }, /* Note on complete */
+        { 0x14, 0xf0, 0x01, 0x02 }, /* F0 d d */
+        { 0x1f, 0x03, 0x00, 0x00 }, /* d, as sent by CoreMIDI */
+        { 0x14, 0x04, 0x05, 0x06 }, /* d d d */
+        { 0x1f, 0x07, 0x00, 0x00 }, /* d */
+        { 0x1f, 0x08, 0x00, 0x00 }, /* d */
+        { 0x1f, 0xf7, 0x00, 0x00 }, /* F7 */
+        { 0x1f, 0x42, 0x00, 0x00 }, /* Sysex cancels running status */
+        { 0x1f, 0xc3, 0x00, 0x00 }, /* Program change status */
+        { 0x1f, 0x05, 0x00, 0x00 }, /* Program change complete */
+        { 0x1f, 0x06, 0x00, 0x00 }, /* Running status */
+    };
+    struct usb_midi_cable_state_t cable_states[2] = { 0 };
+    struct usb_midi_parse_cb_t stream_parse_cb = parse_cb;
+    stream_parse_cb.cable_states = cable_states;
+    stream_parse_cb.num_cable_states = 2;
+
+    reset_parser_test_state();
+    enum usb_midi_error_t error = usb_midi_parse_transfer((uint8_t *)transfer, sizeof(transfer), &stream_parse_cb);
+    assert(error == USB_MIDI_ERROR_INVALID_MIDI_MSG, "A data byte without status should be reported");
+
+    uint8_t expected_messages[][3] = {
+        { 0xf8, 0, 0 },
+        { 0x92, 0x40, 0x7f },
+        { 0x92, 0x41, 0x00 },
+        { 0xc3, 0x05, 0 },
+        { 0xc3, 0x06, 0 },
+    };
+    uint8_t num_expected_messages = sizeof(expected_messages) / 3;
+    assert(parser_test_result.num_non_sysex_messages == num_expected_messages,
+           "Single bytes should be reassembled into messages");
+    for (int i = 0; i < num_expected_messages; i++) {
+        for (int j = 0; j < 3; j++) {
+            assert(parser_test_result.non_sysex_messages[i][j] == expected_messages[i][j],
+                   "Single bytes should be reassembled into messages");
+        }
+    }
+
+    uint8_t expected_sysex[] = { 0xf0, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0xf7 };
+    assert(parser_test_result.sysex_write_pos == sizeof(expected_sysex),
+           "Single sysex bytes should be delivered in order");
+    for (int i = 0; i < sizeof(expected_sysex); i++) {
+        assert(parser_test_result.sysex_messages[i] == expected_sysex[i],
+               "Single sysex bytes should be delivered in order");
+    }
+    assert(parser_test_result.num_sysex_data_callbacks == 4,
+           "Consecutive single sysex bytes should be batched");
+
+    /* Without cable state, single bytes are delivered as is */
+    reset_parser_test_state();
+    usb_midi_parse_transfer((uint8_t *)transfer, 4 * 2, &parse_cb);
+    assert(parser_test_result.num_non_sysex_messages == 1 && parser_test_result.sysex_write_pos == 1,
+           "Single bytes should be delivered as is without cable state");
+}
+
+static void test_parse_raw_byte_stream() {
+    /* As received from a DIN port, split across two calls in the middle of messages */
+    uint8_t bytes[] = {
+        0x90, 0x3c, 0x64, 0x3e, /* Note on, then a running status note on split across calls */
+        0x00, 0xfe, 0x40, 0x7f, /* Active sensing in the middle of a running status note on */
+        0xf0, 0x01, 0x02, 0xf8, 0x03, 0xf7, /* Sysex with a clock in it */
+        0x05, /* Sysex cancels running status */
+        0xb1, 0x07, 0x7f, 0x0a, 0x40,
+    };
+    uint32_t num_first_bytes = 4;
+    struct usb_midi_cable_state_t state = { 0 };
+
+    reset_parser_test_state();
+    enum usb_midi_error_t error = usb_midi_parse_byte_stream(&state, bytes, num_first_bytes, 2, &parse_cb);
+    assert(error == USB_MIDI_SUCCESS, "A byte stream should parse without errors");
+    error = usb_midi_parse_byte_stream(&state, &bytes[num_first_bytes], sizeof(bytes) - num_first_bytes, 2, &parse_cb);
+    assert(error == USB_MIDI_ERROR_INVALID_MIDI_MSG, "A data byte without status should be reported");
+
+    uint8_t expected_messages[][3] = {
+        { 0x90, 0x3c, 0x64 },
+        { 0x90, 0x3e, 0x00 },
+        { 0xfe, 0, 0 },
+        { 0x90, 0x40, 0x7f },
+        { 0xf8, 0, 0 },
+        { 0xb1, 0x07, 0x7f },
+        { 0xb1, 0x0a, 0x40 },
+    };
+    uint8_t num_expected_messages = sizeof(expected_messages) / 3;
+    assert(parser_test_result.num_non_sysex_messages == num_expected_messages,
+           "A byte stream should be parsed into messages");
+    for (int i = 0; i < num_expected_messages; i++) {
+        for (int j = 0; j < 3; j++) {
+            assert(parser_test_result.non_sysex_messages[i][j] == expected_messages[i][j],
+                   "A byte stream should be parsed into messages");
+        }
+    }
+
+    uint8_t expected_sysex[] = { 0xf0, 0x01, 0x02, 0x03, 0xf7 };
+    assert(parser_test_result.sysex_write_pos == sizeof(expected_sysex),
+           "Sysex bytes of a byte stream should be delivered in order");
+    for (int i = 0; i < sizeof(expected_sysex); i++) {
+        assert(parser_test_result.sysex_messages[i] == expected_sysex[i],
+               "Sysex bytes of a byte stream should be delivered in order");
+    }
+
+    /* Sysex data is delivered at the end of each call */
+    uint8_t sysex_start[] = { 0xf0, 0x10, 0x11 };
+    reset_parser_test_state();
+    usb_midi_parse_byte_stream(&state, sysex_start, sizeof(sysex_start), 2, &parse_cb);
+    assert(parser_test_result.sysex_write_pos == 3 && parser_test_result.num_sysex_data_callbacks == 1,
+           "Batched sysex bytes should be delivered at the end of a call");
+}
+
+static void test_parse_sysex_state() {
+    uint8_t transfer[][4] = {
+        { 0x14, 0x01, 0x02, 0x03 }, /* d d d without a start */
+        { 0x17, 0x04, 0x05, 0xf7 }, /* d d F7 without a start */
+        { 0x14, 0xf0, 0x10, 0x11 }, /* F0 d d */
+        { 0x14, 0x12, 0x13, 0x14 }, /* d d d */
+        { 0x14, 0xf0, 0x20, 0x21 }, /* F0 d d without an end of the previous message */
+        { 0x16, 0x22, 0xf7, 0x00 }, /* d F7 */
+        { 0x15, 0xf7, 0x00, 0x00 }, /* F7 without a start */
+        { 0x14, 0xf0, 0x30, 0x31 }, /* F0 d d */
+        { 0x1f, 0xf8, 0x00, 0x00 }, /* Timing clock, allowed in sysex */
+        { 0x19, 0x90, 0x40, 0x7f }, /* Note on, aborts the sysex message */
+        { 0x14, 0xf0, 0x40, 0x41 }, /* F0 d d, aborted by the reset below */
+    };
+    struct usb_midi_cable_state_t cable_states[2] = { 0 };
+    struct usb_midi_parse_cb_t state_parse_cb = parse_cb;
+    state_parse_cb.cable_states = cable_states;
+    state_parse_cb.num_cable_states = 2;
+
+    reset_parser_test_state();
+    enum usb_midi_error_t error = usb_midi_parse_transfer((uint8_t *)transfer, sizeof(transfer), &state_parse_cb);
+    assert(error == USB_MIDI_ERROR_INVALID_MIDI_MSG, "Sysex data without a start should be reported");
+    usb_midi_reset_cable_states(&state_parse_cb);
+
+    uint8_t expected_sysex[] = {
+        0xf0, 0x10, 0x11, 0x12, 0x13, 0x14,
+        0xf0, 0x20, 0x21, 0x22, 0xf7,
+        0xf0, 0x30, 0x31,
+        0xf0, 0x40, 0x41
+    };
+    assert(parser_test_result.sysex_write_pos == sizeof(expected_sysex),
+           "Sysex data without a start should be dropped");
+    for (int i = 0; i < sizeof(expected_sysex); i++) {
+        assert(parser_test_result.sysex_messages[i] == expected_sysex[i],
+               "Sysex data without a start should be dropped");
+    }
+    assert(parser_test_result.num_sysex_aborts == 3,
+           "Interrupted sysex messages should be aborted");
+    assert(parser_test_result.num_non_sysex_messages == 2,
+           "Messages interrupting sysex messages should be delivered");
+    assert(cable_states[1].sysex_state == USB_MIDI_SYSEX_STATE_IDLE,
+           "Resetting should resync the cable state");
+}
+
+static void test_ump_round_trip() {
+    uint8_t messages[][3] = {
+        { 0x93, 0x40, 0x7f }, /* Note on */
+        { 0xe0, 0x00, 0x40 }, /* Pitch bend */
+        { 0xf8, 0x00, 0x00 }, /* Timing clock */
+        { 0xf2, 0x10, 0x20 }, /* Song position pointer */
+    };
+    uint8_t num_messages = sizeof(messages) / 3;
+    uint8_t sysex[] = { 0xf0, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xf7 };
+
+    uint32_t words[16];
+    uint32_t num_words = 0;
+    for (int i = 0; i < num_messages; i++) {
+        uint8_t num_message_words = 0;
+        enum usb_midi_error_t error = usb_midi_ump_from_midi1_bytes(messages[i], 5, &words[num_words],
+                                                                    &num_message_words);
+        assert(error == USB_MIDI_SUCCESS, "Building a UMP from a valid message should succeed");
+        assert(num_message_words == 1, "MIDI 1.0 messages should become 32 bit UMPs");
+        num_words += num_message_words;
+    }
+    assert(words[0] == 0x2593407f, "Note on should become a MIDI 1.0 channel voice UMP");
+
+    uint32_t num_sysex_words = 0;
+    uint32_t num_encoded_bytes = usb_midi_ump_from_sysex7(sysex, sizeof(sysex), 5, &words[num_words],
+                                                          4, 0, &num_sysex_words);
+    assert(num_encoded_bytes == sizeof(sysex), "A complete sysex message should be encoded");
+    assert(num_sysex_words == 4, "9 sysex data bytes should become two 64 bit UMPs");
+    num_words += num_sysex_words;
+
+    uint8_t transfer[64];
+    for (int i = 0; i < num_words; i++) {
+        usb_midi_put_word(words[i], &transfer[4 * i]);
+    }
+    struct usb_midi_ump_parse_cb_t ump_parse_cb = { .midi1 = parse_cb };
+    reset_parser_test_state();
+    enum usb_midi_error_t error = usb_midi_ump_parse_transfer(transfer, 4 * num_words, &ump_parse_cb);
+    assert(error == USB_MIDI_SUCCESS, "Parsing valid UMPs should succeed");
+    assert(parser_test_result.num_non_sysex_messages == num_messages, "All messages should be parsed");
+    for (int i = 0; i < num_messages; i++) {
+        for (int j = 0; j < 3; j++) {
+            assert(parser_test_result.non_sysex_messages[i][j] == messages[i][j],
+                   "Parsed UMPs should match the original messages");
+        }
+    }
+    assert(parser_test_result.sysex_write_pos == sizeof(sysex), "All sysex bytes should be parsed");
+    for (int i = 0; i < sizeof(sysex); i++) {
+        assert(parser_test_result.sysex_messages[i] == sysex[i],
+               "Parsed sysex UMPs should match the original message");
+    }
+}
+
+static void test_ump_sysex_chunks() {
+    uint8_t sysex[] = { 0xf0, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xf7 };
+    uint8_t chunks[][3] = {
+        { 0xf0, 0x01, 0x02 },
+        { 0x03, 0x04, 0x05 },
+        { 0x06, 0x07, 0x08 },
+        { 0x09, 0xf7, 0x00 },
+    };
+    uint8_t num_chunks = sizeof(chunks) / 3;
+
+    /* MIDI 1.0 sysex chunks, as passed to usb_midi_tx_buffer_add */
+    uint32_t words[16];
+    uint32_t num_words = 0;
+    for (int i = 0; i < num_chunks; i++) {
+        uint8_t num_chunk_words = 0;
+        enum usb_midi_error_t error = usb_midi_ump_from_midi1_bytes(chunks[i], 5, &words[num_words],
+                                                                    &num_chunk_words);
+        assert(error == USB_MIDI_SUCCESS, "Building a UMP from a sysex chunk should succeed");
+        assert(num_chunk_words == 2, "Sysex chunks should become 64 bit UMPs");
+        num_words += num_chunk_words;
+    }
+    assert(words[0] == 0x35120102, "The first chunk should start the sysex message");
+    assert(words[2] == 0x35230304, "Middle chunks should continue the sysex message");
+    assert(words[6] == 0x35310900, "The last chunk should end the sysex message");
+
+    /* Spans of less than 6 bytes without F7 are only encoded when flushed */
+    uint32_t num_span_words = 0;
+    assert(usb_midi_ump_from_sysex7(sysex, 3, 5, &words[num_words], 1, 0, &num_span_words) == 0,
+           "A short span should be left for the next call");
+    uint32_t span_sizes[] = { 3, 3, 3, 2 };
+    uint32_t offset = 0;
+    for (int i = 0; i < sizeof(span_sizes) / sizeof(span_sizes[0]); i++) {
+        uint32_t num_encoded_bytes = usb_midi_ump_from_sysex7(
+            &sysex[offset], span_sizes[i], 5, &words[num_words], 1, 1, &num_span_words);
+        assert(num_encoded_bytes == span_sizes[i], "A flushed span should be encoded");
+        offset += num_encoded_bytes;
+        num_words += num_span_words;
+    }
+    assert(num_words == 16, "Each span should become a 64 bit UMP");
+
+    uint8_t transfer[64];
+    for (int i = 0; i < num_words; i++) {
+        usb_midi_put_word(words[i], &transfer[4 * i]);
+    }
+    struct usb_midi_ump_parse_cb_t ump_parse_cb = { .midi1 = parse_cb };
+    reset_parser_test_state();
+    enum usb_midi_error_t error = usb_midi_ump_parse_transfer(transfer, 4 * num_words, &ump_parse_cb);
+    assert(error == USB_MIDI_SUCCESS, "Parsing chunked sysex UMPs should succeed");
+    assert(parser_test_result.sysex_write_pos == 2 * sizeof(sysex), "All sysex bytes should be parsed");
+    for (int i = 0; i < 2 * sizeof(sysex); i++) {
+        assert(parser_test_result.sysex_messages[i] == sysex[i % sizeof(sysex)],
+               "Parsed sysex UMPs should match the original chunks");
+    }
+}
+
 int main(int argc, char *argv[])
 {
     test_packet_from_midi_bytes();
+    test_packets_from_sysex();
     test_parse_sysex();
     test_parse_non_sysex();
+    test_parse_transfer();
+    test_parse_byte_stream();
+    test_parse_raw_byte_stream();
+    test_parse_sysex_state();
+    test_ump_round_trip();
+    test_ump_sysex_chunks();
 
     if (num_failed_assertions > 0) {
         printf("❌ %d failed assertions.\n", num_failed_assertions);
@@ -0,0 +1,137 @@
+/*
+ * Feeds the transfers of the corpus files generated by usb_midi_corpus_gen.c
+ * through the RX parser and reports the throughput per profile, both packet
+ * by packet (usb_midi_parse_packet) and a transfer at a time
+ * (usb_midi_parse_transfer). Each is run without parser state and with per
+ * cable state, which is how the driver parses.
+ *
+ * Usage: see run_bench.sh
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../usb_midi/src/usb_midi_packet.h"
+
+#define MAX_CORPUS_SIZE (1024 * 1024)
+#define MIN_BENCH_TIME_S 0.5
+
+struct corpus_t {
+    uint8_t bytes[MAX_CORPUS_SIZE];
+    uint32_t num_bytes;
+};
+
+static struct corpus_t corpus;
+/* MIDI messages, sysex starts and ends and sysex data bytes */
+static uint64_t num_events;
+
+static void message_cb(uint8_t *bytes, uint8_t num_bytes, uint8_t cable_num)
+{
+    num_events++;
+}
+
+static void sysex_start_cb(uint8_t cable_num)
+{
+    num_events++;
+}
+
+static void sysex_data_cb(uint8_t *data_bytes, uint8_t num_data_bytes, uint8_t cable_num)
+{
+    /* Count sysex data bytes, so that batched callbacks compare fairly */
+    num_events += num_data_bytes;
+}
+
+static void sysex_end_cb(uint8_t cable_num)
+{
+    num_events++;
+}
+
+static struct usb_midi_cable_state_t cable_states[16];
+
+static struct usb_midi_parse_cb_t parse_cb = {
+    .message_cb = message_cb,
+    .sysex_start_cb = sysex_start_cb,
+    .sysex_data_cb = sysex_data_cb,
+    .sysex_end_cb = sysex_end_cb,
+};
+
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static int load_corpus(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        printf("Failed to open %s\n", path);
+        return 1;
+    }
+    corpus.num_bytes = fread(corpus.bytes, 1, sizeof(corpus.bytes), file);
+    fclose(file);
+    return 0;
+}
+
+/* Parses all transfers of the corpus once. Returns the number of transfer bytes. */
+static uint64_t parse_corpus(int per_packet)
+{
+    uint64_t num_transfer_bytes = 0;
+    uint32_t pos = 0;
+    while (pos + 2 <= corpus.num_bytes) {
+        uint32_t transfer_size = corpus.bytes[pos] | (corpus.bytes[pos + 1] << 8);
+        uint8_t *transfer = &corpus.bytes[pos + 2];
+        if (per_packet) {
+            for (uint32_t i = 0; i + 4 <= transfer_size; i += 4) {
+                usb_midi_parse_packet(&transfer[i], &parse_cb);
+            }
+            /* Like usb_midi_parse_transfer does */
+            usb_midi_flush_byte_streams(&parse_cb);
+        } else {
+            usb_midi_parse_transfer(transfer, transfer_size, &parse_cb);
+        }
+        num_transfer_bytes += transfer_size;
+        pos += 2 + transfer_size;
+    }
+    return num_transfer_bytes;
+}
+
+static void bench(const char *name, int per_packet, int has_cable_states)
+{
+    memset(cable_states, 0, sizeof(cable_states));
+    parse_cb.cable_states = has_cable_states ? cable_states : NULL;
+    parse_cb.num_cable_states = has_cable_states ? 16 : 0;
+    uint64_t num_bytes = 0;
+    int num_iterations = 0;
+    num_events = 0;
+    double start = now_s();
+    double elapsed = 0;
+    while (elapsed < MIN_BENCH_TIME_S) {
+        num_bytes += parse_corpus(per_packet);
+        num_iterations++;
+        elapsed = now_s() - start;
+    }
+    printf("%-20s %-9s %-9s %12.0f events/s %12.0f bytes/s (%d iterations)\n", name,
+           per_packet ? "packet" : "transfer", has_cable_states ? "stateful" : "stateless",
+           num_events / elapsed, num_bytes / elapsed, num_iterations);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        printf("Usage: %s corpus_file...\n", argv[0]);
+        return 1;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (load_corpus(argv[i])) {
+            return 1;
+        }
+        const char *name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i];
+        for (int has_cable_states = 0; has_cable_states <= 1; has_cable_states++) {
+            bench(name, 1, has_cable_states);
+            bench(name, 0, has_cable_states);
+        }
+    }
+    return 0;
+}
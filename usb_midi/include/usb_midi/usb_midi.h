@@ -1,7 +1,9 @@
 #ifndef ZEPHYR_USB_MIDI_H_
 #define ZEPHYR_USB_MIDI_H_
 
+#include <stddef.h>
 #include <stdint.h>
+#include <zephyr/kernel.h>
 
 /** A function to call when the USB MIDI device becomes available/unavailable. */
 typedef void (*usb_midi_available_cb_t)(int is_available);
@@ -15,6 +17,80 @@ typedef void (*usb_midi_sysex_start_cb_t)(uint8_t cable_num);
 typedef void (*usb_midi_sysex_data_cb_t)(uint8_t* data_bytes, uint8_t num_data_bytes, uint8_t cable_num);
 /** A function to call when a sysex message ends */
 typedef void (*usb_midi_sysex_end_cb_t)(uint8_t cable_num);
+/**
+ * A function to call when a sysex message in progress ends without F7, i.e
+ * when a new sysex message or a non real time message starts on the same
+ * cable, or when the device is reset or disconnected. Data received since the
+ * sysex start should be discarded.
+ */
+typedef void (*usb_midi_sysex_abort_cb_t)(uint8_t cable_num);
+/**
+ * A function to call when 8 bit sysex data has been received. Only used
+ * with the MIDI 2.0 alternate setting.
+ */
+typedef void (*usb_midi_sysex8_cb_t)(uint8_t *data_bytes, uint8_t num_data_bytes, uint8_t status,
+				     uint8_t stream_id, uint8_t group);
+/**
+ * A function to call when a UMP without a more specific callback, e.g a MIDI 2.0
+ * channel voice message, has been received. Only used with the MIDI 2.0 alternate setting.
+ */
+typedef void (*usb_midi_ump_cb_t)(uint32_t *words, uint8_t num_words);
+
+/**
+ * A function to call when a received transfer has been queued. Only used with
+ * CONFIG_USB_MIDI_RX_FLOW_CONTROL. Called from the USB interrupt, typically to
+ * schedule a call to usb_midi_rx_process.
+ */
+typedef void (*usb_midi_rx_queued_cb_t)();
+
+/**
+ * A function to call when the host suspends the device, e.g when going to
+ * sleep, or resumes it. The device stays available while suspended and
+ * messages sent in the meantime are kept until the host resumes the device.
+ * With CONFIG_USB_MIDI_REMOTE_WAKEUP, sending while suspended wakes the host,
+ * so periodic senders like the clock generator should be stopped here.
+ */
+typedef void (*usb_midi_suspended_cb_t)(int is_suspended);
+
+/**
+ * A function to call with every received MIDI 1.0 transfer, before it is
+ * parsed. Lets e.g a device forwarding packets to another USB MIDI device
+ * skip parsing altogether. Called from the USB interrupt, or from
+ * usb_midi_rx_process with CONFIG_USB_MIDI_RX_FLOW_CONTROL.
+ * @param words The USB MIDI event packets of the transfer, with the header in
+ * the least significant byte. Only valid during the call.
+ * @param num_words The number of packets.
+ * @return Non-zero if the transfer has been handled and should not be parsed,
+ * in which case the message and sysex callbacks are not called for it.
+ */
+typedef int (*usb_midi_rx_raw_cb_t)(const uint32_t *words, uint32_t num_words);
+
+struct usb_midi_tx_token;
+/**
+ * A function to call when an IN transfer containing messages enqueued with a
+ * token has completed or has been discarded.
+ * @param token The token the messages were enqueued with.
+ * @param num_bytes The number of USB bytes of the transfer enqueued with the token.
+ * @param status 0 if the transfer completed. Otherwise the enqueued messages
+ * were discarded: -ECONNRESET if the device was reset or disconnected, -EPIPE
+ * if the host cleared the halt of the IN endpoint, or the error of the device
+ * controller write, e.g -EIO, if the transfer still failed after
+ * CONFIG_USB_MIDI_TX_RETRIES retries.
+ */
+typedef void (*usb_midi_tx_token_cb_t)(struct usb_midi_tx_token *token, uint32_t num_bytes,
+				       int status);
+
+/**
+ * Identifies the messages of a sender, e.g a sysex message being transmitted.
+ * The token must stay valid until all messages enqueued with it have been
+ * reported. The callback is invoked once per transfer containing messages
+ * enqueued with the token, which lets several senders share an endpoint
+ * without global bookkeeping.
+ */
+struct usb_midi_tx_token {
+    usb_midi_tx_token_cb_t cb;
+    void *user_data;
+};
 
 struct usb_midi_cb_t {
     usb_midi_available_cb_t available_cb;
@@ -23,6 +99,12 @@ struct usb_midi_cb_t {
     usb_midi_sysex_start_cb_t sysex_start_cb;
     usb_midi_sysex_data_cb_t sysex_data_cb;
     usb_midi_sysex_end_cb_t sysex_end_cb;
+    usb_midi_sysex_abort_cb_t sysex_abort_cb;
+    usb_midi_sysex8_cb_t sysex8_cb;
+    usb_midi_ump_cb_t ump_cb;
+    usb_midi_rx_queued_cb_t rx_queued_cb;
+    usb_midi_suspended_cb_t suspended_cb;
+    usb_midi_rx_raw_cb_t rx_raw_cb;
 };
 
 /**
@@ -30,6 +112,88 @@ struct usb_midi_cb_t {
  */
 void usb_midi_register_callbacks(struct usb_midi_cb_t* handlers);
 
+/**
+ * @return Non-zero if the host has suspended the device.
+ */
+int usb_midi_is_suspended();
+
+/** Suspend and resume measurements, see usb_midi_resume_stats_get. */
+struct usb_midi_resume_stats {
+    /* The number of times the host suspended and resumed the device */
+    uint32_t num_suspends;
+    uint32_t num_resumes;
+    /* The number of resumes requested by the device (remote wakeups) */
+    uint32_t num_remote_wakeups;
+    /* The time from a remote wakeup request to the resume, in microseconds */
+    uint32_t last_wakeup_us;
+    uint32_t max_wakeup_us;
+    /*
+     * The time from a resume to the completion of the first IN transfer after
+     * it, i.e until the host has received data again, in microseconds.
+     */
+    uint32_t last_resume_to_tx_us;
+    uint32_t max_resume_to_tx_us;
+};
+
+/**
+ * Get the suspend and resume measurements since startup or the last
+ * call to usb_midi_resume_stats_reset.
+ */
+void usb_midi_resume_stats_get(struct usb_midi_resume_stats *stats);
+
+/**
+ * Reset the suspend and resume measurements.
+ */
+void usb_midi_resume_stats_reset();
+
+/** Error recovery counts, see usb_midi_recovery_stats_get. */
+struct usb_midi_recovery_stats {
+    /* The number of errors reported by the USB controller */
+    uint32_t num_errors;
+    /* The number of times the host halted a MIDI endpoint and cleared the halt */
+    uint32_t num_halts;
+    uint32_t num_clear_halts;
+    /* The number of retries of failed IN transfers */
+    uint32_t num_tx_retries;
+    /* The number of IN transfers dropped after the last retry failed */
+    uint32_t num_tx_failures;
+    /* The number of OUT endpoints restarted after a failed read */
+    uint32_t num_rx_restarts;
+};
+
+/**
+ * Get the error recovery counts since startup or the last call to
+ * usb_midi_recovery_stats_reset. A failed IN transfer is retried with
+ * exponential backoff, starting at 1 ms, up to CONFIG_USB_MIDI_TX_RETRIES
+ * times. Each endpoint pair waits for its own backoff. An OUT endpoint whose
+ * transfer could not be read drops it and accepts the next one. When the host
+ * clears the halt of an IN endpoint, its enqueued data is dropped and the
+ * tokens report -EPIPE.
+ */
+void usb_midi_recovery_stats_get(struct usb_midi_recovery_stats *stats);
+
+/**
+ * Reset the error recovery counts.
+ */
+void usb_midi_recovery_stats_reset();
+
+/**
+ * Parse queued received transfers and invoke the MIDI callbacks from the
+ * calling thread. Only available with CONFIG_USB_MIDI_RX_FLOW_CONTROL, in
+ * which case received data is not parsed in the USB interrupt. While the
+ * queue is full, the host is not allowed to send more data. Reception resumes
+ * when the queue has been drained to CONFIG_USB_MIDI_RX_QUEUE_LOW_WATERMARK
+ * transfers.
+ * @param max_transfers The max number of transfers to process.
+ * @return The number of processed transfers.
+ */
+int usb_midi_rx_process(int max_transfers);
+
+/*
+ * The TX functions below, including the clock and scheduling functions, are
+ * not available with CONFIG_USB_MIDI_NUM_OUTPUTS set to 0.
+ */
+
 /**
  * Send a MIDI message with a given cable number. The event must be 1, 2 or 3 
  * bytes long passed in a buffer of length 3 (unused bytes can be set to zero).
@@ -54,24 +218,485 @@ void usb_midi_register_callbacks(struct usb_midi_cb_t* handlers);
  */
 int usb_midi_tx(uint8_t cable_number, uint8_t* midi_bytes);
 
+/**
+ * Like usb_midi_tx, but sleeps while the IN endpoint is busy instead of failing.
+ * Must not be called from an ISR.
+ * @param timeout The max time to wait for the endpoint, e.g K_MSEC(10) or K_FOREVER.
+ * @return 0 on success, -EAGAIN if the endpoint stayed busy for the whole timeout,
+ * another non-zero number on failure.
+ */
+int usb_midi_tx_wait(uint8_t cable_number, uint8_t *midi_bytes, k_timeout_t timeout);
+
 /**
  * Enqueue a message for transmission. Used to send more than one
  * message per USB tx packet, which is useful for increasing throughput.
+ * With CONFIG_USB_MIDI_TX_COALESCE, a controller, pitch bend or pressure
+ * message may instead overwrite an enqueued message with the same key, also
+ * when the buffer is full.
  * @return 0 if the message was enqueued, otherwise a non-zero number indicating that
  * usb_midi_tx_buffer_send should be called.
  */
 int usb_midi_tx_buffer_add(uint8_t cable_number, uint8_t* midi_bytes);
 
+/**
+ * Like usb_midi_tx_buffer_add, but the token callback is invoked when the
+ * transfer containing the message has completed. A transfer can hold messages
+ * of up to CONFIG_USB_MIDI_TX_MAX_TOKENS tokens.
+ * @param token The token to report the message with. May be NULL.
+ */
+int usb_midi_tx_buffer_add_with_token(uint8_t cable_number, uint8_t *midi_bytes,
+				      struct usb_midi_tx_token *token);
+
+/**
+ * Like usb_midi_tx_buffer_add, but sends the buffer when it is full, sleeping
+ * while the IN endpoint is busy. Must not be called from an ISR.
+ * @param timeout The max time to wait for the endpoint, e.g K_MSEC(10) or K_FOREVER.
+ * @return 0 if the message was enqueued, -EAGAIN if the endpoint stayed busy for
+ * the whole timeout, another non-zero number on failure.
+ */
+int usb_midi_tx_buffer_add_wait(uint8_t cable_number, uint8_t *midi_bytes, k_timeout_t timeout);
+
+/**
+ * Enqueue (part of) a sysex message for transmission. This is faster than
+ * splitting the message into chunks passed to usb_midi_tx_buffer_add, since
+ * the bytes are known to be sysex and do not have to be classified.
+ * The bytes may start with F0 and may end with F7. All other bytes must be data bytes.
+ * If the bytes do not end with F7, only multiples of three bytes are enqueued.
+ * On the MIDI 2.0 alternate setting, multiples of six bytes are enqueued, or
+ * all bytes if there are fewer than that.
+ * @param cable_number Send the message on the virtual cable with this number.
+ * @param sysex_bytes The sysex bytes to enqueue.
+ * @param num_bytes The number of sysex bytes.
+ * @return The number of enqueued bytes, which is smaller than num_bytes if
+ * usb_midi_tx_buffer_send should be called before enqueueing the rest. A negative
+ * number on failure.
+ */
+int usb_midi_tx_buffer_add_sysex(uint8_t cable_number, const uint8_t *sysex_bytes,
+				 uint32_t num_bytes);
+
+/**
+ * Like usb_midi_tx_buffer_add_sysex, but the token callback is invoked when
+ * each transfer containing the enqueued bytes has completed.
+ * @param token The token to report the bytes with. May be NULL.
+ */
+int usb_midi_tx_buffer_add_sysex_with_token(uint8_t cable_number, const uint8_t *sysex_bytes,
+					    uint32_t num_bytes, struct usb_midi_tx_token *token);
+
+/**
+ * Send USB MIDI event packets as they are, e.g packets received from another
+ * USB MIDI device or stored in flash. Only the cable number and the code index
+ * number of each packet are checked, the MIDI bytes are not looked at. The
+ * packets are enqueued after already enqueued messages and sent right away,
+ * along with the other data enqueued on their endpoint pairs.
+ * The packets bypass CONFIG_USB_MIDI_TX_RATE_LIMIT: they are charged to the
+ * rate limit of their cable, which delays its later messages, but are never
+ * held. Pace packets for a rate limited cable yourself, or send them with
+ * usb_midi_tx_buffer_add.
+ * @param words The packets, each with the header in the least significant
+ * byte, i.e as read from a transfer as a little endian word.
+ * @param num_words The number of packets, at most INT_MAX.
+ * @return The number of sent packets, which is smaller than num_words if an
+ * endpoint was busy. Send the rest after tx_done_cb. -EINVAL if a packet has
+ * an invalid cable number or code index number, in which case nothing is
+ * sent, -EIO if the device is not available or the MIDI 2.0 alternate
+ * setting is active.
+ */
+int usb_midi_tx_packets(const uint32_t *words, uint32_t num_words);
+
+/** A fragment of a message, see usb_midi_tx_sysexv. */
+struct usb_midi_iov {
+    const uint8_t *data;
+    uint32_t len;
+};
+
+/**
+ * Send a sysex message stored in multiple buffers, e.g a header in RAM, a
+ * payload in flash and a computed footer. The bytes are encoded straight from
+ * the buffers into full USB packets, without intermediate copies, as IN
+ * transfers complete. One such message per endpoint pair can be in progress.
+ * @param cable_number Send the message on the virtual cable with this number.
+ * @param iov The fragments of the message, which must start with F0 and end with F7.
+ * The fragments and the bytes they point to must stay valid until the token
+ * callback has been invoked.
+ * @param iov_cnt The number of fragments.
+ * @param token Invoked once when the whole message has been transferred, with
+ * the number of sysex bytes, or when it was discarded. May be NULL.
+ * @return 0 if transmission started, -EBUSY if a message is already in progress
+ * on the endpoint pair, -EINVAL for invalid arguments.
+ */
+int usb_midi_tx_sysexv(uint8_t cable_number, const struct usb_midi_iov *iov, int iov_cnt,
+		       struct usb_midi_tx_token *token);
+
+/**
+ * Generates outgoing data for a cable directly into a tx buffer. Called with
+ * the driver's TX lock held, i.e with interrupts locked, so it must be quick
+ * and must not call the usb_midi TX functions.
+ * @param cable_number The cable to generate data for.
+ * @param dst_words Destination of the generated USB MIDI event packets, 4 bytes
+ * each. With the MIDI 2.0 alternate setting, see usb_midi_ump_is_active, the
+ * destination holds UMPs instead and max_events counts 32 bit words.
+ * @param max_events The max number of event packets to write.
+ * @param ctx The pointer passed to usb_midi_tx_register_producer.
+ * @return The number of written event packets. 0 if there is nothing to send,
+ * in which case the producer is not called again until a transfer completes
+ * or usb_midi_tx_producer_resume is called.
+ */
+typedef size_t (*usb_midi_tx_fill_cb_t)(uint8_t cable_number, uint8_t *dst_words,
+					size_t max_events, void *ctx);
+
+/**
+ * Register a producer of outgoing data for a cable. The producer is called
+ * whenever a tx buffer of the endpoint pair carrying the cable frees up, so
+ * data is only generated when it can be sent. Producers of different cables
+ * sharing an endpoint pair are called in round robin order.
+ * @param fill The producer, or NULL to unregister.
+ * @return 0 on success, -EINVAL if the cable number is invalid.
+ */
+int usb_midi_tx_register_producer(uint8_t cable_number, usb_midi_tx_fill_cb_t fill, void *ctx);
+
+/**
+ * Call the producers of the endpoint pair carrying a cable now, e.g after new
+ * data became available for a producer that had nothing to send.
+ * @return 0 on success, -EIO if the device is not available, -EINVAL if the
+ * cable number is invalid.
+ */
+int usb_midi_tx_producer_resume(uint8_t cable_number);
+
+/**
+ * Encodes (part of) a sysex message as USB MIDI event packets, e.g in a producer.
+ * The bytes follow the rules of usb_midi_tx_buffer_add_sysex.
+ * @param num_bytes The number of sysex bytes. Set to the number of encoded bytes.
+ * @return The number of written event packets.
+ */
+size_t usb_midi_events_from_sysex(uint8_t cable_number, const uint8_t *sysex_bytes,
+				  uint32_t *num_bytes, uint8_t *dst_words, size_t max_events);
+
+/**
+ * Encodes a MIDI message of the form accepted by usb_midi_tx as a USB MIDI event packet.
+ * @param dst_word Destination of the 4 byte event packet.
+ * @return 0 on success, -EINVAL if the message is invalid.
+ */
+int usb_midi_event_from_midi_bytes(uint8_t cable_number, uint8_t *midi_bytes, uint8_t *dst_word);
+
 /**
  * Indicates if more messages can be enqueued for transmission.
  * @return Zero if more messages can be enqueued. A non-zero number indicates that 
- * usb_midi_tx_buffer_send should be called.
+ * usb_midi_tx_buffer_send should be called. With CONFIG_USB_MIDI_SECONDARY_EP_PAIR,
+ * non-zero is returned if the buffer of any endpoint pair is full. Use
+ * usb_midi_tx_buffer_is_full_for_cable to not hold back cables of the other pair.
  */
 int usb_midi_tx_buffer_is_full();
 
 /**
- * Send enqueued messages, if any, in a single USB packet.
+ * Like usb_midi_tx_buffer_is_full, but only for the buffer of the endpoint
+ * pair carrying a cable.
+ * @return Zero if more messages can be enqueued on the cable, 1 if the buffer
+ * is full, -EINVAL if the cable number is invalid.
+ */
+int usb_midi_tx_buffer_is_full_for_cable(uint8_t cable_number);
+
+/**
+ * Send enqueued messages, if any, in a single USB packet per endpoint pair.
+ * @return 0 on success, otherwise the first error returned by an endpoint pair.
+ * Endpoint pairs that could not send keep their enqueued messages. Endpoint
+ * pairs that were busy (-EAGAIN) send them as soon as the current transfer completes.
  */
 int usb_midi_tx_buffer_send();
 
+/**
+ * Send a single packet message, e.g a system real time or MTC quarter frame
+ * message, ahead of enqueued messages. The message is sent right away if the
+ * IN endpoint is free, otherwise at the start of the next IN transfer. May be
+ * called from interrupts, e.g timer handlers.
+ * @return 0 on success, -EINVAL for sysex messages, -ENOMEM if
+ * CONFIG_USB_MIDI_TX_PRIORITY_SLOTS messages are already waiting, -EIO if the
+ * device is not available.
+ */
+int usb_midi_tx_priority(uint8_t cable_number, uint8_t *midi_bytes);
+
+/**
+ * Send a message at a given time. Only available with CONFIG_USB_MIDI_TX_SCHED.
+ * Scheduled messages are kept in a heap of CONFIG_USB_MIDI_TX_SCHED_SIZE entries
+ * served by a single kernel timer, which fires at the earliest deadline and
+ * enqueues all messages due within CONFIG_USB_MIDI_TX_SCHED_BATCH_US in the same
+ * transfer. Messages with the same deadline are sent in the order they were
+ * scheduled.
+ * @param midi_bytes A message of the form accepted by usb_midi_tx, starting with a
+ * status byte other than sysex start (F0) or end (F7).
+ * @param deadline_cycles The time to send the message at, as returned by
+ * k_cycle_get_64. Messages with a deadline in the past are sent right away.
+ * @return 0 on success, -EINVAL for an invalid message, -ENOMEM if the heap is full.
+ */
+int usb_midi_tx_at(uint8_t cable_number, uint8_t *midi_bytes, uint64_t deadline_cycles);
+
+/**
+ * Drop all messages scheduled with usb_midi_tx_at, e.g when a sequencer stops.
+ */
+void usb_midi_tx_at_clear();
+
+/** Rate limiter measurements of a cable, see usb_midi_tx_rate_limit_stats_get. */
+struct usb_midi_rate_limit_stats {
+    /* The number of messages held until there were tokens for them */
+    uint32_t num_held;
+    /* The number of messages held right now, and the max number held at once */
+    uint32_t num_currently_held;
+    uint32_t max_held;
+    /* The number of messages rejected with -ENOMEM because the hold queue was full */
+    uint32_t num_rejected;
+    /* The total time during which the cable had held messages, in microseconds */
+    uint64_t throttled_us;
+};
+
+/**
+ * Limit the rate of a cable, e.g one feeding a 31.25 kbaud DIN port, with a
+ * token bucket. Only available with CONFIG_USB_MIDI_TX_RATE_LIMIT.
+ * Messages sent with usb_midi_tx, usb_midi_tx_buffer_add (and the functions
+ * built on them) when the bucket is out of tokens are held, in order, and
+ * enqueued by a timer as soon as there are tokens for them. Up to
+ * CONFIG_USB_MIDI_TX_RATE_LIMIT_HOLD_SIZE messages are held per cable,
+ * further messages are rejected with -ENOMEM. Sysex and priority messages
+ * are never held, but use up tokens, which delays the messages after them.
+ * Data from producers (see usb_midi_tx_register_producer) is not limited.
+ * @param bytes_per_s The rate in MIDI bytes per second, e.g 3125 for a DIN
+ * port. 0 removes the limit.
+ * @param burst_bytes The number of bytes that can be sent at once after
+ * the cable has been idle. At least 3.
+ * @return 0 on success, -EINVAL for an invalid cable number or burst size.
+ */
+int usb_midi_tx_rate_limit_set(uint8_t cable_number, uint32_t bytes_per_s, uint32_t burst_bytes);
+
+/**
+ * Get the rate limiter measurements of a cable since startup or the last
+ * call to usb_midi_tx_rate_limit_stats_reset.
+ * @return 0 on success, -EINVAL for an invalid cable number.
+ */
+int usb_midi_tx_rate_limit_stats_get(uint8_t cable_number, struct usb_midi_rate_limit_stats *stats);
+
+/**
+ * Reset the rate limiter measurements of a cable.
+ * @return 0 on success, -EINVAL for an invalid cable number.
+ */
+int usb_midi_tx_rate_limit_stats_reset(uint8_t cable_number);
+
+/** DIN bridge measurements of a cable, see usb_midi_din_stats_get. */
+struct usb_midi_din_stats {
+    /* The number of bytes received from and sent to the DIN port */
+    uint32_t num_rx_bytes;
+    uint32_t num_tx_bytes;
+    /* The number of messages from the DIN port that could not be enqueued for the host */
+    uint32_t num_rx_dropped;
+    /* The number of bytes from the host dropped because the TX buffers were full */
+    uint32_t num_tx_dropped;
+    /* The number of UART receive errors, e.g framing errors or overruns */
+    uint32_t num_rx_errors;
+    /* The number of status bytes left out thanks to running status */
+    uint32_t num_running_status_bytes;
+};
+
+/*
+ * With CONFIG_USB_MIDI_DIN_BRIDGE, each usb-midi-din-port devicetree node
+ * bridges a cable to a UART, e.g a 5-pin DIN port. MIDI data received from
+ * the UART is parsed and sent to the host on the cable, and MIDI 1.0 data
+ * received from the host on the cable is sent to the UART, in addition to
+ * being passed to the callbacks.
+ */
+
+/**
+ * Get the DIN bridge measurements of a cable since startup or the last call
+ * to usb_midi_din_stats_reset.
+ * @return 0 on success, -EINVAL if the cable is not bridged.
+ */
+int usb_midi_din_stats_get(uint8_t cable_number, struct usb_midi_din_stats *stats);
+
+/**
+ * Reset the DIN bridge measurements of a cable.
+ * @return 0 on success, -EINVAL if the cable is not bridged.
+ */
+int usb_midi_din_stats_reset(uint8_t cable_number);
+
+/*
+ * With CONFIG_USB_MIDI_CLOCK, the driver generates MIDI clock and MTC quarter
+ * frame messages from a timer. Deadlines are derived from the start time, not
+ * from when the previous message was sent, so timer latency causes jitter of
+ * at most a tick but no drift. Messages are sent using usb_midi_tx_priority.
+ */
+
+/** MTC frame rates, encoded as in quarter frame piece 7 */
+enum usb_midi_mtc_rate_t {
+    USB_MIDI_MTC_24_FPS = 0,
+    USB_MIDI_MTC_25_FPS = 1,
+    USB_MIDI_MTC_29_97_FPS_DROP_FRAME = 2,
+    USB_MIDI_MTC_30_FPS = 3
+};
+
+struct usb_midi_mtc_time {
+    uint8_t hours;
+    uint8_t minutes;
+    uint8_t seconds;
+    uint8_t frames;
+};
+
+/**
+ * Set the tempo of the MIDI clock, also while running. Defaults to 120 BPM.
+ * @param tempo_mbpm The tempo in thousandths of beats per minute, e.g 120000
+ * for 120 BPM. Between 1 and 1000 BPM.
+ * @return 0 on success, -EINVAL for an invalid tempo.
+ */
+int usb_midi_clock_set_tempo(uint32_t tempo_mbpm);
+
+/**
+ * Send Start (FA) followed by clock messages (F8), 24 per beat.
+ * @return 0 on success, otherwise the error of sending Start.
+ */
+int usb_midi_clock_start(uint8_t cable_number);
+
+/**
+ * Send Continue (FB) followed by clock messages (F8), 24 per beat.
+ * @return 0 on success, otherwise the error of sending Continue.
+ */
+int usb_midi_clock_continue(uint8_t cable_number);
+
+/**
+ * Stop sending clock messages and send Stop (FC).
+ * @return 0 on success, -EALREADY if the clock is not running, otherwise the
+ * error of sending Stop.
+ */
+int usb_midi_clock_stop();
+
+/**
+ * Set the MTC frame rate, also while running. The new rate applies from the
+ * next quarter frame on.
+ */
+void usb_midi_mtc_set_frame_rate(enum usb_midi_mtc_rate_t rate);
+
+/**
+ * Send MTC quarter frames, 4 per frame, starting at a given time. Every 8
+ * quarter frames carry the time of the first one, after which the time
+ * advances by 2 frames.
+ * @return 0 on success, -EINVAL for an invalid time.
+ */
+int usb_midi_mtc_start(uint8_t cable_number, const struct usb_midi_mtc_time *time);
+
+/**
+ * Stop sending MTC quarter frames.
+ */
+void usb_midi_mtc_stop();
+
+/*
+ * With CONFIG_USB_MIDI_CAPTURE, every USB MIDI event packet (or UMP word)
+ * read from an OUT endpoint or submitted to an IN endpoint is recorded with
+ * a cycle timestamp in a ring of CONFIG_USB_MIDI_CAPTURE_SIZE entries. Old
+ * entries are overwritten until the capture is frozen, either explicitly or
+ * by a trigger. A frozen capture can be dumped with the "usb_midi capture
+ * dump" shell command and converted to a pcap file with
+ * usb_midi/scripts/usb_midi_capture_to_pcap.py.
+ */
+
+/** The entry is a UMP word received or sent on the MIDI 2.0 alternate setting */
+#define USB_MIDI_CAPTURE_FLAG_UMP BIT(0)
+/** The entry is the first packet of a transfer */
+#define USB_MIDI_CAPTURE_FLAG_TRANSFER_START BIT(1)
+/** The entry fired the trigger */
+#define USB_MIDI_CAPTURE_FLAG_TRIGGER BIT(2)
+
+struct usb_midi_capture_entry {
+    /* The k_cycle_get_32 value when the transfer was read or submitted */
+    uint32_t cycles;
+    /* The packet as transferred over USB */
+    uint8_t bytes[4];
+    /* The endpoint address, with bit 7 set for IN endpoints */
+    uint8_t ep;
+    /* USB_MIDI_CAPTURE_FLAG_* */
+    uint8_t flags;
+};
+
+/**
+ * Fire the trigger, e.g when the app detects a failure. The capture freezes
+ * after the number of entries set with usb_midi_capture_set_trigger.
+ * Received transfers that fail to parse fire the trigger with
+ * CONFIG_USB_MIDI_CAPTURE_TRIGGER_ON_ERROR.
+ */
+void usb_midi_capture_trigger();
+
+/**
+ * Fire the trigger when a packet matching a value is recorded, i.e when
+ * (bytes[i] & mask[i]) == value[i] for all four bytes.
+ * @param value The bytes to match, or NULL to only trigger explicitly.
+ * @param mask The bits of each byte to compare.
+ * @param num_post_trigger_entries The number of entries to record after the
+ * trigger before freezing.
+ */
+void usb_midi_capture_set_trigger(const uint8_t *value, const uint8_t *mask,
+				  uint32_t num_post_trigger_entries);
+
+/**
+ * Stop recording right away.
+ * @return 0 on success, -EALREADY if already frozen.
+ */
+int usb_midi_capture_freeze();
+
+/**
+ * Remove all entries, re-arm the trigger and resume recording.
+ */
+void usb_midi_capture_clear();
+
+/**
+ * @return Non-zero if the capture is frozen.
+ */
+int usb_midi_capture_is_frozen();
+
+/**
+ * @return The number of recorded entries, at most CONFIG_USB_MIDI_CAPTURE_SIZE.
+ */
+uint32_t usb_midi_capture_num_entries();
+
+/**
+ * Get a recorded entry.
+ * @param idx The index of the entry, 0 being the oldest.
+ * @return 0 on success, -EBUSY if the capture is not frozen, -EINVAL if idx is
+ * out of range.
+ */
+int usb_midi_capture_get(uint32_t idx, struct usb_midi_capture_entry *entry);
+
+/*
+ * With CONFIG_USB_MIDI_2_0, the host may select an alternate setting that
+ * transfers Universal MIDI Packets (UMP). The functions above keep working in
+ * that case: messages are converted to MIDI 1.0 protocol UMPs, using the cable
+ * number as group, and received MIDI 1.0 protocol UMPs are delivered through the
+ * MIDI 1.0 callbacks. The functions below send UMPs as is.
+ */
+
+/**
+ * @return Non-zero if the host has selected the MIDI 2.0 alternate setting. Always
+ * zero without CONFIG_USB_MIDI_2_0.
+ */
+int usb_midi_ump_is_active();
+
+/**
+ * Send a single UMP.
+ * @param words The 1 to 4 words of the UMP.
+ * @param num_words The number of words, which must match the message type.
+ * @return 0 on success, -EIO if the MIDI 2.0 alternate setting is not active,
+ * another non-zero number on failure.
+ */
+int usb_midi_ump_tx(const uint32_t *words, uint32_t num_words);
+
+/**
+ * Enqueue a single UMP for transmission.
+ * @return 0 if the UMP was enqueued, -1 if usb_midi_tx_buffer_send should be called,
+ * another negative number on failure.
+ */
+int usb_midi_ump_tx_buffer_add(const uint32_t *words, uint32_t num_words);
+
+/**
+ * Enqueue (part of) an 8 bit sysex message, 13 data bytes per UMP.
+ * @param is_start Non-zero if the bytes start the message.
+ * @param is_end Non-zero if the bytes end the message.
+ * @return The number of enqueued bytes, which is smaller than num_bytes if
+ * usb_midi_tx_buffer_send should be called before enqueueing the rest. A negative
+ * number on failure.
+ */
+int usb_midi_ump_tx_buffer_add_sysex8(uint8_t group, uint8_t stream_id, const uint8_t *data_bytes,
+				      uint32_t num_bytes, int is_start, int is_end);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+"""
+Converts the output of the "usb_midi capture dump" shell command into a pcap
+file that Wireshark opens, with one USB bulk transfer per captured transfer.
+
+The dump may be part of a longer shell or RTT log. Lines not belonging to the
+dump are skipped.
+
+The pcap file uses the Linux usbmon link type (LINKTYPE_USB_LINUX_MMAPPED).
+Transfers from the host (OUT) are written as URB submissions and transfers to
+the host (IN) as URB completions, i.e the way the host sees the data.
+
+Usage: usb_midi_capture_to_pcap.py shell.log capture.pcap
+"""
+import argparse
+import re
+import struct
+import sys
+
+LINKTYPE_USB_LINUX_MMAPPED = 220
+URB_TRANSFER_BULK = 3
+EINPROGRESS = 115
+
+FLAG_UMP = 1 << 0
+FLAG_TRANSFER_START = 1 << 1
+FLAG_TRIGGER = 1 << 2
+
+HEADER_RE = re.compile(r'usbmidi-capture hz=(\d+) entries=(\d+)')
+ENTRY_RE = re.compile(r'usbmidi ([0-9a-f]{8}) ([0-9a-f]{2}) ([0-9a-f]{2}) ([0-9a-f]{8})')
+
+
+def read_dump(path):
+    """Returns the cycle frequency and the list of (cycles, ep, flags, bytes) of the last dump."""
+    hz = None
+    entries = []
+    with open(path, errors='replace') as f:
+        for line in f:
+            match = HEADER_RE.search(line)
+            if match:
+                # A later dump replaces an earlier one
+                hz = int(match.group(1))
+                entries = []
+                continue
+            match = ENTRY_RE.search(line)
+            if match and hz is not None:
+                entries.append((int(match.group(1), 16), int(match.group(2), 16),
+                                int(match.group(3), 16), bytes.fromhex(match.group(4))))
+    if hz is None:
+        sys.exit(f'No usb_midi capture dump found in {path}')
+    return hz, entries
+
+
+def group_transfers(entries):
+    """Yields (cycles, ep, flags of all packets, data) per transfer."""
+    transfer = None
+    for cycles, ep, flags, packet in entries:
+        if transfer and (flags & FLAG_TRANSFER_START or ep != transfer[1]):
+            yield tuple(transfer)
+            transfer = None
+        if transfer is None:
+            transfer = [cycles, ep, 0, b'']
+        transfer[2] |= flags
+        transfer[3] += packet
+    if transfer:
+        yield tuple(transfer)
+
+
+def usbmon_header(urb_id, ep, ts_us, num_bytes):
+    is_in = ep & 0x80
+    return struct.pack('<QBBBBHBBqiiII8siiII',
+                       urb_id,
+                       ord('C') if is_in else ord('S'),
+                       URB_TRANSFER_BULK,
+                       ep,
+                       1,  # device number
+                       1,  # bus number
+                       ord('-'),  # no setup packet
+                       0,  # data present
+                       ts_us // 1000000,
+                       ts_us % 1000000,
+                       0 if is_in else -EINPROGRESS,
+                       num_bytes,
+                       num_bytes,
+                       bytes(8),
+                       0, 0, 0, 0)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0])
+    parser.add_argument('dump', help='A file containing the output of "usb_midi capture dump"')
+    parser.add_argument('pcap', help='The pcap file to write')
+    args = parser.parse_args()
+
+    hz, entries = read_dump(args.dump)
+    transfers = list(group_transfers(entries))
+
+    with open(args.pcap, 'wb') as f:
+        # Microsecond timestamps, max snapshot length of a high speed bulk transfer + header
+        f.write(struct.pack('<IHHiIII', 0xa1b2c3d4, 2, 4, 0, 0, 64 + 512,
+                            LINKTYPE_USB_LINUX_MMAPPED))
+        cycles = 0
+        prev_raw_cycles = None
+        for urb_id, (raw_cycles, ep, flags, data) in enumerate(transfers):
+            # The 32 bit cycle counter wraps, the entries are in order.
+            if prev_raw_cycles is not None:
+                cycles += (raw_cycles - prev_raw_cycles) & 0xffffffff
+            prev_raw_cycles = raw_cycles
+            ts_us = cycles * 1000000 // hz
+            record = usbmon_header(urb_id, ep, ts_us, len(data)) + data
+            f.write(struct.pack('<IIII', ts_us // 1000000, ts_us % 1000000, len(record),
+                                len(record)))
+            f.write(record)
+            if flags & FLAG_TRIGGER:
+                print(f'Trigger in transfer {urb_id + 1} at {ts_us / 1e6:.6f} s')
+
+    print(f'Wrote {len(transfers)} transfers ({len(entries)} packets) to {args.pcap}')
+
+
+if __name__ == '__main__':
+    main()
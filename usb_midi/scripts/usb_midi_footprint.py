@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+"""
+Reports the RAM and ROM used by the USB MIDI driver in a linked Zephyr image,
+per feature, and checks the totals against a budget.
+
+Input sections of the driver objects are read from the linker map file, so
+sections removed by --gc-sections are not counted. Whether a section takes
+RAM, ROM or both (initialized data) is given by the output section it was
+placed in, read from the ELF file.
+
+Usage: see the usb_midi_footprint build target in usb_midi/CMakeLists.txt
+"""
+import argparse
+import re
+import sys
+
+from elftools.elf.constants import SH_FLAGS
+from elftools.elf.elffile import ELFFile
+
+# Features of the objects other than usb_midi.c.obj
+OBJECT_FEATURES = {
+    'usb_midi_packet.c.obj': 'MIDI 1.0 packets and parser',
+    'usb_midi_ump.c.obj': 'MIDI 2.0 UMP',
+    'usb_midi_clock.c.obj': 'Clock and MTC',
+    'usb_midi_sched.c.obj': 'Scheduled TX',
+    'usb_midi_rate.c.obj': 'TX rate limiting',
+    'usb_midi_din.c.obj': 'DIN bridge',
+    'usb_midi_capture.c.obj': 'Packet capture',
+}
+
+# Features of the symbols of usb_midi.c.obj, by symbol name. First match wins.
+SYMBOL_FEATURES = [
+    ('Descriptors', re.compile(r'^(usb_midi_config(_data)?|jack_string_desc|gtb_descriptors|'
+                               r'midi_ep_cfg|__usb_midi_config.*)$')),
+    ('RX', re.compile(r'^(rx_.*|usb_midi_rx_.*|dispatch_rx_transfer|cable_states|midi1_parse_cb|'
+                      r'midi_out_ep_cb|ump_out_ep_cb)$')),
+    ('TX', re.compile(r'^(ep_pairs?.*|tx_.*|usb_midi_tx_.*|usb_midi_tx|usb_midi_ump_tx.*|'
+                      r'usb_midi_events?_from_.*|sysex_stream_.*|complete_tx_tokens|'
+                      r'discard_tx_buffers|midi_in_ep_cb|wait_for_tx_done|in_ep_addr|'
+                      r'is_ump_ep_pair|is_coalescable|coalesce_.*)$')),
+]
+
+DEFAULT_FEATURE = 'Core'
+
+# Descriptors placed by USBD_CLASS_DESCR_DEFINE and USBD_STRING_DESCR_USER_DEFINE
+DESCRIPTOR_SECTION_RE = re.compile(r'^\.?usb\.(descriptor|string)')
+
+# An input section with its address, size and object on a single line
+INPUT_SECTION_RE = re.compile(r'^ (\S+)\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S+)$')
+# An input section whose name is too long to share a line with the rest
+INPUT_SECTION_NAME_RE = re.compile(r'^ (\S+)$')
+INPUT_SECTION_REST_RE = re.compile(r'^\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S+)$')
+OUTPUT_SECTION_RE = re.compile(r'^(\S+)(\s+0x[0-9a-f]+\s+0x[0-9a-f]+)?')
+OBJECT_RE = re.compile(r'\((usb_midi[a-z0-9_]*\.c\.obj)\)$')
+
+
+def read_section_kinds(elf_path):
+    """Returns {output section name: (takes RAM, takes ROM)}."""
+    kinds = {}
+    with open(elf_path, 'rb') as f:
+        for section in ELFFile(f).iter_sections():
+            flags = section['sh_flags']
+            if not flags & SH_FLAGS.SHF_ALLOC:
+                continue
+            is_ram = bool(flags & SH_FLAGS.SHF_WRITE)
+            # Initialized data is copied from ROM to RAM at boot
+            is_rom = section['sh_type'] != 'SHT_NOBITS'
+            kinds[section.name] = (is_ram, is_rom)
+    return kinds
+
+
+def read_input_sections(map_path):
+    """Yields (output section, input section, size, object) for the driver objects."""
+    with open(map_path) as f:
+        lines = f.read().splitlines()
+    try:
+        start = lines.index('Linker script and memory map') + 1
+    except ValueError:
+        sys.exit(f'{map_path} is not a GNU ld map file')
+
+    output_section = None
+    pending_name = None
+    for line in lines[start:]:
+        if line and not line[0].isspace():
+            output_section = OUTPUT_SECTION_RE.match(line).group(1)
+            pending_name = None
+            continue
+        if pending_name:
+            match = INPUT_SECTION_REST_RE.match(line)
+            name, pending_name = pending_name, None
+            if match:
+                yield output_section, name, int(match.group(2), 16), match.group(3)
+                continue
+        match = INPUT_SECTION_RE.match(line)
+        if match:
+            yield output_section, match.group(1), int(match.group(3), 16), match.group(4)
+            continue
+        match = INPUT_SECTION_NAME_RE.match(line)
+        if match and not match.group(1).startswith('*'):
+            pending_name = match.group(1)
+
+
+def feature_for(object_name, input_section):
+    if object_name in OBJECT_FEATURES:
+        return OBJECT_FEATURES[object_name]
+    if DESCRIPTOR_SECTION_RE.match(input_section):
+        return 'Descriptors'
+    # With -ffunction-sections and -fdata-sections, e.g .bss.rx_buffer
+    symbol = input_section.rsplit('.', 1)[-1]
+    for feature, pattern in SYMBOL_FEATURES:
+        if pattern.match(symbol):
+            return feature
+    return DEFAULT_FEATURE
+
+
+def check_budget(name, used, budget):
+    if budget == 0:
+        print(f'{name}: {used} bytes')
+        return True
+    print(f'{name}: {used} of {budget} bytes ({100 * used / budget:.0f}%)')
+    return used <= budget
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0])
+    parser.add_argument('--elf', required=True)
+    parser.add_argument('--map', required=True)
+    parser.add_argument('--ram-budget', type=int, default=0)
+    parser.add_argument('--rom-budget', type=int, default=0)
+    args = parser.parse_args()
+
+    try:
+        kinds = read_section_kinds(args.elf)
+        input_sections = list(read_input_sections(args.map))
+    except FileNotFoundError as e:
+        sys.exit(f'{e.filename} not found, build the app before running this target')
+
+    ram = {}
+    rom = {}
+    for output_section, input_section, size, obj in input_sections:
+        match = OBJECT_RE.search(obj)
+        if not match or output_section not in kinds or size == 0:
+            continue
+        feature = feature_for(match.group(1), input_section)
+        is_ram, is_rom = kinds[output_section]
+        if is_ram:
+            ram[feature] = ram.get(feature, 0) + size
+        if is_rom:
+            rom[feature] = rom.get(feature, 0) + size
+
+    features = sorted(set(ram) | set(rom))
+    print(f'{"Feature":<32}{"ROM":>8}{"RAM":>8}')
+    for feature in features:
+        print(f'{feature:<32}{rom.get(feature, 0):>8}{ram.get(feature, 0):>8}')
+    total_ram = sum(ram.values())
+    total_rom = sum(rom.values())
+    print(f'{"Total":<32}{total_rom:>8}{total_ram:>8}')
+    print()
+
+    within_budget = check_budget('RAM', total_ram, args.ram_budget)
+    within_budget &= check_budget('ROM', total_rom, args.rom_budget)
+    if not within_budget:
+        sys.exit('USB MIDI driver footprint exceeds the budget, see '
+                 'CONFIG_USB_MIDI_FOOTPRINT_RAM_BUDGET and CONFIG_USB_MIDI_FOOTPRINT_ROM_BUDGET')
+
+
+if __name__ == '__main__':
+    main()
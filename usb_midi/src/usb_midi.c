@@ -1,10 +1,18 @@
+#include <string.h>
 #include <zephyr/init.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/__assert.h>
+#include <zephyr/sys/byteorder.h>
 #include <zephyr/usb/usb_device.h>
 #include <usb_descriptor.h>
 #include <usb_midi/usb_midi.h>
 #include "usb_midi_types.h"
 #include "usb_midi_macros.h"
 #include "usb_midi_packet.h"
+#include "usb_midi_ump.h"
+#include "usb_midi_capture.h"
+#include "usb_midi_rate.h"
+#include "usb_midi_din.h"
 
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(usb_midi, CONFIG_USB_MIDI_LOG_LEVEL);
@@ -13,6 +21,10 @@ LOG_MODULE_REGISTER(usb_midi, CONFIG_USB_MIDI_LOG_LEVEL);
 									   packet.bytes[0], packet.bytes[1], packet.bytes[2], packet.bytes[3],            \
 									   packet.cable_num, packet.cin, packet.num_midi_bytes)
 
+/*
+ * Not const, since the USB stack assigns interface numbers and endpoint
+ * addresses in place when it is initialized.
+ */
 USBD_CLASS_DESCR_DEFINE(primary, 0)
 struct usb_midi_config usb_midi_config_data = {
 	.ac_if = INIT_AC_IF,
@@ -30,34 +42,493 @@ struct usb_midi_config usb_midi_config_data = {
 		#endif
 	},
 	.element = INIT_ELEMENT,
-	.in_ep = INIT_IN_EP,
-	.in_cs_ep = {
-		.bLength = sizeof(struct usb_midi_bulk_in_ep_descriptor),
-		.bDescriptorType = USB_DESC_CS_ENDPOINT,
-		.bDescriptorSubtype = 0x01,
-		.bNumEmbMIDIJack = CONFIG_USB_MIDI_NUM_OUTPUTS,
-		.BaAssocJackID = {
-			#if CONFIG_USB_MIDI_NUM_OUTPUTS > 0
-				LISTIFY(CONFIG_USB_MIDI_NUM_OUTPUTS, IDX_WITH_OFFSET, (, ), 1)
-			#endif
-		}
+	.out_ep = INIT_OUT_EP(0x01),
+	.out_cs_ep = INIT_CS_EP(struct usb_midi_bulk_out_ep_descriptor, USB_MIDI_PRIMARY_NUM_INPUTS),
+	.in_ep = INIT_IN_EP(0x81),
+	.in_cs_ep = INIT_CS_EP(struct usb_midi_bulk_in_ep_descriptor, USB_MIDI_PRIMARY_NUM_OUTPUTS),
+#ifdef CONFIG_USB_MIDI_SECONDARY_EP_PAIR
+	.secondary_out_ep = INIT_OUT_EP(0x02),
+	.secondary_out_cs_ep = INIT_CS_EP(struct usb_midi_secondary_bulk_out_ep_descriptor,
+					  USB_MIDI_SECONDARY_NUM_INPUTS),
+	.secondary_in_ep = INIT_IN_EP(0x82),
+	.secondary_in_cs_ep = INIT_CS_EP(struct usb_midi_secondary_bulk_in_ep_descriptor,
+					 USB_MIDI_SECONDARY_NUM_OUTPUTS),
+#endif
+#ifdef CONFIG_USB_MIDI_2_0
+	.ms2_if = INIT_MS2_IF,
+	.ms2_cs_if = INIT_MS2_CS_IF,
+	.ump_out_ep = INIT_UMP_EP(0x03),
+	.ump_out_cs_ep = INIT_UMP_CS_EP,
+	.ump_in_ep = INIT_UMP_EP(0x83),
+	.ump_in_cs_ep = INIT_UMP_CS_EP,
+#endif
+};
+
+#ifdef CONFIG_USB_MIDI_2_0
+/* Returned on request, so not part of the configuration descriptor. */
+static const struct usb_midi2_gtb_descriptors gtb_descriptors = INIT_GTB_DESCRIPTORS;
+/* The endpoint pair of the MIDI 2.0 alternate setting follows the MIDI 1.0 pairs. */
+#define UMP_EP_PAIR_IDX USB_MIDI_NUM_EP_PAIRS
+#define NUM_TX_EP_PAIRS (USB_MIDI_NUM_EP_PAIRS + 1)
+#else
+#define NUM_TX_EP_PAIRS USB_MIDI_NUM_EP_PAIRS
+#endif
+
+#ifdef CONFIG_USB_MIDI_TX
+#ifdef CONFIG_USB_MIDI_TX_COALESCE
+/* Twice the max number of packets per transfer, to keep collisions rare */
+#define NUM_COALESCE_SLOTS (EP_MAX_PACKET_SIZE / 2)
+#endif
+
+/* The number of bytes of a transfer enqueued with a given token. */
+struct usb_midi_tx_token_entry_t {
+	struct usb_midi_tx_token *token;
+	uint32_t num_bytes;
+};
+
+struct usb_midi_tx_completion_t {
+	struct usb_midi_tx_token *token;
+	uint32_t num_bytes;
+	int status;
+};
+
+/*
+ * Token callbacks that became due with tx_lock held. They are invoked after
+ * releasing it, since they may enqueue and send more data. Room for discarding
+ * the in flight and enqueued tokens of an endpoint pair and its sysex stream.
+ */
+struct usb_midi_tx_completions_t {
+	int num_entries;
+	struct usb_midi_tx_completion_t entries[2 * CONFIG_USB_MIDI_TX_MAX_TOKENS + 1];
+};
+
+/* A sysex message sent from multiple buffers, see usb_midi_tx_sysexv. */
+struct usb_midi_sysex_stream_t {
+	int is_active;
+	uint8_t cable_number;
+	const struct usb_midi_iov *iov;
+	int iov_cnt;
+	/* The position of the next byte to enqueue */
+	int iov_idx;
+	uint32_t iov_offset;
+	/* The number of enqueued sysex bytes */
+	uint32_t num_enqueued_bytes;
+	/* The number of USB bytes enqueued but not yet transferred */
+	uint32_t num_pending_bytes;
+	/* Tracks the enqueued bytes */
+	struct usb_midi_tx_token token;
+	/* Reported when the whole message has been transferred */
+	struct usb_midi_tx_token *user_token;
+};
+
+/* Transmit state of a pair of bulk IN and OUT endpoints. */
+struct usb_midi_ep_pair_t {
+	/* Index of the IN endpoint in midi_ep_cfg. The OUT endpoint follows it. */
+	uint8_t ep_cfg_idx;
+	/* The number of bytes sent per IN transfer, i.e the size of the IN endpoint. */
+	int tx_max_size;
+	int tx_buffer_size;
+	/* Word aligned, since UMPs are encoded in place */
+	uint8_t tx_buffer[EP_MAX_PACKET_SIZE] __aligned(4);
+	/* Tokens of the bytes in tx_buffer */
+	int num_tx_tokens;
+	struct usb_midi_tx_token_entry_t tx_tokens[CONFIG_USB_MIDI_TX_MAX_TOKENS];
+	/* Tokens of the bytes of the IN transfer in progress */
+	int num_in_flight_tokens;
+	struct usb_midi_tx_token_entry_t in_flight_tokens[CONFIG_USB_MIDI_TX_MAX_TOKENS];
+	/* Non-zero if tx_buffer should be sent as soon as the IN endpoint is free */
+	int send_pending;
+	/* The number of bytes of priority messages at the start of tx_buffer */
+	int tx_prio_size;
+	/* Priority messages waiting for room at the start of the next IN transfer */
+	int num_prio_packets;
+	uint8_t prio_packets[CONFIG_USB_MIDI_TX_PRIORITY_SLOTS][4];
+	struct usb_midi_sysex_stream_t sysex_stream;
+#ifdef CONFIG_USB_MIDI_TX_COALESCE
+	/*
+	 * Offset + 1 of the last enqueued message of each coalescing key hash, or 0.
+	 * Relative to the end of the priority messages, which are moved in front.
+	 */
+	uint16_t coalesce_slots[NUM_COALESCE_SLOTS];
+#endif
+	/* Non-zero if tx_buffer is sent again by the retry timer, once retry_ticks is reached */
+	int retry_is_pending;
+	int64_t retry_ticks;
+	/* The number of retries of the failing IN transfer, 0 after a successful one */
+	int num_tx_retries;
+};
+
+static int ep_pair_tx_buffer_send(struct usb_midi_ep_pair_t *ep_pair,
+				  struct usb_midi_tx_completions_t *done);
+static int ep_pair_send(struct usb_midi_ep_pair_t *ep_pair);
+static void ep_pair_refill(struct usb_midi_ep_pair_t *ep_pair,
+			   struct usb_midi_tx_completions_t *done);
+static void sysex_stream_finish(struct usb_midi_sysex_stream_t *stream, int status,
+				struct usb_midi_tx_completions_t *done);
+#endif
+
+static void midi_in_ep_cb(uint8_t ep, enum usb_dc_ep_cb_status_code ep_status);
+static void midi_out_ep_cb(uint8_t ep, enum usb_dc_ep_cb_status_code ep_status);
+#ifdef CONFIG_USB_MIDI_RX_FLOW_CONTROL
+static void rx_queue_clear();
+#endif
+#ifdef CONFIG_USB_MIDI_2_0
+static void ump_out_ep_cb(uint8_t ep, enum usb_dc_ep_cb_status_code ep_status);
+#endif
+
+/* Not const, since the USB stack assigns the endpoint addresses. */
+static struct usb_ep_cfg_data midi_ep_cfg[] = {
+	{
+		.ep_cb = midi_in_ep_cb,
+		.ep_addr = 0x81,
+	},
+	{
+		.ep_cb = midi_out_ep_cb,
+		.ep_addr = 0x01,
+	},
+#ifdef CONFIG_USB_MIDI_SECONDARY_EP_PAIR
+	{
+		.ep_cb = midi_in_ep_cb,
+		.ep_addr = 0x82,
+	},
+	{
+		.ep_cb = midi_out_ep_cb,
+		.ep_addr = 0x02,
+	},
+#endif
+#ifdef CONFIG_USB_MIDI_2_0
+	{
+		.ep_cb = midi_in_ep_cb,
+		.ep_addr = 0x83,
+	},
+	{
+		.ep_cb = ump_out_ep_cb,
+		.ep_addr = 0x03,
 	},
-	.out_ep = INIT_OUT_EP,
-	.out_cs_ep = {
-		.bLength = sizeof(struct usb_midi_bulk_out_ep_descriptor),
-		.bDescriptorType = USB_DESC_CS_ENDPOINT,
-		.bDescriptorSubtype = 0x01,
-		.bNumEmbMIDIJack = CONFIG_USB_MIDI_NUM_INPUTS,
-		.BaAssocJackID = {
-			#if CONFIG_USB_MIDI_NUM_INPUTS > 0
-				LISTIFY(CONFIG_USB_MIDI_NUM_INPUTS, IDX_WITH_OFFSET, (, ), 1 + CONFIG_USB_MIDI_NUM_OUTPUTS)
-			#endif
+#endif
+};
+
+#ifdef CONFIG_USB_MIDI_TX
+static struct usb_midi_ep_pair_t ep_pairs[NUM_TX_EP_PAIRS] = {
+	{.ep_cfg_idx = 0, .tx_max_size = EP_MAX_PACKET_SIZE},
+#ifdef CONFIG_USB_MIDI_SECONDARY_EP_PAIR
+	{.ep_cfg_idx = 2, .tx_max_size = EP_MAX_PACKET_SIZE},
+#endif
+#ifdef CONFIG_USB_MIDI_2_0
+	{.ep_cfg_idx = 2 * UMP_EP_PAIR_IDX, .tx_max_size = EP_MAX_PACKET_SIZE},
+#endif
+};
+
+/*
+ * Wakes the threads blocked in usb_midi_tx_wait and usb_midi_tx_buffer_add_wait
+ * when an IN transfer completes, i.e when a busy IN endpoint frees up. Each
+ * completion increments tx_done_count and gives the semaphore once per waiting
+ * thread, so that all of them retry. Both counters are protected by tx_lock.
+ */
+static K_SEM_DEFINE(tx_done_sem, 0, K_SEM_MAX_LIMIT);
+static uint32_t tx_done_count;
+static int num_tx_waiters;
+
+/*
+ * Protects the endpoint pairs, the producers and the IN endpoint writes.
+ * Data is enqueued and sent from threads, the IN endpoint ISR, timers and the
+ * DIN bridge UART ISR.
+ */
+static struct k_spinlock tx_lock;
+#endif
+
+#ifdef CONFIG_USB_MIDI_RX
+#ifndef CONFIG_USB_MIDI_RX_FLOW_CONTROL
+/* Word aligned, since rx_raw_cb reads the packets in place */
+static uint8_t rx_buffer[EP_MAX_PACKET_SIZE] __aligned(4);
+#endif
+
+/* Per cable RX parser state, tracking sysex messages and single byte streams (CIN 0xf). */
+static struct usb_midi_cable_state_t cable_states[CONFIG_USB_MIDI_NUM_INPUTS];
+#endif
+
+/* Non-zero if the host has selected the MIDI 2.0 alternate setting. */
+static int ump_is_active = 0;
+
+/* Non-zero while the host has suspended the device. Enqueued data is sent on resume. */
+static int usb_midi_suspended = 0;
+static struct usb_midi_resume_stats resume_stats;
+/* Non-zero from a remote wakeup request until the resume */
+static int wakeup_is_requested = 0;
+static uint32_t wakeup_request_cycles;
+/* Non-zero from a resume until the first IN transfer has completed */
+static int resume_tx_is_pending = 0;
+static uint32_t resume_cycles;
+static struct usb_midi_recovery_stats recovery_stats;
+
+static void update_latency(uint32_t start_cycles, uint32_t *last_us, uint32_t *max_us)
+{
+	*last_us = k_cyc_to_us_floor32(k_cycle_get_32() - start_cycles);
+	*max_us = MAX(*max_us, *last_us);
+}
+
+#ifdef CONFIG_USB_MIDI_REMOTE_WAKEUP
+/* Asks a suspended host to resume, so that data sent while suspended goes out right away. */
+static void request_remote_wakeup()
+{
+	if (wakeup_is_requested) {
+		return;
+	}
+	int rc = usb_wakeup_request();
+	if (rc != 0) {
+		/* E.g the host has not enabled remote wakeup. Wait for it to resume. */
+		LOG_DBG("Remote wakeup request failed with error %d", rc);
+		return;
+	}
+	wakeup_is_requested = 1;
+	wakeup_request_cycles = k_cycle_get_32();
+	resume_stats.num_remote_wakeups++;
+}
+#endif
+
+#ifdef CONFIG_USB_MIDI_TX
+
+static int is_ump_ep_pair(struct usb_midi_ep_pair_t *ep_pair)
+{
+#ifdef CONFIG_USB_MIDI_2_0
+	return ep_pair == &ep_pairs[UMP_EP_PAIR_IDX];
+#else
+	return 0;
+#endif
+}
+
+static struct usb_midi_ep_pair_t *ep_pair_for_cable(uint8_t cable_number)
+{
+#ifdef CONFIG_USB_MIDI_2_0
+	if (ump_is_active) {
+		/* All groups share the MIDI 2.0 endpoint pair */
+		return &ep_pairs[UMP_EP_PAIR_IDX];
+	}
+#endif
+	return &ep_pairs[cable_number >= USB_MIDI_SECONDARY_FIRST_CABLE ? 1 : 0];
+}
+
+static uint8_t in_ep_addr(struct usb_midi_ep_pair_t *ep_pair)
+{
+	/* The endpoint address may have been changed by the USB stack. */
+	return midi_ep_cfg[ep_pair->ep_cfg_idx].ep_addr;
+}
+
+/* Starts an IN transfer. */
+static int ep_pair_write(struct usb_midi_ep_pair_t *ep_pair, const uint8_t *bytes,
+			 uint32_t num_bytes)
+{
+	if (usb_midi_suspended) {
+		/* Like a busy endpoint. The caller keeps the data and sends it on resume. */
+#ifdef CONFIG_USB_MIDI_REMOTE_WAKEUP
+		request_remote_wakeup();
+#endif
+		return -EAGAIN;
+	}
+	int write_result = usb_write(in_ep_addr(ep_pair), bytes, num_bytes, NULL);
+	if (write_result == 0) {
+		usb_midi_capture_transfer(in_ep_addr(ep_pair), bytes, num_bytes,
+					  is_ump_ep_pair(ep_pair));
+	}
+	return write_result;
+}
+
+static struct usb_midi_ep_pair_t *ep_pair_for_in_ep(uint8_t ep)
+{
+	for (int i = 0; i < NUM_TX_EP_PAIRS; i++) {
+		if (in_ep_addr(&ep_pairs[i]) == ep) {
+			return &ep_pairs[i];
 		}
 	}
-};
+	return NULL;
+}
+
+static int ep_pair_can_add_token(struct usb_midi_ep_pair_t *ep_pair,
+				 struct usb_midi_tx_token *token)
+{
+	if (token == NULL || ep_pair->num_tx_tokens < CONFIG_USB_MIDI_TX_MAX_TOKENS) {
+		return 1;
+	}
+	for (int i = 0; i < ep_pair->num_tx_tokens; i++) {
+		if (ep_pair->tx_tokens[i].token == token) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void ep_pair_add_token_bytes(struct usb_midi_ep_pair_t *ep_pair,
+				    struct usb_midi_tx_token *token, uint32_t num_bytes)
+{
+	if (token == NULL || num_bytes == 0) {
+		return;
+	}
+	/* Coalesce all bytes of a token in a transfer into a single completion. */
+	for (int i = 0; i < ep_pair->num_tx_tokens; i++) {
+		if (ep_pair->tx_tokens[i].token == token) {
+			ep_pair->tx_tokens[i].num_bytes += num_bytes;
+			return;
+		}
+	}
+	__ASSERT_NO_MSG(ep_pair->num_tx_tokens < CONFIG_USB_MIDI_TX_MAX_TOKENS);
+	ep_pair->tx_tokens[ep_pair->num_tx_tokens].token = token;
+	ep_pair->tx_tokens[ep_pair->num_tx_tokens].num_bytes = num_bytes;
+	ep_pair->num_tx_tokens++;
+}
+
+#ifdef CONFIG_USB_MIDI_TX_COALESCE
+/*
+ * Returns non-zero if only the latest value of the message in a packet
+ * matters. Controllers that are part of a sequence (bank select, RPN, NRPN
+ * and data entry), switches and channel mode messages keep every value.
+ */
+static int is_coalescable(const uint8_t *packet)
+{
+	switch (packet[0] & 0x0f) {
+	case USB_MIDI_CIN_POLY_KEYPRESS:
+	case USB_MIDI_CIN_CHANNEL_PRESSURE:
+	case USB_MIDI_CIN_PITCH_BEND_CHANGE:
+		return 1;
+	case USB_MIDI_CIN_CONTROL_CHANGE: {
+		uint8_t controller = packet[2];
+		return !(controller == 0 || controller == 6 || controller == 32 ||
+			 controller == 38 || (controller >= 64 && controller <= 69) ||
+			 (controller >= 96 && controller <= 101) || controller >= 120);
+	}
+	default:
+		return 0;
+	}
+}
+
+/* The cable, message type, channel and, if any, key or controller of a message. */
+static uint32_t coalesce_key(const uint8_t *packet)
+{
+	uint32_t key = packet[0] | (packet[1] << 8);
+	uint8_t cin = packet[0] & 0x0f;
+	if (cin == USB_MIDI_CIN_POLY_KEYPRESS || cin == USB_MIDI_CIN_CONTROL_CHANGE) {
+		key |= packet[2] << 16;
+	}
+	return key;
+}
+
+static uint16_t *coalesce_slot(struct usb_midi_ep_pair_t *ep_pair, uint32_t key)
+{
+	/* Fibonacci hashing, which takes the top bits since every key bit only affects higher bits */
+	return &ep_pair->coalesce_slots[(key * 2654435761U) >> (32 - __builtin_ctz(NUM_COALESCE_SLOTS))];
+}
+
+/*
+ * Overwrites the enqueued message with the same key as a coalescable packet
+ * with the packet, if there is one. Returns non-zero if it did.
+ */
+static int ep_pair_coalesce(struct usb_midi_ep_pair_t *ep_pair, const uint8_t *packet)
+{
+	uint32_t key = coalesce_key(packet);
+	uint16_t slot = *coalesce_slot(ep_pair, key);
+	int offset = ep_pair->tx_prio_size + slot - 1;
+	/*
+	 * Slots are not cleared when tx_buffer is sent or when another key with
+	 * the same hash is enqueued, so check that the message is still there.
+	 */
+	if (slot == 0 || offset + 4 > ep_pair->tx_buffer_size ||
+	    coalesce_key(&ep_pair->tx_buffer[offset]) != key) {
+		return 0;
+	}
+	memcpy(&ep_pair->tx_buffer[offset], packet, 4);
+	return 1;
+}
+
+/* Makes a message just enqueued at the end of tx_buffer the one to coalesce with. */
+static void ep_pair_coalesce_track(struct usb_midi_ep_pair_t *ep_pair, const uint8_t *packet,
+				   struct usb_midi_tx_token *token)
+{
+	if (is_coalescable(packet)) {
+		/* A message enqueued with a token is sent as is */
+		*coalesce_slot(ep_pair, coalesce_key(packet)) =
+			token ? 0 : ep_pair->tx_buffer_size - 4 - ep_pair->tx_prio_size + 1;
+	}
+}
+#endif
+
+static void tx_completions_add(struct usb_midi_tx_completions_t *done,
+			       struct usb_midi_tx_token *token, uint32_t num_bytes, int status)
+{
+	__ASSERT_NO_MSG(done->num_entries < ARRAY_SIZE(done->entries));
+	struct usb_midi_tx_completion_t *entry = &done->entries[done->num_entries++];
+	entry->token = token;
+	entry->num_bytes = num_bytes;
+	entry->status = status;
+}
+
+/* Completes a list of tokens of an endpoint pair. Called with tx_lock held. */
+static void complete_tx_tokens(struct usb_midi_tx_completions_t *done,
+			       const struct usb_midi_tx_token_entry_t *entries, int num_entries,
+			       int status)
+{
+	for (int i = 0; i < num_entries; i++) {
+		tx_completions_add(done, entries[i].token, entries[i].num_bytes, status);
+	}
+}
+
+/* Invokes the collected token callbacks. Must be called without tx_lock held. */
+static void tx_completions_run(struct usb_midi_tx_completions_t *done)
+{
+	for (int i = 0; i < done->num_entries; i++) {
+		struct usb_midi_tx_token *token = done->entries[i].token;
+		if (token->cb) {
+			token->cb(token, done->entries[i].num_bytes, done->entries[i].status);
+		}
+	}
+}
+
+/*
+ * Drops the data of an endpoint pair, reporting the status to the tokens.
+ * Called with tx_lock held.
+ */
+static void ep_pair_discard(struct usb_midi_ep_pair_t *ep_pair, int status,
+			    struct usb_midi_tx_completions_t *done)
+{
+	complete_tx_tokens(done, ep_pair->in_flight_tokens, ep_pair->num_in_flight_tokens, status);
+	complete_tx_tokens(done, ep_pair->tx_tokens, ep_pair->num_tx_tokens, status);
+	ep_pair->num_in_flight_tokens = 0;
+	ep_pair->num_tx_tokens = 0;
+	ep_pair->tx_buffer_size = 0;
+	ep_pair->send_pending = 0;
+	ep_pair->tx_prio_size = 0;
+	ep_pair->num_prio_packets = 0;
+	ep_pair->retry_is_pending = 0;
+	ep_pair->num_tx_retries = 0;
+	if (ep_pair->sysex_stream.is_active) {
+		/* The completions of its enqueued bytes are ignored once it has finished */
+		sysex_stream_finish(&ep_pair->sysex_stream, status, done);
+	}
+}
+
+/* Lets all blocked senders retry. */
+static void tx_done_broadcast()
+{
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	int num_woken = num_tx_waiters;
+	num_tx_waiters = 0;
+	tx_done_count++;
+	k_spin_unlock(&tx_lock, key);
+	for (int i = 0; i < num_woken; i++) {
+		k_sem_give(&tx_done_sem);
+	}
+}
 
-static int temp_tx_buffer_size = 0;
-static uint8_t temp_tx_buffer[EP_MAX_PACKET_SIZE];
+static void discard_tx_buffers()
+{
+	for (int i = 0; i < NUM_TX_EP_PAIRS; i++) {
+		struct usb_midi_tx_completions_t done = {0};
+		k_spinlock_key_t key = k_spin_lock(&tx_lock);
+		ep_pair_discard(&ep_pairs[i], -ECONNRESET, &done);
+		k_spin_unlock(&tx_lock, key);
+		tx_completions_run(&done);
+	}
+	usb_midi_rate_limit_discard(-ECONNRESET);
+}
+#endif
 
 static int usb_midi_is_available = false;
 static struct usb_midi_cb_t user_callbacks = {
@@ -66,17 +537,73 @@ static struct usb_midi_cb_t user_callbacks = {
 	.tx_done_cb = NULL,
 	.sysex_data_cb = NULL,
 	.sysex_end_cb = NULL,
-	.sysex_start_cb = NULL};
+	.sysex_start_cb = NULL,
+	.sysex_abort_cb = NULL,
+	.sysex8_cb = NULL,
+	.ump_cb = NULL,
+	.rx_queued_cb = NULL,
+	.suspended_cb = NULL,
+	.rx_raw_cb = NULL};
+
+#ifdef CONFIG_USB_MIDI_RX
+static struct usb_midi_parse_cb_t midi1_parse_cb()
+{
+	struct usb_midi_parse_cb_t parse_cb = {
+		.message_cb = user_callbacks.midi_message_cb,
+		.sysex_data_cb = user_callbacks.sysex_data_cb,
+		.sysex_end_cb = user_callbacks.sysex_end_cb,
+		.sysex_start_cb = user_callbacks.sysex_start_cb,
+		.sysex_abort_cb = user_callbacks.sysex_abort_cb,
+		.cable_states = cable_states,
+		.num_cable_states = CONFIG_USB_MIDI_NUM_INPUTS};
+	return parse_cb;
+}
+#endif
 
 static void availability_changed(int is_available) {
+	/* Configuring, resetting or disconnecting the device ends a suspend. */
+	usb_midi_suspended = 0;
+	wakeup_is_requested = 0;
+	resume_tx_is_pending = 0;
 	if (usb_midi_is_available == is_available) {
 		return;
 	}
 
 	LOG_INF("device became %s ", is_available ? "available" : "unavailable");
 
+#ifdef CONFIG_USB_MIDI_TX
+	/* Data enqueued before a reset or disconnect will never be sent. */
+	discard_tx_buffers();
+#endif
+#ifdef CONFIG_USB_MIDI_RX_FLOW_CONTROL
+	rx_queue_clear();
+#endif
+#ifdef CONFIG_USB_MIDI_RX
+	/* A message in progress will never be completed. */
+	struct usb_midi_parse_cb_t parse_cb = midi1_parse_cb();
+	usb_midi_reset_cable_states(&parse_cb);
+#endif
+
 	if (is_available) {
-		temp_tx_buffer_size = 0;
+		/* The host selects the MIDI 2.0 alternate setting after configuring the device. */
+#ifdef CONFIG_USB_MIDI_TX
+		k_spinlock_key_t key = k_spin_lock(&tx_lock);
+		ump_is_active = 0;
+		for (int i = 0; i < NUM_TX_EP_PAIRS; i++) {
+			struct usb_midi_ep_pair_t *ep_pair = &ep_pairs[i];
+			/*
+			 * The controller may have configured the IN endpoint with a smaller
+			 * size than the descriptor, e.g a high speed capable controller
+			 * running at full speed.
+			 */
+			int in_ep_mps = usb_dc_ep_mps(in_ep_addr(ep_pair));
+			ep_pair->tx_max_size = in_ep_mps > 0 ? MIN(in_ep_mps, EP_MAX_PACKET_SIZE) & ~0x3
+							     : EP_MAX_PACKET_SIZE;
+		}
+		k_spin_unlock(&tx_lock, key);
+#else
+		ump_is_active = 0;
+#endif
 	}
 	if (user_callbacks.available_cb) {
 		user_callbacks.available_cb(is_available);
@@ -84,6 +611,70 @@ static void availability_changed(int is_available) {
 	usb_midi_is_available = is_available;
 }
 
+static void suspended_changed(int is_suspended)
+{
+	if (usb_midi_suspended == is_suspended || !usb_midi_is_available) {
+		return;
+	}
+
+	LOG_INF("device %s", is_suspended ? "suspended" : "resumed");
+	usb_midi_suspended = is_suspended;
+	if (is_suspended) {
+		resume_stats.num_suspends++;
+	} else {
+		resume_stats.num_resumes++;
+		if (wakeup_is_requested) {
+			update_latency(wakeup_request_cycles, &resume_stats.last_wakeup_us,
+				       &resume_stats.max_wakeup_us);
+			wakeup_is_requested = 0;
+		}
+		resume_tx_is_pending = 1;
+		resume_cycles = k_cycle_get_32();
+#ifdef CONFIG_USB_MIDI_TX
+		/* Send what was enqueued while suspended */
+		for (int i = 0; i < NUM_TX_EP_PAIRS; i++) {
+			struct usb_midi_tx_completions_t done = {0};
+			k_spinlock_key_t key = k_spin_lock(&tx_lock);
+			if (ep_pairs[i].send_pending) {
+				ep_pair_tx_buffer_send(&ep_pairs[i], &done);
+			}
+			k_spin_unlock(&tx_lock, key);
+			tx_completions_run(&done);
+		}
+		/* Let blocked senders retry */
+		tx_done_broadcast();
+#endif
+	}
+	if (user_callbacks.suspended_cb) {
+		user_callbacks.suspended_cb(is_suspended);
+	}
+}
+
+int usb_midi_is_suspended()
+{
+	return usb_midi_suspended;
+}
+
+void usb_midi_resume_stats_get(struct usb_midi_resume_stats *stats)
+{
+	*stats = resume_stats;
+}
+
+void usb_midi_resume_stats_reset()
+{
+	memset(&resume_stats, 0, sizeof(resume_stats));
+}
+
+void usb_midi_recovery_stats_get(struct usb_midi_recovery_stats *stats)
+{
+	*stats = recovery_stats;
+}
+
+void usb_midi_recovery_stats_reset()
+{
+	memset(&recovery_stats, 0, sizeof(recovery_stats));
+}
+
 void usb_midi_register_callbacks(struct usb_midi_cb_t *cb)
 {
 	user_callbacks.available_cb = cb->available_cb;
@@ -92,68 +683,423 @@ void usb_midi_register_callbacks(struct usb_midi_cb_t *cb)
 	user_callbacks.sysex_start_cb = cb->sysex_start_cb;
 	user_callbacks.sysex_data_cb = cb->sysex_data_cb;
 	user_callbacks.sysex_end_cb = cb->sysex_end_cb;
+	user_callbacks.sysex_abort_cb = cb->sysex_abort_cb;
+	user_callbacks.sysex8_cb = cb->sysex8_cb;
+	user_callbacks.ump_cb = cb->ump_cb;
+	user_callbacks.rx_queued_cb = cb->rx_queued_cb;
+	user_callbacks.suspended_cb = cb->suspended_cb;
+	user_callbacks.rx_raw_cb = cb->rx_raw_cb;
 }
 
-static void midi_out_ep_cb(uint8_t ep, enum usb_dc_ep_cb_status_code ep_status)
+/*
+ * Drops what an OUT endpoint holds after a failed read and lets the host
+ * send again. Otherwise the endpoint would NAK until the device is reset.
+ */
+static void out_ep_restart(uint8_t ep)
 {
-	if (ep_status == USB_DC_EP_DATA_OUT) {
-		uint8_t buf[4];
-		uint32_t num_read_bytes = 1;
-		while (num_read_bytes > 0)
-		{
-			int read_rc = usb_read(ep, buf, 4, &num_read_bytes);
-			if (read_rc != 0) {
-				LOG_ERR("Failed to read from endpoint %d with error %d", ep, read_rc);
-				return;
-			}
-			if (num_read_bytes == 0)
-			{
-				break;
-			}
+	usb_dc_ep_flush(ep);
+	usb_dc_ep_read_continue(ep);
+	recovery_stats.num_rx_restarts++;
+}
+
+/*
+ * Converts word aligned packets in place between USB byte order and native
+ * words, so that they are read and encoded without a copy on the stack.
+ * Converting twice restores them. Nothing to do on little endian targets.
+ */
+static inline void swap_usb_words(uint8_t *buf, uint32_t num_words)
+{
+#ifdef CONFIG_BIG_ENDIAN
+	uint32_t *words = (uint32_t *)buf;
+	for (uint32_t i = 0; i < num_words; i++) {
+		words[i] = sys_le32_to_cpu(words[i]);
+	}
+#endif
+}
+
+#ifdef CONFIG_USB_MIDI_RX
+
+/* Parses a received transfer and invokes the user callbacks. */
+static void dispatch_rx_transfer(uint8_t *buf, uint32_t num_bytes, int is_ump)
+{
+#ifdef CONFIG_USB_MIDI_2_0
+	if (is_ump) {
+		struct usb_midi_ump_parse_cb_t parse_cb = {
+			.midi1 = {
+				.message_cb = user_callbacks.midi_message_cb,
+				.sysex_data_cb = user_callbacks.sysex_data_cb,
+				.sysex_end_cb = user_callbacks.sysex_end_cb,
+				.sysex_start_cb = user_callbacks.sysex_start_cb},
+			.sysex8_cb = user_callbacks.sysex8_cb,
+			.ump_cb = user_callbacks.ump_cb};
+		enum usb_midi_error_t error = usb_midi_ump_parse_transfer(buf, num_bytes, &parse_cb);
+		if (error != USB_MIDI_SUCCESS) {
+			LOG_ERR("Failed to parse UMP transfer with error %d", error);
+#ifdef CONFIG_USB_MIDI_CAPTURE_TRIGGER_ON_ERROR
+			usb_midi_capture_trigger();
+#endif
+		}
+		return;
+	}
+#endif
+
+	if (IS_ENABLED(CONFIG_USB_MIDI_LOG_LEVEL_DBG)) {
+		for (uint32_t i = 0; i + 4 <= num_bytes; i += 4) {
 			struct usb_midi_packet_t packet;
-			enum usb_midi_error_t error = usb_midi_packet_from_usb_bytes(buf, &packet);
+			usb_midi_packet_from_usb_bytes(&buf[i], &packet);
+			LOG_DBG_PACKET(packet);
+		}
+	}
 
-			if (error != USB_MIDI_SUCCESS)
-			{
-				LOG_ERR("Failed to read packet with error %d", error);
-			}
-			else
-			{
-				LOG_DBG_PACKET(packet);
-				struct usb_midi_parse_cb_t parse_cb = {
-					.message_cb = user_callbacks.midi_message_cb,
-					.sysex_data_cb = user_callbacks.sysex_data_cb,
-					.sysex_end_cb = user_callbacks.sysex_end_cb,
-					.sysex_start_cb = user_callbacks.sysex_start_cb};
-				error = usb_midi_parse_packet(packet.bytes, &parse_cb);
-				if (error != USB_MIDI_SUCCESS)
-				{
-					LOG_ERR("Failed to parse packet with error %d", error);
-				}
-			}
+	usb_midi_din_rx_transfer(buf, num_bytes);
+
+	if (user_callbacks.rx_raw_cb) {
+		uint32_t num_words = num_bytes / 4;
+		swap_usb_words(buf, num_words);
+		int is_handled = user_callbacks.rx_raw_cb((const uint32_t *)buf, num_words);
+		swap_usb_words(buf, num_words);
+		if (is_handled) {
+			return;
+		}
+	}
+
+	struct usb_midi_parse_cb_t parse_cb = midi1_parse_cb();
+	enum usb_midi_error_t error = usb_midi_parse_transfer(buf, num_bytes, &parse_cb);
+	if (error != USB_MIDI_SUCCESS)
+	{
+		LOG_ERR("Failed to parse transfer with error %d", error);
+#ifdef CONFIG_USB_MIDI_CAPTURE_TRIGGER_ON_ERROR
+		usb_midi_capture_trigger();
+#endif
+	}
+}
+
+#ifdef CONFIG_USB_MIDI_RX_FLOW_CONTROL
+BUILD_ASSERT(CONFIG_USB_MIDI_RX_QUEUE_LOW_WATERMARK < CONFIG_USB_MIDI_RX_QUEUE_SIZE,
+	     "The RX queue low watermark must be smaller than the queue size");
+
+struct usb_midi_rx_transfer_t {
+	uint8_t is_ump;
+	uint32_t num_bytes;
+	uint8_t bytes[EP_MAX_PACKET_SIZE] __aligned(4);
+};
+
+static struct usb_midi_rx_transfer_t rx_queue[CONFIG_USB_MIDI_RX_QUEUE_SIZE];
+/* Incremented by the OUT endpoint callbacks */
+static uint32_t rx_queue_head = 0;
+/* Incremented by usb_midi_rx_process */
+static uint32_t rx_queue_tail = 0;
+/* OUT endpoints left NAKing because the queue was full */
+static uint8_t rx_paused_eps[NUM_TX_EP_PAIRS];
+static int num_rx_paused_eps = 0;
+static struct k_spinlock rx_queue_lock;
+
+static void rx_queue_clear()
+{
+	k_spinlock_key_t key = k_spin_lock(&rx_queue_lock);
+	rx_queue_head = 0;
+	rx_queue_tail = 0;
+	/* The USB stack re-enables the endpoints on reset */
+	num_rx_paused_eps = 0;
+	k_spin_unlock(&rx_queue_lock, key);
+}
+
+/*
+ * Reads a transfer into the queue. The transfer is only acknowledged, i.e
+ * the host may send the next one, if there is room for it in the queue.
+ */
+static void rx_queue_read(uint8_t ep, int is_ump)
+{
+	k_spinlock_key_t key = k_spin_lock(&rx_queue_lock);
+	if (rx_queue_head - rx_queue_tail >= CONFIG_USB_MIDI_RX_QUEUE_SIZE) {
+		/* Should not happen, since the endpoint is paused when the queue fills up */
+		k_spin_unlock(&rx_queue_lock, key);
+		LOG_ERR("RX queue overflow on endpoint %d", ep);
+		return;
+	}
+	struct usb_midi_rx_transfer_t *transfer =
+		&rx_queue[rx_queue_head % CONFIG_USB_MIDI_RX_QUEUE_SIZE];
+	uint32_t num_read_bytes = 0;
+	int read_rc = usb_dc_ep_read_wait(ep, transfer->bytes, sizeof(transfer->bytes),
+					  &num_read_bytes);
+	if (read_rc != 0) {
+		k_spin_unlock(&rx_queue_lock, key);
+		LOG_ERR("Failed to read from endpoint %d with error %d", ep, read_rc);
+		out_ep_restart(ep);
+		return;
+	}
+	usb_midi_capture_transfer(ep, transfer->bytes, num_read_bytes, is_ump);
+	transfer->is_ump = is_ump;
+	transfer->num_bytes = num_read_bytes;
+	rx_queue_head++;
+	int is_full = rx_queue_head - rx_queue_tail >= CONFIG_USB_MIDI_RX_QUEUE_SIZE;
+	if (is_full) {
+		rx_paused_eps[num_rx_paused_eps++] = ep;
+	}
+	k_spin_unlock(&rx_queue_lock, key);
+
+	if (!is_full) {
+		usb_dc_ep_read_continue(ep);
+	}
+	if (user_callbacks.rx_queued_cb) {
+		user_callbacks.rx_queued_cb();
+	}
+}
+
+int usb_midi_rx_process(int max_transfers)
+{
+	int num_processed = 0;
+	while (num_processed < max_transfers && rx_queue_tail != rx_queue_head) {
+		struct usb_midi_rx_transfer_t *transfer =
+			&rx_queue[rx_queue_tail % CONFIG_USB_MIDI_RX_QUEUE_SIZE];
+		dispatch_rx_transfer(transfer->bytes, transfer->num_bytes, transfer->is_ump);
+		num_processed++;
+
+		uint8_t resumed_eps[ARRAY_SIZE(rx_paused_eps)];
+		int num_resumed_eps = 0;
+		k_spinlock_key_t key = k_spin_lock(&rx_queue_lock);
+		rx_queue_tail++;
+		if (rx_queue_head - rx_queue_tail <= CONFIG_USB_MIDI_RX_QUEUE_LOW_WATERMARK) {
+			num_resumed_eps = num_rx_paused_eps;
+			memcpy(resumed_eps, rx_paused_eps, num_rx_paused_eps);
+			num_rx_paused_eps = 0;
+		}
+		k_spin_unlock(&rx_queue_lock, key);
+
+		for (int i = 0; i < num_resumed_eps; i++) {
+			/* Let the host send again */
+			usb_dc_ep_read_continue(resumed_eps[i]);
+		}
+	}
+	return num_processed;
+}
+#endif
+
+static void midi_out_ep_cb(uint8_t ep, enum usb_dc_ep_cb_status_code ep_status)
+{
+	if (ep_status == USB_DC_EP_DATA_OUT) {
+#ifdef CONFIG_USB_MIDI_RX_FLOW_CONTROL
+		rx_queue_read(ep, 0);
+#else
+		uint8_t *buf = rx_buffer;
+		uint32_t num_read_bytes = 0;
+		int read_rc = usb_read(ep, buf, sizeof(rx_buffer), &num_read_bytes);
+		if (read_rc != 0) {
+			LOG_ERR("Failed to read from endpoint %d with error %d", ep, read_rc);
+			out_ep_restart(ep);
+			return;
 		}
+		usb_midi_capture_transfer(ep, buf, num_read_bytes, 0);
+		dispatch_rx_transfer(buf, num_read_bytes, 0);
+#endif
 	} else {
 		// printk("USB ep status %d\n", ep_status);
 	}
 }
 
+#ifdef CONFIG_USB_MIDI_2_0
+static void ump_out_ep_cb(uint8_t ep, enum usb_dc_ep_cb_status_code ep_status)
+{
+	if (ep_status == USB_DC_EP_DATA_OUT) {
+#ifdef CONFIG_USB_MIDI_RX_FLOW_CONTROL
+		rx_queue_read(ep, 1);
+#else
+		uint32_t num_read_bytes = 0;
+		int read_rc = usb_read(ep, rx_buffer, sizeof(rx_buffer), &num_read_bytes);
+		if (read_rc != 0) {
+			LOG_ERR("Failed to read from endpoint %d with error %d", ep, read_rc);
+			out_ep_restart(ep);
+			return;
+		}
+		usb_midi_capture_transfer(ep, rx_buffer, num_read_bytes, 1);
+		dispatch_rx_transfer(rx_buffer, num_read_bytes, 1);
+#endif
+	}
+}
+#endif
+#else
+/*
+ * Without input jacks, there is nothing to parse. The host may write to the
+ * OUT endpoints anyway, so drop the data to keep them accepting transfers.
+ */
+static void rx_discard(uint8_t ep)
+{
+	uint8_t bytes[16];
+	uint32_t num_read_bytes = 0;
+	do {
+		if (usb_dc_ep_read_wait(ep, bytes, sizeof(bytes), &num_read_bytes) != 0) {
+			out_ep_restart(ep);
+			return;
+		}
+	} while (num_read_bytes == sizeof(bytes));
+	usb_dc_ep_read_continue(ep);
+}
+
+static void midi_out_ep_cb(uint8_t ep, enum usb_dc_ep_cb_status_code ep_status)
+{
+	if (ep_status == USB_DC_EP_DATA_OUT) {
+		rx_discard(ep);
+	}
+}
+
+#ifdef CONFIG_USB_MIDI_2_0
+static void ump_out_ep_cb(uint8_t ep, enum usb_dc_ep_cb_status_code ep_status)
+{
+	if (ep_status == USB_DC_EP_DATA_OUT) {
+		rx_discard(ep);
+	}
+}
+#endif
+#endif
+
 static void midi_in_ep_cb(uint8_t ep, enum usb_dc_ep_cb_status_code ep_status)
 {
+#ifdef CONFIG_USB_MIDI_TX
+	if (ep_status == USB_DC_EP_DATA_IN) {
+		struct usb_midi_ep_pair_t *ep_pair = ep_pair_for_in_ep(ep);
+		if (ep_pair) {
+			struct usb_midi_tx_completions_t done = {0};
+			k_spinlock_key_t key = k_spin_lock(&tx_lock);
+			complete_tx_tokens(&done, ep_pair->in_flight_tokens,
+					   ep_pair->num_in_flight_tokens, 0);
+			ep_pair->num_in_flight_tokens = 0;
+			if (resume_tx_is_pending) {
+				update_latency(resume_cycles, &resume_stats.last_resume_to_tx_us,
+					       &resume_stats.max_resume_to_tx_us);
+				resume_tx_is_pending = 0;
+			}
+			if (ep_pair->send_pending) {
+				/* Keep the endpoint busy before notifying anyone. */
+				ep_pair_tx_buffer_send(ep_pair, &done);
+			}
+			k_spin_unlock(&tx_lock, key);
+			tx_completions_run(&done);
+
+			done.num_entries = 0;
+			key = k_spin_lock(&tx_lock);
+			ep_pair_refill(ep_pair, &done);
+			k_spin_unlock(&tx_lock, key);
+			tx_completions_run(&done);
+		}
+		tx_done_broadcast();
+	}
 	if (ep_status == USB_DC_EP_DATA_IN && user_callbacks.tx_done_cb)
 	{
 		user_callbacks.tx_done_cb();
 	}
+#endif
 }
 
-static struct usb_ep_cfg_data midi_ep_cfg[] = {
-	{
-		.ep_cb = midi_in_ep_cb,
-		.ep_addr = 0x81,
-	},
-	{
-		.ep_cb = midi_out_ep_cb,
-		.ep_addr = 0x01,
-	}};
+static void init_assoc_jack_ids(uint8_t *jack_ids, int num_jacks, int first_jack_id)
+{
+	for (int i = 0; i < num_jacks; i++) {
+		jack_ids[i] = first_jack_id + i;
+	}
+}
+
+static void usb_midi_interface_config(struct usb_desc_header *head, uint8_t bInterfaceNumber)
+{
+	/*
+	 * Output jack IDs start at 1, followed by the input jack IDs. The IN
+	 * endpoints carry output jacks and the OUT endpoints carry input jacks.
+	 */
+	init_assoc_jack_ids(usb_midi_config_data.in_cs_ep.BaAssocJackID,
+			    USB_MIDI_PRIMARY_NUM_OUTPUTS, 1);
+	init_assoc_jack_ids(usb_midi_config_data.out_cs_ep.BaAssocJackID,
+			    USB_MIDI_PRIMARY_NUM_INPUTS, 1 + CONFIG_USB_MIDI_NUM_OUTPUTS);
+#ifdef CONFIG_USB_MIDI_SECONDARY_EP_PAIR
+	init_assoc_jack_ids(usb_midi_config_data.secondary_in_cs_ep.BaAssocJackID,
+			    USB_MIDI_SECONDARY_NUM_OUTPUTS, 1 + USB_MIDI_SECONDARY_FIRST_CABLE);
+	init_assoc_jack_ids(usb_midi_config_data.secondary_out_cs_ep.BaAssocJackID,
+			    USB_MIDI_SECONDARY_NUM_INPUTS,
+			    1 + CONFIG_USB_MIDI_NUM_OUTPUTS + USB_MIDI_SECONDARY_FIRST_CABLE);
+#endif
+#ifdef CONFIG_USB_MIDI_2_0
+	/* The USB stack only numbers the default setting of each interface. */
+	usb_midi_config_data.ms2_if.bInterfaceNumber = bInterfaceNumber + 1;
+#endif
+}
+
+#ifdef CONFIG_USB_MIDI_2_0
+static int usb_midi_custom_handler(struct usb_setup_packet *setup, int32_t *len, uint8_t **data)
+{
+	if (setup->RequestType.recipient != USB_REQTYPE_RECIPIENT_INTERFACE ||
+	    (setup->wIndex & 0xff) != usb_midi_config_data.ms_if.bInterfaceNumber) {
+		return -EINVAL;
+	}
+
+	if (usb_reqtype_is_to_device(setup) && setup->bRequest == USB_SREQ_SET_INTERFACE) {
+		/*
+		 * Alternate setting 1 uses UMPs, alternate setting 0 (the default
+		 * used by MIDI 1.0 only hosts) uses USB MIDI 1.0 event packets.
+		 * Let the USB stack switch the endpoints.
+		 */
+		int is_ump = setup->wValue == 1;
+#ifdef CONFIG_USB_MIDI_TX
+		k_spinlock_key_t key = k_spin_lock(&tx_lock);
+		int is_changed = is_ump != ump_is_active;
+		ump_is_active = is_ump;
+		k_spin_unlock(&tx_lock, key);
+		if (is_changed) {
+			/* Enqueued bytes are encoded for the previous alternate setting */
+			discard_tx_buffers();
+		}
+#else
+		ump_is_active = is_ump;
+#endif
+		LOG_INF("MIDI %s selected", ump_is_active ? "2.0" : "1.0");
+		return -EINVAL;
+	}
+
+	if (usb_reqtype_is_to_host(setup) && setup->bRequest == USB_SREQ_GET_DESCRIPTOR &&
+	    USB_GET_DESCRIPTOR_TYPE(setup->wValue) == USB_MIDI_DESC_CS_GR_TRM_BLOCK) {
+		*data = (uint8_t *)&gtb_descriptors;
+		*len = MIN(sizeof(gtb_descriptors), setup->wLength);
+		return 0;
+	}
+
+	return -EINVAL;
+}
+#endif
+
+static int is_midi_ep(uint8_t ep)
+{
+	for (int i = 0; i < ARRAY_SIZE(midi_ep_cfg); i++) {
+		if (midi_ep_cfg[i].ep_addr == ep) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The host clears a halt, e.g after a transfer error, to resume using the
+ * endpoint. The transfer in progress when the IN endpoint halted is lost,
+ * so start over with empty TX buffers.
+ */
+static void halt_cleared(uint8_t ep)
+{
+	if (!is_midi_ep(ep)) {
+		return;
+	}
+	recovery_stats.num_clear_halts++;
+	if (USB_EP_DIR_IS_IN(ep)) {
+#ifdef CONFIG_USB_MIDI_TX
+		struct usb_midi_ep_pair_t *ep_pair = ep_pair_for_in_ep(ep);
+		if (ep_pair) {
+			struct usb_midi_tx_completions_t done = {0};
+			k_spinlock_key_t key = k_spin_lock(&tx_lock);
+			ep_pair_discard(ep_pair, -EPIPE, &done);
+			k_spin_unlock(&tx_lock, key);
+			tx_completions_run(&done);
+			/* Let blocked senders retry */
+			tx_done_broadcast();
+		}
+#endif
+	} else {
+		usb_dc_ep_read_continue(ep);
+	}
+}
 
 void usb_status_callback(struct usb_cfg_data *cfg,
 						 enum usb_dc_status_code cb_status,
@@ -164,10 +1110,14 @@ void usb_status_callback(struct usb_cfg_data *cfg,
 	/** USB error reported by the controller */
 	case USB_DC_ERROR:
 		LOG_DBG("USB_DC_ERROR");
+		/* Failed transfers are recovered where they fail */
+		recovery_stats.num_errors++;
 		break;
 	/** USB reset */
 	case USB_DC_RESET:
 		LOG_DBG("USB_DC_RESET");
+		/* The host enumerates the device again, e.g after waking up without resuming it. */
+		availability_changed(0);
 		break;
 	/** USB connection established, hardware enumeration is completed */
 	case USB_DC_CONNECTED:
@@ -181,14 +1131,18 @@ void usb_status_callback(struct usb_cfg_data *cfg,
 	/** USB connection lost */
 	case USB_DC_DISCONNECTED:
 		LOG_DBG("USB_DC_DISCONNECTED");
+		availability_changed(0);
 		break;
 	/** USB connection suspended by the HOST */
 	case USB_DC_SUSPEND:
-		availability_changed(0);
+		LOG_DBG("USB_DC_SUSPEND");
+		/* The device stays configured, so keep everything enqueued for the resume. */
+		suspended_changed(1);
 		break;
 	/** USB connection resumed by the HOST */
 	case USB_DC_RESUME:
 		LOG_DBG("USB_DC_RESUME");
+		suspended_changed(0);
 		break;
 	/** USB interface selected */
 	case USB_DC_INTERFACE:
@@ -197,10 +1151,16 @@ void usb_status_callback(struct usb_cfg_data *cfg,
 	/** Set Feature ENDPOINT_HALT received */
 	case USB_DC_SET_HALT:
 		LOG_DBG("USB_DC_SET_HALT");
+		if (param && is_midi_ep(*param)) {
+			recovery_stats.num_halts++;
+		}
 		break;
 	/** Clear Feature ENDPOINT_HALT received */
 	case USB_DC_CLEAR_HALT:
 		LOG_DBG("USB_DC_CLEAR_HALT");
+		if (param) {
+			halt_cleared(*param);
+		}
 		break;
 	/** Start of Frame received */
 	case USB_DC_SOF:
@@ -213,6 +1173,7 @@ void usb_status_callback(struct usb_cfg_data *cfg,
 	}
 }
 
+#ifdef CONFIG_USB_MIDI_TX
 int usb_midi_tx(uint8_t cable_number, uint8_t *midi_bytes)
 {
 	struct usb_midi_packet_t packet;
@@ -223,19 +1184,121 @@ int usb_midi_tx(uint8_t cable_number, uint8_t *midi_bytes)
 		return -EINVAL;
 	}
 	LOG_DBG_PACKET(packet);
-	int write_result = usb_write(0x81, packet.bytes, 4, NULL);
+	int admit_result = usb_midi_rate_limit_admit(cable_number, midi_bytes,
+						     packet.num_midi_bytes, NULL);
+	if (admit_result != 0) {
+		/* A held message is sent by the rate limiter */
+		return admit_result < 0 ? admit_result : 0;
+	}
+	int write_result;
+#ifdef CONFIG_USB_MIDI_2_0
+	if (ump_is_active) {
+		uint32_t words[2];
+		uint8_t num_words = 0;
+		if (usb_midi_ump_from_midi1_bytes(midi_bytes, cable_number, words, &num_words) !=
+		    USB_MIDI_SUCCESS) {
+			return -EINVAL;
+		}
+		write_result = usb_midi_ump_tx(words, num_words);
+	} else
+#endif
+	{
+		k_spinlock_key_t key = k_spin_lock(&tx_lock);
+		write_result = ep_pair_write(ep_pair_for_cable(cable_number), packet.bytes, 4);
+		k_spin_unlock(&tx_lock, key);
+	}
+	if (write_result == 0) {
+		usb_midi_rate_limit_charge(cable_number, packet.num_midi_bytes);
+	}
 	return write_result;
 }
 
+static int ep_pair_tx_buffer_is_full(struct usb_midi_ep_pair_t *ep_pair)
+{
+	if (is_ump_ep_pair(ep_pair)) {
+		/* Leave room for the largest UMP a MIDI 1.0 message is converted to */
+		return ep_pair->tx_buffer_size + 8 > ep_pair->tx_max_size;
+	}
+	return ep_pair->tx_buffer_size >= ep_pair->tx_max_size;
+}
+
 int usb_midi_tx_buffer_is_full() {
-	return temp_tx_buffer_size == EP_MAX_PACKET_SIZE;
+	int is_full = 0;
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	if (ump_is_active) {
+		is_full = ep_pair_tx_buffer_is_full(ep_pair_for_cable(0));
+	} else {
+		for (int i = 0; i < USB_MIDI_NUM_EP_PAIRS; i++) {
+			is_full |= ep_pair_tx_buffer_is_full(&ep_pairs[i]);
+		}
+	}
+	k_spin_unlock(&tx_lock, key);
+	return is_full;
+}
+
+int usb_midi_tx_buffer_is_full_for_cable(uint8_t cable_number)
+{
+	if (cable_number >= 16) {
+		return -EINVAL;
+	}
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	int is_full = ep_pair_tx_buffer_is_full(ep_pair_for_cable(cable_number));
+	k_spin_unlock(&tx_lock, key);
+	return is_full;
 }
 
 int usb_midi_tx_buffer_add(uint8_t cable_number, uint8_t* midi_bytes) {
-	if (usb_midi_tx_buffer_is_full()) {
+	return usb_midi_tx_buffer_add_with_token(cable_number, midi_bytes, NULL);
+}
+
+/* Enqueues a message given as MIDI bytes and as a packet. Called with tx_lock held. */
+static int ep_pair_add(struct usb_midi_ep_pair_t *ep_pair, uint8_t cable_number,
+		       uint8_t *midi_bytes, const struct usb_midi_packet_t *packet,
+		       struct usb_midi_tx_token *token)
+{
+#ifdef CONFIG_USB_MIDI_TX_COALESCE
+	/* Also when tx_buffer is full, which is when coalescing helps the most */
+	if (!ump_is_active && token == NULL && is_coalescable(packet->bytes) &&
+	    ep_pair_coalesce(ep_pair, packet->bytes)) {
+		return 0;
+	}
+#endif
+	if (ep_pair_tx_buffer_is_full(ep_pair) || !ep_pair_can_add_token(ep_pair, token)) {
 		return -1;
 	}
 
+#ifdef CONFIG_USB_MIDI_2_0
+	if (ump_is_active) {
+		uint32_t words[2];
+		uint8_t num_words = 0;
+		if (usb_midi_ump_from_midi1_bytes(midi_bytes, cable_number, words, &num_words) !=
+		    USB_MIDI_SUCCESS) {
+			return -EINVAL;
+		}
+		for (int i = 0; i < num_words; i++) {
+			usb_midi_put_word(words[i], &ep_pair->tx_buffer[ep_pair->tx_buffer_size]);
+			ep_pair->tx_buffer_size += 4;
+		}
+		ep_pair_add_token_bytes(ep_pair, token, 4 * num_words);
+		return 0;
+	}
+#endif
+
+	for (int i = 0; i < 4; i++) {
+		ep_pair->tx_buffer[ep_pair->tx_buffer_size] = packet->bytes[i];
+		ep_pair->tx_buffer_size++;
+	}
+	ep_pair_add_token_bytes(ep_pair, token, 4);
+#ifdef CONFIG_USB_MIDI_TX_COALESCE
+	ep_pair_coalesce_track(ep_pair, packet->bytes, token);
+#endif
+	return 0;
+}
+
+/* Enqueues a message. With is_rate_limited, the message may be held instead. */
+static int tx_buffer_add(uint8_t cable_number, uint8_t *midi_bytes,
+			 struct usb_midi_tx_token *token, int is_rate_limited)
+{
 	struct usb_midi_packet_t packet;
 	enum usb_midi_error_t error = usb_midi_packet_from_midi_bytes(midi_bytes, cable_number, &packet);
 	if (error != USB_MIDI_SUCCESS)
@@ -243,33 +1306,812 @@ int usb_midi_tx_buffer_add(uint8_t cable_number, uint8_t* midi_bytes) {
 		LOG_ERR("Building packet from MIDI bytes %02x %02x %02x failed with error %d", midi_bytes[0], midi_bytes[1], midi_bytes[2], error);
 		return -EINVAL;
 	}
+	if (is_rate_limited) {
+		int admit_result = usb_midi_rate_limit_admit(cable_number, midi_bytes,
+							     packet.num_midi_bytes, token);
+		if (admit_result != 0) {
+			/* A held message counts as enqueued */
+			return admit_result < 0 ? admit_result : 0;
+		}
+	}
 
-	for (int i = 0; i < 4; i++) {
-		temp_tx_buffer[temp_tx_buffer_size] = packet.bytes[i];
-		temp_tx_buffer_size++;
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	int result = ep_pair_add(ep_pair_for_cable(cable_number), cable_number, midi_bytes, &packet,
+				 token);
+	if (result == 0 && is_rate_limited) {
+		usb_midi_rate_limit_charge(cable_number, packet.num_midi_bytes);
 	}
-	return 0;
+	k_spin_unlock(&tx_lock, key);
+	return result;
 }
 
-int usb_midi_tx_buffer_send() {
-	if (temp_tx_buffer_size > 0) {
-		int write_result = usb_write(0x81, temp_tx_buffer, temp_tx_buffer_size, NULL);
+int usb_midi_tx_buffer_add_with_token(uint8_t cable_number, uint8_t *midi_bytes,
+				      struct usb_midi_tx_token *token) {
+	return tx_buffer_add(cable_number, midi_bytes, token, 1);
+}
+
+#ifdef CONFIG_USB_MIDI_TX_RATE_LIMIT
+int usb_midi_tx_buffer_add_unlimited(uint8_t cable_number, uint8_t *midi_bytes,
+				     struct usb_midi_tx_token *token)
+{
+	return tx_buffer_add(cable_number, midi_bytes, token, 0);
+}
+
+uint8_t usb_midi_tx_num_usb_bytes(uint8_t cable_number, uint8_t *midi_bytes)
+{
+#ifdef CONFIG_USB_MIDI_2_0
+	if (ump_is_active) {
+		uint32_t words[2];
+		uint8_t num_words = 0;
+		if (usb_midi_ump_from_midi1_bytes(midi_bytes, cable_number, words, &num_words) ==
+		    USB_MIDI_SUCCESS) {
+			return 4 * num_words;
+		}
+	}
+#endif
+	return 4;
+}
+#endif
+
+int usb_midi_tx_buffer_add_sysex(uint8_t cable_number, const uint8_t *sysex_bytes,
+				 uint32_t num_bytes) {
+	return usb_midi_tx_buffer_add_sysex_with_token(cable_number, sysex_bytes, num_bytes, NULL);
+}
+
+/* Enqueues (part of) a sysex message. Called with tx_lock held. */
+static int ep_pair_add_sysex(struct usb_midi_ep_pair_t *ep_pair, uint8_t cable_number,
+			     const uint8_t *sysex_bytes, uint32_t num_bytes,
+			     struct usb_midi_tx_token *token)
+{
+	if (!ep_pair_can_add_token(ep_pair, token)) {
+		return 0;
+	}
+	uint32_t num_packets = 0;
+#ifdef CONFIG_USB_MIDI_2_0
+	if (ump_is_active) {
+		/* Encoded in place, since this also runs on the DIN bridge UART ISR stack */
+		uint8_t *dst = &ep_pair->tx_buffer[ep_pair->tx_buffer_size];
+		uint32_t num_words = 0;
+		uint32_t max_ump_packets = (ep_pair->tx_max_size - ep_pair->tx_buffer_size) / 8;
+		uint32_t num_encoded_bytes = usb_midi_ump_from_sysex7(sysex_bytes, num_bytes, cable_number,
+								      (uint32_t *)dst, max_ump_packets,
+								      0, &num_words);
+		if (num_encoded_bytes == 0 && max_ump_packets > 0) {
+			/* Less than 6 bytes without F7, e.g 3 byte chunks from the DIN bridge */
+			num_encoded_bytes = usb_midi_ump_from_sysex7(sysex_bytes, num_bytes,
+								     cable_number, (uint32_t *)dst,
+								     1, 1, &num_words);
+		}
+		swap_usb_words(dst, num_words);
+		ep_pair->tx_buffer_size += 4 * num_words;
+		ep_pair_add_token_bytes(ep_pair, token, 4 * num_words);
+		usb_midi_rate_limit_charge(cable_number, num_encoded_bytes);
+		return num_encoded_bytes;
+	}
+#endif
+	uint32_t max_packets = (ep_pair->tx_max_size - ep_pair->tx_buffer_size) / 4;
+	uint32_t num_encoded_bytes = usb_midi_packets_from_sysex(sysex_bytes, num_bytes, cable_number,
+								 &ep_pair->tx_buffer[ep_pair->tx_buffer_size],
+								 max_packets, &num_packets);
+	ep_pair->tx_buffer_size += 4 * num_packets;
+	ep_pair_add_token_bytes(ep_pair, token, 4 * num_packets);
+	usb_midi_rate_limit_charge(cable_number, num_encoded_bytes);
+	return num_encoded_bytes;
+}
+
+int usb_midi_tx_buffer_add_sysex_with_token(uint8_t cable_number, const uint8_t *sysex_bytes,
+					    uint32_t num_bytes, struct usb_midi_tx_token *token) {
+	if (cable_number >= 16) {
+		return -EINVAL;
+	}
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	int num_added = ep_pair_add_sysex(ep_pair_for_cable(cable_number), cable_number,
+					  sysex_bytes, num_bytes, token);
+	k_spin_unlock(&tx_lock, key);
+	return num_added;
+}
+
+int usb_midi_tx_packets(const uint32_t *words, uint32_t num_words)
+{
+	if (!usb_midi_is_available || ump_is_active) {
+		return -EIO;
+	}
+	/* Validate all packets first, so that nothing is sent on failure */
+	for (uint32_t i = 0; i < num_words; i++) {
+		uint8_t header = words[i];
+		uint8_t cin = header & 0xf;
+		if ((header >> 4) >= CONFIG_USB_MIDI_NUM_OUTPUTS || cin == USB_MIDI_CIN_MISC ||
+		    cin == USB_MIDI_CIN_CABLE_EVENT) {
+			LOG_ERR("Invalid packet %08x", words[i]);
+			return -EINVAL;
+		}
+	}
+
+	uint32_t num_enqueued = 0;
+	/* Only the endpoint pairs of the packets are sent, not those of unrelated senders */
+	uint8_t used_ep_pairs = 0;
+	while (num_enqueued < num_words) {
+		uint8_t bytes[4];
+		usb_midi_put_word(words[num_enqueued], bytes);
+		uint8_t cable_number = bytes[0] >> 4;
+		struct usb_midi_tx_completions_t done = {0};
+		k_spinlock_key_t key = k_spin_lock(&tx_lock);
+		struct usb_midi_ep_pair_t *ep_pair = ep_pair_for_cable(cable_number);
+		if (ep_pair_tx_buffer_is_full(ep_pair)) {
+			ep_pair_tx_buffer_send(ep_pair, &done);
+			if (ep_pair_tx_buffer_is_full(ep_pair)) {
+				/* Busy with a full buffer */
+				k_spin_unlock(&tx_lock, key);
+				tx_completions_run(&done);
+				break;
+			}
+		}
+		used_ep_pairs |= BIT(ep_pair - ep_pairs);
+		memcpy(&ep_pair->tx_buffer[ep_pair->tx_buffer_size], bytes, 4);
+		ep_pair->tx_buffer_size += 4;
+#ifdef CONFIG_USB_MIDI_TX_COALESCE
+		/* Later coalescable messages with the same key overwrite this one */
+		ep_pair_coalesce_track(ep_pair, bytes, NULL);
+#endif
+#ifdef CONFIG_USB_MIDI_TX_RATE_LIMIT
+		struct usb_midi_packet_t packet;
+		usb_midi_packet_from_usb_bytes(bytes, &packet);
+		usb_midi_rate_limit_charge(cable_number, packet.num_midi_bytes);
+#endif
+		k_spin_unlock(&tx_lock, key);
+		tx_completions_run(&done);
+		num_enqueued++;
+	}
+
+	int send_result = 0;
+	for (int i = 0; i < NUM_TX_EP_PAIRS; i++) {
+		if (used_ep_pairs & BIT(i)) {
+			int write_result = ep_pair_send(&ep_pairs[i]);
+			if (send_result == 0) {
+				send_result = write_result;
+			}
+		}
+	}
+	return num_enqueued > 0 || send_result == 0 ? (int)num_enqueued : send_result;
+}
+
+static void tx_retry_timer_handler(struct k_timer *timer);
+
+static K_TIMER_DEFINE(tx_retry_timer, tx_retry_timer_handler, NULL);
+
+/* Fires the retry timer at a given uptime, unless it fires before that. Called with tx_lock held. */
+static void tx_retry_timer_arm(int64_t retry_ticks)
+{
+	k_ticks_t ticks = MAX(retry_ticks - k_uptime_ticks(), 0);
+	k_ticks_t remaining_ticks = k_timer_remaining_ticks(&tx_retry_timer);
+	if (remaining_ticks == 0 || ticks < remaining_ticks) {
+		k_timer_start(&tx_retry_timer, K_TICKS(ticks), K_NO_WAIT);
+	}
+}
+
+/*
+ * Sends the data of the endpoint pairs whose IN transfer failed again, once
+ * their own backoff has passed, and fires again for the others.
+ */
+static void tx_retry_timer_handler(struct k_timer *timer)
+{
+	int64_t now = k_uptime_ticks();
+	for (int i = 0; i < NUM_TX_EP_PAIRS; i++) {
+		struct usb_midi_ep_pair_t *ep_pair = &ep_pairs[i];
+		struct usb_midi_tx_completions_t done = {0};
+		k_spinlock_key_t key = k_spin_lock(&tx_lock);
+		if (ep_pair->retry_is_pending && ep_pair->retry_ticks <= now) {
+			ep_pair->retry_is_pending = 0;
+			ep_pair_tx_buffer_send(ep_pair, &done);
+		} else if (ep_pair->retry_is_pending) {
+			tx_retry_timer_arm(ep_pair->retry_ticks);
+		}
+		k_spin_unlock(&tx_lock, key);
+		tx_completions_run(&done);
+	}
+	/* Let blocked senders retry */
+	tx_done_broadcast();
+}
+
+/*
+ * Handles a failed IN transfer of enqueued data. A busy endpoint sends the
+ * data when it frees up. Other errors, e.g a transient controller error, are
+ * retried with exponential backoff, and the data is dropped after
+ * CONFIG_USB_MIDI_TX_RETRIES retries. Returns -EAGAIN if the data is kept.
+ * Called with tx_lock held.
+ */
+static int ep_pair_write_failed(struct usb_midi_ep_pair_t *ep_pair, int write_result,
+				struct usb_midi_tx_completions_t *done)
+{
+	if (write_result == -EAGAIN) {
+		return write_result;
+	}
+	if (!usb_midi_is_available || ep_pair->num_tx_retries >= CONFIG_USB_MIDI_TX_RETRIES) {
+		LOG_ERR("IN transfer failed with error %d, dropping its data", write_result);
+		recovery_stats.num_tx_failures++;
+		ep_pair_discard(ep_pair, write_result, done);
+		return write_result;
+	}
+	LOG_WRN("IN transfer failed with error %d, retrying", write_result);
+	recovery_stats.num_tx_retries++;
+	ep_pair->retry_is_pending = 1;
+	ep_pair->retry_ticks = k_uptime_ticks() + k_ms_to_ticks_ceil64(1 << ep_pair->num_tx_retries);
+	ep_pair->num_tx_retries++;
+	tx_retry_timer_arm(ep_pair->retry_ticks);
+	return -EAGAIN;
+}
+
+/*
+ * Moves waiting priority messages to the start of tx_buffer, after the
+ * priority messages already there. Returns non-zero if some did not fit.
+ */
+static int ep_pair_merge_prio_packets(struct usb_midi_ep_pair_t *ep_pair)
+{
+	int num_merged = 0;
+	while (num_merged < ep_pair->num_prio_packets &&
+	       ep_pair->tx_buffer_size + 4 <= ep_pair->tx_max_size) {
+		uint8_t *dst = &ep_pair->tx_buffer[ep_pair->tx_prio_size];
+		memmove(dst + 4, dst, ep_pair->tx_buffer_size - ep_pair->tx_prio_size);
+		memcpy(dst, ep_pair->prio_packets[num_merged], 4);
+		ep_pair->tx_prio_size += 4;
+		ep_pair->tx_buffer_size += 4;
+		num_merged++;
+	}
+	ep_pair->num_prio_packets -= num_merged;
+	memmove(ep_pair->prio_packets, ep_pair->prio_packets[num_merged],
+		4 * ep_pair->num_prio_packets);
+	return ep_pair->num_prio_packets > 0;
+}
+
+/*
+ * Sends waiting priority messages on their own, when tx_buffer is full.
+ * Called with tx_lock held.
+ */
+static int ep_pair_prio_packets_send(struct usb_midi_ep_pair_t *ep_pair,
+				     struct usb_midi_tx_completions_t *done)
+{
+	int write_result = ep_pair_write(ep_pair, ep_pair->prio_packets[0],
+				       4 * ep_pair->num_prio_packets);
+	if (write_result != 0) {
+		write_result = ep_pair_write_failed(ep_pair, write_result, done);
+	}
+	if (write_result == 0) {
+		ep_pair->num_tx_retries = 0;
+		complete_tx_tokens(done, ep_pair->in_flight_tokens, ep_pair->num_in_flight_tokens, 0);
+		ep_pair->num_in_flight_tokens = 0;
+		ep_pair->num_prio_packets = 0;
+		/* tx_buffer follows in the next transfer */
+		ep_pair->send_pending = 1;
+	} else if (write_result == -EAGAIN) {
+		ep_pair->send_pending = 1;
+	}
+	return write_result;
+}
+
+/* Sends tx_buffer, if there is anything to send. Called with tx_lock held. */
+static int ep_pair_tx_buffer_send(struct usb_midi_ep_pair_t *ep_pair,
+				  struct usb_midi_tx_completions_t *done)
+{
+	if (ep_pair->retry_is_pending) {
+		/* Sent by the retry timer once the backoff has passed */
+		return -EAGAIN;
+	}
+	if (ep_pair->num_prio_packets > 0 && ep_pair_merge_prio_packets(ep_pair) &&
+	    ep_pair->tx_prio_size == 0) {
+		return ep_pair_prio_packets_send(ep_pair, done);
+	}
+	if (ep_pair->tx_buffer_size > 0) {
+		int write_result = ep_pair_write(ep_pair, ep_pair->tx_buffer,
+					       ep_pair->tx_buffer_size);
+		if (write_result != 0) {
+			write_result = ep_pair_write_failed(ep_pair, write_result, done);
+		}
 		if (write_result == 0) {
-			temp_tx_buffer_size = 0;
+			ep_pair->num_tx_retries = 0;
+			/*
+			 * A new transfer could only start if the previous one has completed,
+			 * even if its completion callback has not run yet.
+			 */
+			complete_tx_tokens(done, ep_pair->in_flight_tokens,
+					   ep_pair->num_in_flight_tokens, 0);
+			memcpy(ep_pair->in_flight_tokens, ep_pair->tx_tokens, sizeof(ep_pair->tx_tokens));
+			ep_pair->num_in_flight_tokens = ep_pair->num_tx_tokens;
+			ep_pair->num_tx_tokens = 0;
+			ep_pair->tx_buffer_size = 0;
+			ep_pair->tx_prio_size = 0;
+			/* Priority messages that did not fit go in the next transfer */
+			ep_pair->send_pending = ep_pair->num_prio_packets > 0;
+		} else if (write_result == -EAGAIN) {
+			/* Send from midi_in_ep_cb when the endpoint frees up. */
+			ep_pair->send_pending = 1;
 		}
 		return write_result;
 	}
 	return 0;
 }
 
+/* Sends tx_buffer, taking tx_lock. */
+static int ep_pair_send(struct usb_midi_ep_pair_t *ep_pair)
+{
+	struct usb_midi_tx_completions_t done = {0};
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	int write_result = ep_pair_tx_buffer_send(ep_pair, &done);
+	k_spin_unlock(&tx_lock, key);
+	tx_completions_run(&done);
+	return write_result;
+}
+
+int usb_midi_tx_priority(uint8_t cable_number, uint8_t *midi_bytes)
+{
+	struct usb_midi_packet_t packet;
+	enum usb_midi_error_t error = usb_midi_packet_from_midi_bytes(midi_bytes, cable_number, &packet);
+	if (error != USB_MIDI_SUCCESS || midi_bytes[0] < 0x80 || midi_bytes[0] == 0xf0 ||
+	    midi_bytes[0] == 0xf7) {
+		/* Sysex messages span several packets */
+		return -EINVAL;
+	}
+	if (!usb_midi_is_available) {
+		return -EIO;
+	}
+
+	uint8_t ump_bytes[4];
+#ifdef CONFIG_USB_MIDI_2_0
+	/* Messages of a single USB MIDI packet become single word UMPs */
+	uint32_t words[2];
+	uint8_t num_words = 0;
+	if (usb_midi_ump_from_midi1_bytes(midi_bytes, cable_number, words, &num_words) !=
+		    USB_MIDI_SUCCESS ||
+	    num_words != 1) {
+		return -EINVAL;
+	}
+	usb_midi_put_word(words[0], ump_bytes);
+#endif
+
+	struct usb_midi_tx_completions_t done = {0};
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	struct usb_midi_ep_pair_t *ep_pair = ep_pair_for_cable(cable_number);
+	if (ep_pair->num_prio_packets == CONFIG_USB_MIDI_TX_PRIORITY_SLOTS) {
+		k_spin_unlock(&tx_lock, key);
+		return -ENOMEM;
+	}
+	memcpy(ep_pair->prio_packets[ep_pair->num_prio_packets],
+	       is_ump_ep_pair(ep_pair) ? ump_bytes : packet.bytes, 4);
+	ep_pair->num_prio_packets++;
+
+	/* Not held, but later messages on the cable wait for the used tokens */
+	usb_midi_rate_limit_charge(cable_number, packet.num_midi_bytes);
+
+	int write_result = ep_pair_tx_buffer_send(ep_pair, &done);
+	k_spin_unlock(&tx_lock, key);
+	tx_completions_run(&done);
+	/* A busy endpoint sends the message first thing when it frees up. */
+	return write_result == -EAGAIN ? 0 : write_result;
+}
+
+int usb_midi_tx_buffer_send() {
+	/* A busy endpoint pair must not hold back the others. */
+	int result = 0;
+	for (int i = 0; i < NUM_TX_EP_PAIRS; i++) {
+		int write_result = ep_pair_send(&ep_pairs[i]);
+		if (result == 0) {
+			result = write_result;
+		}
+	}
+	return result;
+}
+
+/* Called with tx_lock held. */
+static void sysex_stream_finish(struct usb_midi_sysex_stream_t *stream, int status,
+				struct usb_midi_tx_completions_t *done)
+{
+	stream->is_active = 0;
+	if (stream->user_token) {
+		tx_completions_add(done, stream->user_token, stream->num_enqueued_bytes, status);
+	}
+}
+
+static void sysex_stream_token_cb(struct usb_midi_tx_token *token, uint32_t num_bytes, int status)
+{
+	struct usb_midi_sysex_stream_t *stream = token->user_data;
+	struct usb_midi_tx_completions_t done = {0};
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	if (stream->is_active) {
+		stream->num_pending_bytes -= num_bytes;
+		if (status != 0) {
+			sysex_stream_finish(stream, status, &done);
+		} else if (stream->iov_idx == stream->iov_cnt && stream->num_pending_bytes == 0) {
+			sysex_stream_finish(stream, 0, &done);
+		}
+	}
+	k_spin_unlock(&tx_lock, key);
+	tx_completions_run(&done);
+}
+
+static void sysex_stream_advance(struct usb_midi_sysex_stream_t *stream, uint32_t num_bytes)
+{
+	stream->num_enqueued_bytes += num_bytes;
+	while (stream->iov_idx < stream->iov_cnt) {
+		uint32_t num_left = stream->iov[stream->iov_idx].len - stream->iov_offset;
+		uint32_t num_skipped = MIN(num_left, num_bytes);
+		stream->iov_offset += num_skipped;
+		num_bytes -= num_skipped;
+		if (stream->iov_offset < stream->iov[stream->iov_idx].len) {
+			return;
+		}
+		stream->iov_idx++;
+		stream->iov_offset = 0;
+	}
+}
+
+/* Copies up to max_bytes bytes from the current position without advancing it. */
+static uint32_t sysex_stream_gather(struct usb_midi_sysex_stream_t *stream, uint8_t *bytes,
+				    uint32_t max_bytes)
+{
+	uint32_t num_bytes = 0;
+	uint32_t offset = stream->iov_offset;
+	for (int i = stream->iov_idx; i < stream->iov_cnt && num_bytes < max_bytes; i++) {
+		while (offset < stream->iov[i].len && num_bytes < max_bytes) {
+			bytes[num_bytes++] = stream->iov[i].data[offset++];
+		}
+		offset = 0;
+	}
+	return num_bytes;
+}
+
+/* Enqueues as much of the stream of an endpoint pair as fits. Called with tx_lock held. */
+static void sysex_stream_pump(struct usb_midi_ep_pair_t *ep_pair)
+{
+	struct usb_midi_sysex_stream_t *stream = &ep_pair->sysex_stream;
+	if (!stream->is_active) {
+		return;
+	}
+	/*
+	 * Enough bytes for a packet, including a leading F0 or trailing F7.
+	 * Fewer bytes left in a fragment are gathered from the following fragments.
+	 */
+	uint32_t chunk_size = is_ump_ep_pair(ep_pair) ? USB_MIDI_UMP_SYSEX7_MAX_BYTES + 1 : 3;
+	while (stream->iov_idx < stream->iov_cnt) {
+		const struct usb_midi_iov *iov = &stream->iov[stream->iov_idx];
+		uint32_t num_left = iov->len - stream->iov_offset;
+		int tx_buffer_size = ep_pair->tx_buffer_size;
+		int num_added;
+		if (num_left >= chunk_size || stream->iov_idx == stream->iov_cnt - 1) {
+			num_added = ep_pair_add_sysex(ep_pair, stream->cable_number,
+						      &iov->data[stream->iov_offset], num_left,
+						      &stream->token);
+		} else {
+			uint8_t chunk[USB_MIDI_UMP_SYSEX7_MAX_BYTES + 1];
+			uint32_t num_chunk_bytes = sysex_stream_gather(stream, chunk, chunk_size);
+			num_added = ep_pair_add_sysex(ep_pair, stream->cable_number, chunk,
+						      num_chunk_bytes, &stream->token);
+		}
+		if (num_added <= 0) {
+			/* The tx buffer is full */
+			break;
+		}
+		stream->num_pending_bytes += ep_pair->tx_buffer_size - tx_buffer_size;
+		sysex_stream_advance(stream, num_added);
+	}
+}
+
+struct usb_midi_tx_producer_t {
+	usb_midi_tx_fill_cb_t fill;
+	void *ctx;
+};
+
+static struct usb_midi_tx_producer_t tx_producers[16];
+/* The cable whose producer is asked first on the next refill, for fairness. */
+static uint8_t next_producer_cable = 0;
+
+/*
+ * Lets the producers of the cables of an endpoint pair write into its tx buffer.
+ * Called with tx_lock held.
+ */
+static void tx_producers_fill(struct usb_midi_ep_pair_t *ep_pair)
+{
+	uint8_t first_cable = next_producer_cable;
+	next_producer_cable = (next_producer_cable + 1) % ARRAY_SIZE(tx_producers);
+	for (int i = 0; i < ARRAY_SIZE(tx_producers); i++) {
+		uint8_t cable_number = (first_cable + i) % ARRAY_SIZE(tx_producers);
+		struct usb_midi_tx_producer_t *producer = &tx_producers[cable_number];
+		if (!producer->fill || ep_pair_for_cable(cable_number) != ep_pair) {
+			continue;
+		}
+		size_t max_events = (ep_pair->tx_max_size - ep_pair->tx_buffer_size) / 4;
+		if (max_events == 0) {
+			break;
+		}
+		size_t num_events = producer->fill(cable_number,
+						   &ep_pair->tx_buffer[ep_pair->tx_buffer_size],
+						   max_events, producer->ctx);
+		__ASSERT_NO_MSG(num_events <= max_events);
+		ep_pair->tx_buffer_size += 4 * MIN(num_events, max_events);
+	}
+}
+
+/*
+ * Enqueues data generated without a user call, i.e the sysex stream and the
+ * producers, in a freed up tx buffer, then sends it. Called with tx_lock held.
+ */
+static void ep_pair_refill(struct usb_midi_ep_pair_t *ep_pair,
+			   struct usb_midi_tx_completions_t *done)
+{
+	sysex_stream_pump(ep_pair);
+	tx_producers_fill(ep_pair);
+	int write_result = ep_pair_tx_buffer_send(ep_pair, done);
+	if (write_result != 0 && write_result != -EAGAIN) {
+		LOG_ERR("Failed to send with error %d", write_result);
+	}
+}
+
+int usb_midi_tx_register_producer(uint8_t cable_number, usb_midi_tx_fill_cb_t fill, void *ctx)
+{
+	if (cable_number >= ARRAY_SIZE(tx_producers)) {
+		return -EINVAL;
+	}
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	tx_producers[cable_number].ctx = ctx;
+	tx_producers[cable_number].fill = fill;
+	k_spin_unlock(&tx_lock, key);
+	return 0;
+}
+
+int usb_midi_tx_producer_resume(uint8_t cable_number)
+{
+	if (cable_number >= ARRAY_SIZE(tx_producers)) {
+		return -EINVAL;
+	}
+	if (!usb_midi_is_available) {
+		return -EIO;
+	}
+	struct usb_midi_tx_completions_t done = {0};
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	ep_pair_refill(ep_pair_for_cable(cable_number), &done);
+	k_spin_unlock(&tx_lock, key);
+	tx_completions_run(&done);
+	return 0;
+}
+
+size_t usb_midi_events_from_sysex(uint8_t cable_number, const uint8_t *sysex_bytes,
+				  uint32_t *num_bytes, uint8_t *dst_words, size_t max_events)
+{
+	uint32_t num_packets = 0;
+	*num_bytes = usb_midi_packets_from_sysex(sysex_bytes, *num_bytes, cable_number, dst_words,
+						 max_events, &num_packets);
+	return num_packets;
+}
+
+int usb_midi_event_from_midi_bytes(uint8_t cable_number, uint8_t *midi_bytes, uint8_t *dst_word)
+{
+	struct usb_midi_packet_t packet;
+	if (usb_midi_packet_from_midi_bytes(midi_bytes, cable_number, &packet) != USB_MIDI_SUCCESS) {
+		return -EINVAL;
+	}
+	memcpy(dst_word, packet.bytes, 4);
+	return 0;
+}
+
+int usb_midi_tx_sysexv(uint8_t cable_number, const struct usb_midi_iov *iov, int iov_cnt,
+		       struct usb_midi_tx_token *token)
+{
+	if (cable_number >= 16 || iov_cnt <= 0) {
+		return -EINVAL;
+	}
+	/* The message must start with F0 and end with F7 so that the stream cannot stall. */
+	int first_idx = 0;
+	while (first_idx < iov_cnt && iov[first_idx].len == 0) {
+		first_idx++;
+	}
+	int last_idx = iov_cnt - 1;
+	while (last_idx >= 0 && iov[last_idx].len == 0) {
+		last_idx--;
+	}
+	if (first_idx == iov_cnt || iov[first_idx].data[0] != 0xf0 ||
+	    iov[last_idx].data[iov[last_idx].len - 1] != 0xf7) {
+		return -EINVAL;
+	}
+
+	struct usb_midi_tx_completions_t done = {0};
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	struct usb_midi_ep_pair_t *ep_pair = ep_pair_for_cable(cable_number);
+	struct usb_midi_sysex_stream_t *stream = &ep_pair->sysex_stream;
+	if (stream->is_active) {
+		k_spin_unlock(&tx_lock, key);
+		return -EBUSY;
+	}
+	stream->cable_number = cable_number;
+	stream->iov = iov;
+	/* Trailing empty fragments would never be consumed */
+	stream->iov_cnt = last_idx + 1;
+	stream->iov_idx = first_idx;
+	stream->iov_offset = 0;
+	stream->num_enqueued_bytes = 0;
+	stream->num_pending_bytes = 0;
+	stream->token.cb = sysex_stream_token_cb;
+	stream->token.user_data = stream;
+	stream->user_token = token;
+	stream->is_active = 1;
+	ep_pair_refill(ep_pair, &done);
+	k_spin_unlock(&tx_lock, key);
+	tx_completions_run(&done);
+	return 0;
+}
+
+static uint32_t tx_done_count_get()
+{
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	uint32_t done_count = tx_done_count;
+	k_spin_unlock(&tx_lock, key);
+	return done_count;
+}
+
+/*
+ * Sleeps until an IN transfer completes or until the deadline computed by
+ * sys_clock_timeout_end_calc for timeout has passed. Returns right away if a
+ * transfer has completed since tx_done_count was done_count.
+ */
+static int wait_for_tx_done(uint32_t done_count, k_timeout_t timeout, int64_t end_ticks)
+{
+	k_timeout_t remaining = K_FOREVER;
+	if (!K_TIMEOUT_EQ(timeout, K_FOREVER)) {
+		int64_t remaining_ticks = end_ticks - sys_clock_tick_get();
+		if (remaining_ticks <= 0) {
+			return -EAGAIN;
+		}
+		remaining = K_TICKS(remaining_ticks);
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	if (tx_done_count != done_count) {
+		k_spin_unlock(&tx_lock, key);
+		return 0;
+	}
+	num_tx_waiters++;
+	k_spin_unlock(&tx_lock, key);
+
+	int result = k_sem_take(&tx_done_sem, remaining);
+	if (result != 0) {
+		key = k_spin_lock(&tx_lock);
+		if (tx_done_count == done_count) {
+			/* Not woken yet, so still counted */
+			num_tx_waiters--;
+		}
+		/* Otherwise the semaphore keeps a count, which wakes a waiter spuriously */
+		k_spin_unlock(&tx_lock, key);
+	}
+	return result;
+}
+
+int usb_midi_tx_wait(uint8_t cable_number, uint8_t *midi_bytes, k_timeout_t timeout)
+{
+	__ASSERT(!k_is_in_isr(), "usb_midi_tx_wait must not be called from an ISR");
+	int64_t end_ticks = sys_clock_timeout_end_calc(timeout);
+	while (1) {
+		/* Read before writing so that a completion during the write is not missed. */
+		uint32_t done_count = tx_done_count_get();
+		int result = usb_midi_tx(cable_number, midi_bytes);
+		if (result != -EAGAIN) {
+			return result;
+		}
+		if (wait_for_tx_done(done_count, timeout, end_ticks) != 0) {
+			return -EAGAIN;
+		}
+	}
+}
+
+int usb_midi_tx_buffer_add_wait(uint8_t cable_number, uint8_t *midi_bytes, k_timeout_t timeout)
+{
+	__ASSERT(!k_is_in_isr(), "usb_midi_tx_buffer_add_wait must not be called from an ISR");
+	int64_t end_ticks = sys_clock_timeout_end_calc(timeout);
+	while (1) {
+		uint32_t done_count = tx_done_count_get();
+		int result = usb_midi_tx_buffer_add(cable_number, midi_bytes);
+		if (result != -1) {
+			return result;
+		}
+		/* The buffer is full. Send it, waiting for the endpoint if it is busy. */
+		k_spinlock_key_t key = k_spin_lock(&tx_lock);
+		struct usb_midi_ep_pair_t *ep_pair = ep_pair_for_cable(cable_number);
+		k_spin_unlock(&tx_lock, key);
+		result = ep_pair_send(ep_pair);
+		if (result != 0 && result != -EAGAIN) {
+			return result;
+		}
+		/* Only the buffer of this cable's endpoint pair matters */
+		if (usb_midi_tx_buffer_is_full_for_cable(cable_number) &&
+		    wait_for_tx_done(done_count, timeout, end_ticks) != 0) {
+			return -EAGAIN;
+		}
+	}
+}
+
+#endif
+
+int usb_midi_ump_is_active()
+{
+	return ump_is_active;
+}
+
+#if defined(CONFIG_USB_MIDI_2_0) && defined(CONFIG_USB_MIDI_TX)
+
+int usb_midi_ump_tx(const uint32_t *words, uint32_t num_words)
+{
+	if (!ump_is_active) {
+		return -EIO;
+	}
+	if (num_words == 0 || num_words > USB_MIDI_UMP_MAX_WORDS ||
+	    usb_midi_ump_num_words(words[0]) != num_words) {
+		return -EINVAL;
+	}
+	uint8_t bytes[4 * USB_MIDI_UMP_MAX_WORDS];
+	for (int i = 0; i < num_words; i++) {
+		usb_midi_put_word(words[i], &bytes[4 * i]);
+	}
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	int write_result = ep_pair_write(&ep_pairs[UMP_EP_PAIR_IDX], bytes, 4 * num_words);
+	k_spin_unlock(&tx_lock, key);
+	return write_result;
+}
+
+int usb_midi_ump_tx_buffer_add(const uint32_t *words, uint32_t num_words)
+{
+	if (!ump_is_active) {
+		return -EIO;
+	}
+	if (num_words == 0 || num_words > USB_MIDI_UMP_MAX_WORDS ||
+	    usb_midi_ump_num_words(words[0]) != num_words) {
+		return -EINVAL;
+	}
+	struct usb_midi_ep_pair_t *ep_pair = &ep_pairs[UMP_EP_PAIR_IDX];
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	if (ep_pair->tx_buffer_size + 4 * num_words > ep_pair->tx_max_size) {
+		k_spin_unlock(&tx_lock, key);
+		return -1;
+	}
+	for (int i = 0; i < num_words; i++) {
+		usb_midi_put_word(words[i], &ep_pair->tx_buffer[ep_pair->tx_buffer_size]);
+		ep_pair->tx_buffer_size += 4;
+	}
+	k_spin_unlock(&tx_lock, key);
+	return 0;
+}
+
+int usb_midi_ump_tx_buffer_add_sysex8(uint8_t group, uint8_t stream_id, const uint8_t *data_bytes,
+				      uint32_t num_bytes, int is_start, int is_end)
+{
+	if (!ump_is_active) {
+		return -EIO;
+	}
+	if (group >= 16) {
+		return -EINVAL;
+	}
+	struct usb_midi_ep_pair_t *ep_pair = &ep_pairs[UMP_EP_PAIR_IDX];
+	uint32_t num_words = 0;
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	uint8_t *dst = &ep_pair->tx_buffer[ep_pair->tx_buffer_size];
+	uint32_t max_packets = (ep_pair->tx_max_size - ep_pair->tx_buffer_size) / 16;
+	uint32_t num_encoded_bytes = usb_midi_ump_from_sysex8(data_bytes, num_bytes, group, stream_id,
+							      is_start, is_end, (uint32_t *)dst,
+							      max_packets, &num_words);
+	swap_usb_words(dst, num_words);
+	ep_pair->tx_buffer_size += 4 * num_words;
+	k_spin_unlock(&tx_lock, key);
+	return num_encoded_bytes;
+}
+#endif
+
 USBD_DEFINE_CFG_DATA(usb_midi_config) = {
 	.usb_device_description = NULL,
-	.interface_config = NULL,
+	.interface_config = usb_midi_interface_config,
 	.interface_descriptor = &usb_midi_config_data.ac_if,
 	.cb_usb_status = usb_status_callback,
 	.interface = {
 		.class_handler = NULL,
+#ifdef CONFIG_USB_MIDI_2_0
+		.custom_handler = usb_midi_custom_handler,
+#else
 		.custom_handler = NULL,
+#endif
 		.vendor_handler = NULL,
 	},
 	.num_endpoints = ARRAY_SIZE(midi_ep_cfg),
@@ -0,0 +1,231 @@
+#include <errno.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <usb_midi/usb_midi.h>
+#include "usb_midi_capture.h"
+
+#ifdef CONFIG_USB_MIDI_CAPTURE_SHELL
+#include <stdlib.h>
+#include <zephyr/shell/shell.h>
+#endif
+
+static struct usb_midi_capture_entry entries[CONFIG_USB_MIDI_CAPTURE_SIZE];
+/* The number of entries recorded since the capture was cleared */
+static uint32_t num_recorded;
+static int is_frozen;
+static int is_triggered;
+/* The number of entries left to record after the trigger */
+static uint32_t num_post_trigger_left;
+static uint32_t num_post_trigger;
+static int has_trigger_value;
+static uint8_t trigger_value[4];
+static uint8_t trigger_mask[4];
+static struct k_spinlock capture_lock;
+
+/* Called with capture_lock held. */
+static void trigger_locked()
+{
+	if (is_triggered || is_frozen) {
+		return;
+	}
+	is_triggered = 1;
+	num_post_trigger_left = num_post_trigger;
+	if (num_post_trigger_left == 0) {
+		is_frozen = 1;
+	}
+}
+
+static int matches_trigger(const uint8_t *bytes)
+{
+	for (int i = 0; i < 4; i++) {
+		if ((bytes[i] & trigger_mask[i]) != trigger_value[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void usb_midi_capture_transfer(uint8_t ep, const uint8_t *bytes, uint32_t num_bytes, int is_ump)
+{
+	/* All packets of a transfer share the timestamp */
+	uint32_t cycles = k_cycle_get_32();
+	uint8_t flags = USB_MIDI_CAPTURE_FLAG_TRANSFER_START |
+			(is_ump ? USB_MIDI_CAPTURE_FLAG_UMP : 0);
+
+	k_spinlock_key_t key = k_spin_lock(&capture_lock);
+	for (uint32_t i = 0; i + 4 <= num_bytes && !is_frozen; i += 4) {
+		struct usb_midi_capture_entry *entry =
+			&entries[num_recorded % CONFIG_USB_MIDI_CAPTURE_SIZE];
+		entry->cycles = cycles;
+		memcpy(entry->bytes, &bytes[i], 4);
+		entry->ep = ep;
+		entry->flags = flags;
+		flags &= ~USB_MIDI_CAPTURE_FLAG_TRANSFER_START;
+		num_recorded++;
+
+		if (is_triggered) {
+			if (--num_post_trigger_left == 0) {
+				is_frozen = 1;
+			}
+		} else if (has_trigger_value && matches_trigger(entry->bytes)) {
+			entry->flags |= USB_MIDI_CAPTURE_FLAG_TRIGGER;
+			trigger_locked();
+		}
+	}
+	k_spin_unlock(&capture_lock, key);
+}
+
+void usb_midi_capture_trigger()
+{
+	k_spinlock_key_t key = k_spin_lock(&capture_lock);
+	trigger_locked();
+	k_spin_unlock(&capture_lock, key);
+}
+
+void usb_midi_capture_set_trigger(const uint8_t *value, const uint8_t *mask,
+				  uint32_t num_post_trigger_entries)
+{
+	k_spinlock_key_t key = k_spin_lock(&capture_lock);
+	has_trigger_value = value != NULL;
+	if (value) {
+		for (int i = 0; i < 4; i++) {
+			trigger_mask[i] = mask[i];
+			trigger_value[i] = value[i] & mask[i];
+		}
+	}
+	num_post_trigger = num_post_trigger_entries;
+	k_spin_unlock(&capture_lock, key);
+}
+
+int usb_midi_capture_freeze()
+{
+	k_spinlock_key_t key = k_spin_lock(&capture_lock);
+	int rc = is_frozen ? -EALREADY : 0;
+	is_frozen = 1;
+	k_spin_unlock(&capture_lock, key);
+	return rc;
+}
+
+void usb_midi_capture_clear()
+{
+	k_spinlock_key_t key = k_spin_lock(&capture_lock);
+	num_recorded = 0;
+	is_triggered = 0;
+	is_frozen = 0;
+	k_spin_unlock(&capture_lock, key);
+}
+
+int usb_midi_capture_is_frozen()
+{
+	return is_frozen;
+}
+
+uint32_t usb_midi_capture_num_entries()
+{
+	return MIN(num_recorded, CONFIG_USB_MIDI_CAPTURE_SIZE);
+}
+
+int usb_midi_capture_get(uint32_t idx, struct usb_midi_capture_entry *entry)
+{
+	if (!is_frozen) {
+		/* The entry could be overwritten while being copied */
+		return -EBUSY;
+	}
+	uint32_t num_entries = usb_midi_capture_num_entries();
+	if (idx >= num_entries) {
+		return -EINVAL;
+	}
+	*entry = entries[(num_recorded - num_entries + idx) % CONFIG_USB_MIDI_CAPTURE_SIZE];
+	return 0;
+}
+
+#ifdef CONFIG_USB_MIDI_CAPTURE_SHELL
+
+static int cmd_status(const struct shell *sh, size_t argc, char **argv)
+{
+	shell_print(sh, "%s, %u entries, trigger %s", is_frozen ? "frozen" : "recording",
+		    usb_midi_capture_num_entries(), is_triggered ? "fired" : "armed");
+	return 0;
+}
+
+static int cmd_freeze(const struct shell *sh, size_t argc, char **argv)
+{
+	usb_midi_capture_freeze();
+	return 0;
+}
+
+static int cmd_clear(const struct shell *sh, size_t argc, char **argv)
+{
+	usb_midi_capture_clear();
+	return 0;
+}
+
+/*
+ * Prints the capture in the format read by usb_midi_capture_to_pcap.py, one
+ * line per entry, oldest first. Freezes the capture first.
+ */
+static int cmd_dump(const struct shell *sh, size_t argc, char **argv)
+{
+	usb_midi_capture_freeze();
+	uint32_t num_entries = usb_midi_capture_num_entries();
+	shell_print(sh, "usbmidi-capture hz=%u entries=%u", sys_clock_hw_cycles_per_sec(),
+		    num_entries);
+	for (uint32_t i = 0; i < num_entries; i++) {
+		struct usb_midi_capture_entry entry;
+		usb_midi_capture_get(i, &entry);
+		shell_print(sh, "usbmidi %08x %02x %02x %02x%02x%02x%02x", entry.cycles, entry.ep,
+			    entry.flags, entry.bytes[0], entry.bytes[1], entry.bytes[2],
+			    entry.bytes[3]);
+	}
+	return 0;
+}
+
+static int parse_hex_bytes(const char *str, uint8_t *bytes)
+{
+	char *end;
+	uint32_t word = strtoul(str, &end, 16);
+	if (strlen(str) != 8 || *end != '\0') {
+		return -EINVAL;
+	}
+	for (int i = 0; i < 4; i++) {
+		bytes[i] = word >> (24 - 8 * i);
+	}
+	return 0;
+}
+
+/* usb_midi capture trigger <value> <mask> [post trigger entries], or trigger off */
+static int cmd_trigger(const struct shell *sh, size_t argc, char **argv)
+{
+	if (argc == 2 && strcmp(argv[1], "off") == 0) {
+		usb_midi_capture_set_trigger(NULL, NULL, 0);
+		return 0;
+	}
+	uint8_t value[4];
+	uint8_t mask[4];
+	if (argc < 3 || parse_hex_bytes(argv[1], value) || parse_hex_bytes(argv[2], mask)) {
+		shell_error(sh, "Usage: trigger <value> <mask> [post trigger entries], "
+				"e.g trigger 0b900000 0ff00000 16");
+		return -EINVAL;
+	}
+	uint32_t num_post_trigger_entries = argc > 3 ? strtoul(argv[3], NULL, 10) : 0;
+	usb_midi_capture_set_trigger(value, mask, num_post_trigger_entries);
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_capture,
+	SHELL_CMD(status, NULL, "Show the capture state", cmd_status),
+	SHELL_CMD(freeze, NULL, "Stop recording", cmd_freeze),
+	SHELL_CMD(clear, NULL, "Remove all entries and resume recording", cmd_clear),
+	SHELL_CMD(dump, NULL, "Freeze and print all entries", cmd_dump),
+	SHELL_CMD_ARG(trigger, NULL, "Freeze on a packet: <value> <mask> [post trigger entries]",
+		      cmd_trigger, 2, 2),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_usb_midi,
+	SHELL_CMD(capture, &sub_capture, "USB MIDI packet capture", NULL),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(usb_midi, &sub_usb_midi, "USB MIDI device commands", NULL);
+#endif
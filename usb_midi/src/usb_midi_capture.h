@@ -0,0 +1,19 @@
+#ifndef ZEPHYR_USB_MIDI_CAPTURE_H_
+#define ZEPHYR_USB_MIDI_CAPTURE_H_
+
+#include <stdint.h>
+
+#ifdef CONFIG_USB_MIDI_CAPTURE
+/*
+ * Records the packets of a transfer read from an OUT endpoint or submitted
+ * to an IN endpoint. Safe to call from the USB interrupt.
+ */
+void usb_midi_capture_transfer(uint8_t ep, const uint8_t *bytes, uint32_t num_bytes, int is_ump);
+#else
+static inline void usb_midi_capture_transfer(uint8_t ep, const uint8_t *bytes, uint32_t num_bytes,
+					     int is_ump)
+{
+}
+#endif
+
+#endif
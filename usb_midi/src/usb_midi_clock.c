@@ -0,0 +1,299 @@
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <usb_midi/usb_midi.h>
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_DECLARE(usb_midi, CONFIG_USB_MIDI_LOG_LEVEL);
+
+#define CLOCKS_PER_BEAT 24
+#define QUARTER_FRAMES_PER_FRAME 4
+#define NUM_QUARTER_FRAME_PIECES 8
+#define MIN_TEMPO_MBPM 1000
+#define MAX_TEMPO_MBPM 1000000
+#define DEFAULT_TEMPO_MBPM 120000
+/* The clock period in ticks is CLOCK_PERIOD_NUM / (tempo_mbpm * CLOCKS_PER_BEAT) */
+#define CLOCK_PERIOD_NUM (60000ULL * CONFIG_SYS_CLOCK_TICKS_PER_SEC)
+
+/*
+ * Sends a message at a fixed rate. The period in system clock ticks is
+ * period_num / period_den. Each deadline is the previous deadline plus the
+ * whole part of the period, with the fractional part accumulated separately,
+ * so that rounding and timer latency never add up to drift.
+ */
+struct usb_midi_clock_gen_t {
+	struct k_timer *timer;
+	/* Builds the next message. Called with clock_lock held, the message is sent after unlocking. */
+	void (*tick_cb)(struct usb_midi_clock_gen_t *gen, uint8_t *midi_bytes);
+	uint8_t cable_number;
+	int is_running;
+	int64_t next_tick;
+	uint64_t period_num;
+	uint64_t period_den;
+	uint64_t period_frac;
+};
+
+static struct k_spinlock clock_lock;
+
+static void clock_gen_timer_handler(struct k_timer *timer);
+static void clock_tick_cb(struct usb_midi_clock_gen_t *gen, uint8_t *midi_bytes);
+static void mtc_tick_cb(struct usb_midi_clock_gen_t *gen, uint8_t *midi_bytes);
+
+static K_TIMER_DEFINE(clock_timer, clock_gen_timer_handler, NULL);
+static K_TIMER_DEFINE(mtc_timer, clock_gen_timer_handler, NULL);
+
+static struct usb_midi_clock_gen_t clock_gen = {
+	.timer = &clock_timer,
+	.tick_cb = clock_tick_cb,
+	.period_num = CLOCK_PERIOD_NUM,
+	.period_den = (uint64_t)DEFAULT_TEMPO_MBPM * CLOCKS_PER_BEAT,
+};
+
+static struct usb_midi_clock_gen_t mtc_gen = {
+	.timer = &mtc_timer,
+	.tick_cb = mtc_tick_cb,
+};
+
+static enum usb_midi_mtc_rate_t mtc_rate = USB_MIDI_MTC_25_FPS;
+/* The time carried by the current 8 quarter frames */
+static struct usb_midi_mtc_time mtc_time;
+/* The next quarter frame piece to send */
+static uint8_t mtc_piece;
+
+static void clock_gen_schedule_next(struct usb_midi_clock_gen_t *gen)
+{
+	gen->next_tick += gen->period_num / gen->period_den;
+	gen->period_frac += gen->period_num % gen->period_den;
+	if (gen->period_frac >= gen->period_den) {
+		gen->period_frac -= gen->period_den;
+		gen->next_tick++;
+	}
+	k_timer_start(gen->timer, K_TIMEOUT_ABS_TICKS(gen->next_tick), K_NO_WAIT);
+}
+
+static void clock_gen_timer_handler(struct k_timer *timer)
+{
+	struct usb_midi_clock_gen_t *gen = k_timer_user_data_get(timer);
+	uint8_t midi_bytes[3] = {0};
+	uint8_t cable_number = 0;
+	int is_due = 0;
+	k_spinlock_key_t key = k_spin_lock(&clock_lock);
+	if (gen->is_running) {
+		gen->tick_cb(gen, midi_bytes);
+		cable_number = gen->cable_number;
+		is_due = 1;
+		/* A late handler catches up instead of shifting later deadlines. */
+		clock_gen_schedule_next(gen);
+	}
+	k_spin_unlock(&clock_lock, key);
+	/* The TX path takes its own lock, so the message is sent without clock_lock held. */
+	if (is_due) {
+		int rc = usb_midi_tx_priority(cable_number, midi_bytes);
+		if (rc != 0) {
+			LOG_DBG("Failed to send %02x with error %d", midi_bytes[0], rc);
+		}
+	}
+}
+
+static void clock_gen_start(struct usb_midi_clock_gen_t *gen, uint8_t cable_number)
+{
+	gen->cable_number = cable_number;
+	gen->is_running = 1;
+	gen->period_frac = 0;
+	/* The first message is due right away */
+	gen->next_tick = k_uptime_ticks();
+	k_timer_user_data_set(gen->timer, gen);
+	k_timer_start(gen->timer, K_TIMEOUT_ABS_TICKS(gen->next_tick), K_NO_WAIT);
+}
+
+static void clock_gen_stop(struct usb_midi_clock_gen_t *gen)
+{
+	gen->is_running = 0;
+	k_timer_stop(gen->timer);
+}
+
+static int send_realtime(uint8_t cable_number, uint8_t status)
+{
+	uint8_t midi_bytes[3] = {status, 0, 0};
+	return usb_midi_tx_priority(cable_number, midi_bytes);
+}
+
+/************************ MIDI clock ************************/
+
+static void clock_tick_cb(struct usb_midi_clock_gen_t *gen, uint8_t *midi_bytes)
+{
+	midi_bytes[0] = 0xf8;
+}
+
+int usb_midi_clock_set_tempo(uint32_t tempo_mbpm)
+{
+	if (tempo_mbpm < MIN_TEMPO_MBPM || tempo_mbpm > MAX_TEMPO_MBPM) {
+		return -EINVAL;
+	}
+	k_spinlock_key_t key = k_spin_lock(&clock_lock);
+	/* The new period applies from the next deadline on. */
+	clock_gen.period_num = CLOCK_PERIOD_NUM;
+	clock_gen.period_den = (uint64_t)tempo_mbpm * CLOCKS_PER_BEAT;
+	clock_gen.period_frac = 0;
+	k_spin_unlock(&clock_lock, key);
+	return 0;
+}
+
+static int clock_start(uint8_t cable_number, uint8_t status)
+{
+	if (cable_number >= 16) {
+		return -EINVAL;
+	}
+	k_spinlock_key_t key = k_spin_lock(&clock_lock);
+	clock_gen_stop(&clock_gen);
+	k_spin_unlock(&clock_lock, key);
+	int rc = send_realtime(cable_number, status);
+	if (rc == 0) {
+		key = k_spin_lock(&clock_lock);
+		clock_gen_start(&clock_gen, cable_number);
+		k_spin_unlock(&clock_lock, key);
+	}
+	return rc;
+}
+
+int usb_midi_clock_start(uint8_t cable_number)
+{
+	return clock_start(cable_number, 0xfa);
+}
+
+int usb_midi_clock_continue(uint8_t cable_number)
+{
+	return clock_start(cable_number, 0xfb);
+}
+
+int usb_midi_clock_stop()
+{
+	k_spinlock_key_t key = k_spin_lock(&clock_lock);
+	int was_running = clock_gen.is_running;
+	uint8_t cable_number = clock_gen.cable_number;
+	clock_gen_stop(&clock_gen);
+	k_spin_unlock(&clock_lock, key);
+	if (!was_running) {
+		return -EALREADY;
+	}
+	return send_realtime(cable_number, 0xfc);
+}
+
+/************************ MIDI time code ************************/
+
+static uint8_t mtc_frames_per_second(enum usb_midi_mtc_rate_t rate)
+{
+	switch (rate) {
+	case USB_MIDI_MTC_24_FPS:
+		return 24;
+	case USB_MIDI_MTC_25_FPS:
+		return 25;
+	default:
+		return 30;
+	}
+}
+
+static void mtc_advance_frames(uint8_t num_frames)
+{
+	uint8_t fps = mtc_frames_per_second(mtc_rate);
+	mtc_time.frames += num_frames;
+	if (mtc_time.frames < fps) {
+		return;
+	}
+	mtc_time.frames -= fps;
+	if (++mtc_time.seconds < 60) {
+		return;
+	}
+	mtc_time.seconds = 0;
+	if (++mtc_time.minutes == 60) {
+		mtc_time.minutes = 0;
+		mtc_time.hours = (mtc_time.hours + 1) % 24;
+	}
+	if (mtc_rate == USB_MIDI_MTC_29_97_FPS_DROP_FRAME && mtc_time.minutes % 10 != 0) {
+		/* Frames 0 and 1 are skipped at the start of each minute, except every 10th. */
+		mtc_time.frames += 2;
+	}
+}
+
+static uint8_t mtc_piece_value(uint8_t piece)
+{
+	switch (piece) {
+	case 0:
+		return mtc_time.frames & 0xf;
+	case 1:
+		return mtc_time.frames >> 4;
+	case 2:
+		return mtc_time.seconds & 0xf;
+	case 3:
+		return mtc_time.seconds >> 4;
+	case 4:
+		return mtc_time.minutes & 0xf;
+	case 5:
+		return mtc_time.minutes >> 4;
+	case 6:
+		return mtc_time.hours & 0xf;
+	default:
+		return (mtc_rate << 1) | (mtc_time.hours >> 4);
+	}
+}
+
+static void mtc_tick_cb(struct usb_midi_clock_gen_t *gen, uint8_t *midi_bytes)
+{
+	midi_bytes[0] = 0xf1;
+	midi_bytes[1] = (mtc_piece << 4) | mtc_piece_value(mtc_piece);
+	if (++mtc_piece == NUM_QUARTER_FRAME_PIECES) {
+		mtc_piece = 0;
+		mtc_advance_frames(NUM_QUARTER_FRAME_PIECES / QUARTER_FRAMES_PER_FRAME);
+	}
+}
+
+/* Called with clock_lock held */
+static void mtc_gen_set_period(void)
+{
+	/* Quarter frames per second, i.e 4 * fps, with 29.97 fps being 30000 / 1001. */
+	int is_drop_frame = mtc_rate == USB_MIDI_MTC_29_97_FPS_DROP_FRAME;
+	uint64_t fps_num = is_drop_frame ? 30000 : mtc_frames_per_second(mtc_rate);
+	uint64_t fps_den = is_drop_frame ? 1001 : 1;
+	mtc_gen.period_num = fps_den * CONFIG_SYS_CLOCK_TICKS_PER_SEC;
+	mtc_gen.period_den = fps_num * QUARTER_FRAMES_PER_FRAME;
+	mtc_gen.period_frac = 0;
+}
+
+void usb_midi_mtc_set_frame_rate(enum usb_midi_mtc_rate_t rate)
+{
+	k_spinlock_key_t key = k_spin_lock(&clock_lock);
+	mtc_rate = rate;
+	/* While running, the new rate applies from the next deadline on. */
+	uint8_t fps = mtc_frames_per_second(rate);
+	if (mtc_time.frames >= fps) {
+		mtc_time.frames = fps - 1;
+	}
+	mtc_gen_set_period();
+	k_spin_unlock(&clock_lock, key);
+}
+
+int usb_midi_mtc_start(uint8_t cable_number, const struct usb_midi_mtc_time *time)
+{
+	if (cable_number >= 16 || time->hours >= 24 || time->minutes >= 60 ||
+	    time->seconds >= 60) {
+		return -EINVAL;
+	}
+	k_spinlock_key_t key = k_spin_lock(&clock_lock);
+	if (time->frames >= mtc_frames_per_second(mtc_rate)) {
+		k_spin_unlock(&clock_lock, key);
+		return -EINVAL;
+	}
+	clock_gen_stop(&mtc_gen);
+	mtc_time = *time;
+	mtc_piece = 0;
+	mtc_gen_set_period();
+	clock_gen_start(&mtc_gen, cable_number);
+	k_spin_unlock(&clock_lock, key);
+	return 0;
+}
+
+void usb_midi_mtc_stop()
+{
+	k_spinlock_key_t key = k_spin_lock(&clock_lock);
+	clock_gen_stop(&mtc_gen);
+	k_spin_unlock(&clock_lock, key);
+}
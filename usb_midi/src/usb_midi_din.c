@@ -0,0 +1,371 @@
+#include <errno.h>
+#include <string.h>
+#include <zephyr/device.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/drivers/uart.h>
+#include <zephyr/init.h>
+#include <zephyr/kernel.h>
+#include <usb_midi/usb_midi.h>
+#include "usb_midi_packet.h"
+#include "usb_midi_din.h"
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_DECLARE(usb_midi, CONFIG_USB_MIDI_LOG_LEVEL);
+
+#define DT_DRV_COMPAT usb_midi_din_port
+
+BUILD_ASSERT(DT_HAS_COMPAT_STATUS_OKAY(DT_DRV_COMPAT),
+	     "CONFIG_USB_MIDI_DIN_BRIDGE requires usb-midi-din-port devicetree nodes");
+
+#define SYSEX_START_BYTE 0xF0
+#define SYSEX_END_BYTE 0xF7
+
+/* A DIN port and the cable it is bridged to */
+struct usb_midi_din_port_t {
+	const struct device *uart;
+	uint8_t cable_number;
+#ifdef CONFIG_USB_MIDI_TX
+	/* DIN to USB. The UART receives into one buffer while the other is parsed. */
+	uint8_t rx_bufs[2][CONFIG_USB_MIDI_DIN_RX_BUF_SIZE];
+	uint8_t next_rx_buf;
+	struct usb_midi_cable_state_t rx_state;
+	/* Sysex bytes waiting for a full packet */
+	uint8_t sysex_chunk[3];
+	uint8_t num_sysex_chunk_bytes;
+#endif
+#ifdef CONFIG_USB_MIDI_RX
+	/* USB to DIN. One buffer is filled while the UART sends the other. */
+	uint8_t tx_bufs[2][CONFIG_USB_MIDI_DIN_TX_BUF_SIZE];
+	uint8_t fill_tx_buf;
+	uint32_t num_fill_bytes;
+	uint8_t tx_is_busy;
+	/* The status byte of the last channel message sent, or 0 */
+	uint8_t tx_running_status;
+#endif
+	struct usb_midi_din_stats stats;
+};
+
+#define DIN_PORT_CHECK(inst)                                                                     \
+	BUILD_ASSERT(DT_INST_PROP(inst, cable) < 16, "usb-midi-din-port cable must be 0-15");
+DT_INST_FOREACH_STATUS_OKAY(DIN_PORT_CHECK)
+
+#define DIN_PORT_INIT(inst)                                                                      \
+	{.uart = DEVICE_DT_GET(DT_INST_PHANDLE(inst, uart)), .cable_number = DT_INST_PROP(inst, cable)},
+
+static struct usb_midi_din_port_t ports[] = {DT_INST_FOREACH_STATUS_OKAY(DIN_PORT_INIT)};
+#define NUM_PORTS ARRAY_SIZE(ports)
+
+static struct k_spinlock din_lock;
+
+static struct usb_midi_din_port_t *port_for_cable(uint8_t cable_number)
+{
+	for (int i = 0; i < NUM_PORTS; i++) {
+		if (ports[i].cable_number == cable_number) {
+			return &ports[i];
+		}
+	}
+	return NULL;
+}
+
+#ifdef CONFIG_USB_MIDI_TX
+/*
+ * The parser callbacks. The parser is given the index of the port instead of
+ * a cable number, so that the port does not have to be looked up.
+ */
+static void usb_tx(struct usb_midi_din_port_t *port, uint8_t *midi_bytes)
+{
+	int rc = usb_midi_tx_buffer_add(port->cable_number, midi_bytes);
+	if (rc == -1) {
+		/* Full. Send what has been enqueued so far and try again. */
+		usb_midi_tx_buffer_send();
+		rc = usb_midi_tx_buffer_add(port->cable_number, midi_bytes);
+	}
+	if (rc != 0) {
+		port->stats.num_rx_dropped++;
+	}
+}
+
+static void usb_tx_sysex_chunk(struct usb_midi_din_port_t *port)
+{
+	uint32_t num_bytes = port->num_sysex_chunk_bytes;
+	port->num_sysex_chunk_bytes = 0;
+	int rc = usb_midi_tx_buffer_add_sysex(port->cable_number, port->sysex_chunk, num_bytes);
+	if (rc >= 0 && rc < num_bytes) {
+		usb_midi_tx_buffer_send();
+		int num_added = usb_midi_tx_buffer_add_sysex(
+			port->cable_number, &port->sysex_chunk[rc], num_bytes - rc);
+		rc = num_added < 0 ? num_added : rc + num_added;
+	}
+	if (rc != num_bytes) {
+		port->stats.num_rx_dropped++;
+	}
+}
+
+static void usb_tx_sysex_byte(struct usb_midi_din_port_t *port, uint8_t byte)
+{
+	port->sysex_chunk[port->num_sysex_chunk_bytes++] = byte;
+	if (port->num_sysex_chunk_bytes == 3 || byte == SYSEX_END_BYTE) {
+		usb_tx_sysex_chunk(port);
+	}
+}
+
+static void din_message_cb(uint8_t *bytes, uint8_t num_bytes, uint8_t port_idx)
+{
+	uint8_t midi_bytes[3] = {0};
+	memcpy(midi_bytes, bytes, num_bytes);
+	usb_tx(&ports[port_idx], midi_bytes);
+}
+
+static void din_sysex_start_cb(uint8_t port_idx)
+{
+	ports[port_idx].num_sysex_chunk_bytes = 0;
+	usb_tx_sysex_byte(&ports[port_idx], SYSEX_START_BYTE);
+}
+
+static void din_sysex_data_cb(uint8_t *data_bytes, uint8_t num_data_bytes, uint8_t port_idx)
+{
+	for (int i = 0; i < num_data_bytes; i++) {
+		usb_tx_sysex_byte(&ports[port_idx], data_bytes[i]);
+	}
+}
+
+static void din_sysex_end_cb(uint8_t port_idx)
+{
+	/* Also ends aborted messages, so that the host is not left waiting for an F7 */
+	usb_tx_sysex_byte(&ports[port_idx], SYSEX_END_BYTE);
+}
+
+static struct usb_midi_parse_cb_t din_parse_cb = {
+	.message_cb = din_message_cb,
+	.sysex_start_cb = din_sysex_start_cb,
+	.sysex_data_cb = din_sysex_data_cb,
+	.sysex_end_cb = din_sysex_end_cb,
+	.sysex_abort_cb = din_sysex_end_cb};
+
+static void din_rx(struct usb_midi_din_port_t *port, const uint8_t *bytes, uint32_t num_bytes)
+{
+	port->stats.num_rx_bytes += num_bytes;
+	enum usb_midi_error_t error = usb_midi_parse_byte_stream(
+		&port->rx_state, bytes, num_bytes, port - ports, &din_parse_cb);
+	if (error != USB_MIDI_SUCCESS) {
+		LOG_WRN("Invalid MIDI data on DIN port of cable %d", port->cable_number);
+	}
+	/* Send at the end of each chunk of DMA data rather than for each message */
+	usb_midi_tx_buffer_send();
+}
+
+/* Drops a message in progress after a receive error, and ends a sysex message. */
+static void din_rx_reset(struct usb_midi_din_port_t *port)
+{
+	if (port->rx_state.sysex_state == USB_MIDI_SYSEX_STATE_ACTIVE) {
+		din_sysex_end_cb(port - ports);
+		usb_midi_tx_buffer_send();
+	}
+	memset(&port->rx_state, 0, sizeof(port->rx_state));
+}
+
+static int din_rx_enable(struct usb_midi_din_port_t *port)
+{
+	uint8_t *buf = port->rx_bufs[port->next_rx_buf];
+	port->next_rx_buf ^= 1;
+	return uart_rx_enable(port->uart, buf, CONFIG_USB_MIDI_DIN_RX_BUF_SIZE,
+			      CONFIG_USB_MIDI_DIN_RX_TIMEOUT_US);
+}
+#endif
+
+#ifdef CONFIG_USB_MIDI_RX
+/*
+ * Appends the bytes of a packet, leaving out channel message status bytes
+ * that repeat the running status. A packet that does not fit in the buffer
+ * being filled is dropped whole, so that the receiver never gets part of a
+ * message. Called with din_lock held.
+ */
+static void din_tx_put_packet(struct usb_midi_din_port_t *port, const uint8_t *bytes,
+			      uint8_t num_bytes)
+{
+	uint8_t out_bytes[3];
+	uint8_t num_out_bytes = 0;
+	uint8_t running_status = port->tx_running_status;
+	uint32_t num_running_status_bytes = 0;
+	for (int i = 0; i < num_bytes; i++) {
+		uint8_t byte = bytes[i];
+		if (byte >= 0xf8) {
+			/* System real time messages do not affect running status */
+		} else if (byte >= 0xf0) {
+			/* System common messages, including sysex, cancel running status */
+			running_status = 0;
+		} else if (byte >= 0x80) {
+			if (IS_ENABLED(CONFIG_USB_MIDI_DIN_TX_RUNNING_STATUS) &&
+			    byte == running_status) {
+				num_running_status_bytes++;
+				continue;
+			}
+			running_status = byte;
+		}
+		out_bytes[num_out_bytes++] = byte;
+	}
+
+	if (port->num_fill_bytes + num_out_bytes > CONFIG_USB_MIDI_DIN_TX_BUF_SIZE) {
+		port->stats.num_tx_dropped += num_out_bytes;
+		/* The receiver may have missed a status byte */
+		port->tx_running_status = 0;
+		return;
+	}
+	memcpy(&port->tx_bufs[port->fill_tx_buf][port->num_fill_bytes], out_bytes, num_out_bytes);
+	port->num_fill_bytes += num_out_bytes;
+	port->tx_running_status = running_status;
+	port->stats.num_running_status_bytes += num_running_status_bytes;
+}
+
+/* Starts sending the filled buffer, unless the other one is being sent. */
+static void din_tx_start(struct usb_midi_din_port_t *port)
+{
+	k_spinlock_key_t key = k_spin_lock(&din_lock);
+	if (port->tx_is_busy || port->num_fill_bytes == 0) {
+		k_spin_unlock(&din_lock, key);
+		return;
+	}
+	uint8_t *buf = port->tx_bufs[port->fill_tx_buf];
+	uint32_t num_bytes = port->num_fill_bytes;
+	port->tx_is_busy = 1;
+	port->fill_tx_buf ^= 1;
+	port->num_fill_bytes = 0;
+	k_spin_unlock(&din_lock, key);
+
+	/* Without the lock, since some drivers report UART_TX_DONE from uart_tx */
+	int rc = uart_tx(port->uart, buf, num_bytes, SYS_FOREVER_US);
+	if (rc != 0) {
+		LOG_ERR("Failed to send to DIN port of cable %d with error %d", port->cable_number,
+			rc);
+		key = k_spin_lock(&din_lock);
+		port->tx_is_busy = 0;
+		port->stats.num_tx_dropped += num_bytes;
+		port->tx_running_status = 0;
+		k_spin_unlock(&din_lock, key);
+	}
+}
+
+static void din_tx_done(struct usb_midi_din_port_t *port, uint32_t num_bytes)
+{
+	k_spinlock_key_t key = k_spin_lock(&din_lock);
+	port->tx_is_busy = 0;
+	port->stats.num_tx_bytes += num_bytes;
+	k_spin_unlock(&din_lock, key);
+	din_tx_start(port);
+}
+
+void usb_midi_din_rx_transfer(const uint8_t *bytes, uint32_t num_bytes)
+{
+	int is_bridged = 0;
+	k_spinlock_key_t key = k_spin_lock(&din_lock);
+	for (uint32_t i = 0; i + 4 <= num_bytes; i += 4) {
+		struct usb_midi_packet_t packet;
+		if (usb_midi_packet_from_usb_bytes((uint8_t *)&bytes[i], &packet) !=
+		    USB_MIDI_SUCCESS) {
+			continue;
+		}
+		struct usb_midi_din_port_t *port = port_for_cable(packet.cable_num);
+		if (port) {
+			din_tx_put_packet(port, &packet.bytes[1], packet.num_midi_bytes);
+			is_bridged = 1;
+		}
+	}
+	k_spin_unlock(&din_lock, key);
+
+	if (is_bridged) {
+		for (int i = 0; i < NUM_PORTS; i++) {
+			din_tx_start(&ports[i]);
+		}
+	}
+}
+#endif
+
+static void uart_cb(const struct device *dev, struct uart_event *evt, void *user_data)
+{
+	struct usb_midi_din_port_t *port = user_data;
+
+	switch (evt->type) {
+#ifdef CONFIG_USB_MIDI_RX
+	case UART_TX_DONE:
+	case UART_TX_ABORTED:
+		din_tx_done(port, evt->data.tx.len);
+		break;
+#endif
+#ifdef CONFIG_USB_MIDI_TX
+	case UART_RX_RDY:
+		din_rx(port, &evt->data.rx.buf[evt->data.rx.offset], evt->data.rx.len);
+		break;
+	case UART_RX_BUF_REQUEST:
+		uart_rx_buf_rsp(dev, port->rx_bufs[port->next_rx_buf],
+				CONFIG_USB_MIDI_DIN_RX_BUF_SIZE);
+		port->next_rx_buf ^= 1;
+		break;
+	case UART_RX_STOPPED:
+		LOG_WRN("Receive error %d on DIN port of cable %d", evt->data.rx_stop.reason,
+			port->cable_number);
+		port->stats.num_rx_errors++;
+		din_rx_reset(port);
+		break;
+	case UART_RX_DISABLED:
+		/* After a receive error. Keep receiving. */
+		din_rx_enable(port);
+		break;
+#endif
+	default:
+		break;
+	}
+}
+
+int usb_midi_din_stats_get(uint8_t cable_number, struct usb_midi_din_stats *stats)
+{
+	struct usb_midi_din_port_t *port = port_for_cable(cable_number);
+	if (!port) {
+		return -EINVAL;
+	}
+	k_spinlock_key_t key = k_spin_lock(&din_lock);
+	*stats = port->stats;
+	k_spin_unlock(&din_lock, key);
+	return 0;
+}
+
+int usb_midi_din_stats_reset(uint8_t cable_number)
+{
+	struct usb_midi_din_port_t *port = port_for_cable(cable_number);
+	if (!port) {
+		return -EINVAL;
+	}
+	k_spinlock_key_t key = k_spin_lock(&din_lock);
+	memset(&port->stats, 0, sizeof(port->stats));
+	k_spin_unlock(&din_lock, key);
+	return 0;
+}
+
+static int usb_midi_din_init(void)
+{
+	for (int i = 0; i < NUM_PORTS; i++) {
+		struct usb_midi_din_port_t *port = &ports[i];
+		if (!device_is_ready(port->uart)) {
+			LOG_ERR("UART of DIN port of cable %d is not ready", port->cable_number);
+			continue;
+		}
+		int rc = uart_callback_set(port->uart, uart_cb, port);
+		if (rc != 0) {
+			LOG_ERR("UART of DIN port of cable %d has no async API, error %d",
+				port->cable_number, rc);
+			continue;
+		}
+#ifdef CONFIG_USB_MIDI_TX
+		/* DIN input is sent to the host on an output jack */
+		if (port->cable_number < CONFIG_USB_MIDI_NUM_OUTPUTS) {
+			rc = din_rx_enable(port);
+			if (rc != 0) {
+				LOG_ERR("Failed to receive from DIN port of cable %d with error %d",
+					port->cable_number, rc);
+			}
+		}
+#endif
+	}
+	return 0;
+}
+
+SYS_INIT(usb_midi_din_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
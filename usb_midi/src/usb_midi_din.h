@@ -0,0 +1,18 @@
+#ifndef ZEPHYR_USB_MIDI_DIN_H_
+#define ZEPHYR_USB_MIDI_DIN_H_
+
+#include <stdint.h>
+
+#ifdef CONFIG_USB_MIDI_DIN_BRIDGE
+/*
+ * Sends the packets of a received MIDI 1.0 transfer that are on bridged
+ * cables to their DIN ports. Safe to call from the USB interrupt.
+ */
+void usb_midi_din_rx_transfer(const uint8_t *bytes, uint32_t num_bytes);
+#else
+static inline void usb_midi_din_rx_transfer(const uint8_t *bytes, uint32_t num_bytes)
+{
+}
+#endif
+
+#endif
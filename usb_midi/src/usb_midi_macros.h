@@ -6,7 +6,19 @@
 /* Require at least one jack */
 BUILD_ASSERT((CONFIG_USB_MIDI_NUM_INPUTS + CONFIG_USB_MIDI_NUM_OUTPUTS > 0), "USB MIDI device must have more than 0 jacks");
 
-#define EP_MAX_PACKET_SIZE 0x0040
+#define EP_MAX_PACKET_SIZE CONFIG_USB_MIDI_BULK_EP_MPS
+
+/* Bulk endpoints must use 8, 16, 32 or 64 at full speed and 512 at high speed */
+BUILD_ASSERT(EP_MAX_PACKET_SIZE == 8 || EP_MAX_PACKET_SIZE == 16 || EP_MAX_PACKET_SIZE == 32 ||
+	     EP_MAX_PACKET_SIZE == 64 || EP_MAX_PACKET_SIZE == 512,
+	     "Invalid USB MIDI bulk endpoint size");
+
+#ifdef CONFIG_USB_MIDI_SECONDARY_EP_PAIR
+/* The secondary endpoint pair must carry at least one input and one output jack */
+BUILD_ASSERT(CONFIG_USB_MIDI_SECONDARY_EP_PAIR_FIRST_CABLE < CONFIG_USB_MIDI_NUM_INPUTS &&
+	     CONFIG_USB_MIDI_SECONDARY_EP_PAIR_FIRST_CABLE < CONFIG_USB_MIDI_NUM_OUTPUTS,
+	     "CONFIG_USB_MIDI_SECONDARY_EP_PAIR_FIRST_CABLE must be smaller than the number of inputs and outputs");
+#endif
 
 #ifdef CONFIG_USB_MIDI_USE_CUSTOM_JACK_NAMES
 
@@ -49,6 +61,7 @@ struct jack_string_descriptors
         .bDescriptorType = USB_DESC_STRING,                                                        \
         .bString = CONFIG_USB_MIDI_OUTPUT_JACK_##jack_number##_NAME},
 
+/* Not const, since the USB stack converts the strings to UTF-16 in place. */
 USBD_STRING_DESCR_USER_DEFINE(primary)
 struct jack_string_descriptors jack_string_desc = {
     LISTIFY(CONFIG_USB_MIDI_NUM_OUTPUTS, INIT_OUTPUT_JACK_STRING_DESCR, ())
@@ -92,7 +105,7 @@ struct jack_string_descriptors jack_string_desc = {
         .bDescriptorType = USB_DESC_INTERFACE,                           \
         .bInterfaceNumber = 0x01,                                        \
         .bAlternateSetting = 0x00,                                       \
-        .bNumEndpoints = 2,                                              \
+        .bNumEndpoints = 2 * USB_MIDI_NUM_EP_PAIRS,                      \
         .bInterfaceClass = USB_MIDI_AUDIO_INTERFACE_CLASS,               \
         .bInterfaceSubClass = USB_MIDI_MIDISTREAMING_INTERFACE_SUBCLASS, \
         .bInterfaceProtocol = 0x00,                                      \
@@ -137,11 +150,11 @@ struct jack_string_descriptors jack_string_desc = {
     }
 
 /* Out endpoint */
-#define INIT_OUT_EP                                         \
+#define INIT_OUT_EP(ep_addr)                                \
     {                                                       \
         .bLength = sizeof(struct usb_ep_descriptor_padded), \
         .bDescriptorType = USB_DESC_ENDPOINT,               \
-        .bEndpointAddress = 0x01,                           \
+        .bEndpointAddress = ep_addr,                        \
         .bmAttributes = 0x02,                               \
         .wMaxPacketSize = EP_MAX_PACKET_SIZE,                  \
         .bInterval = 0x00,                                  \
@@ -150,11 +163,11 @@ struct jack_string_descriptors jack_string_desc = {
     }
 
 /* In endpoint */
-#define INIT_IN_EP                                          \
+#define INIT_IN_EP(ep_addr)                                 \
     {                                                       \
         .bLength = sizeof(struct usb_ep_descriptor_padded), \
         .bDescriptorType = USB_DESC_ENDPOINT,               \
-        .bEndpointAddress = 0x81,                           \
+        .bEndpointAddress = ep_addr,                        \
         .bmAttributes = 0x02,                               \
         .wMaxPacketSize = EP_MAX_PACKET_SIZE,                  \
         .bInterval = 0x00,                                  \
@@ -162,8 +175,85 @@ struct jack_string_descriptors jack_string_desc = {
         .bSynchAddress = 0x00,                              \
     }
 
+/* Class specific bulk endpoint. The associated jack IDs are filled in at runtime. */
+#define INIT_CS_EP(descriptor_type, num_jacks)             \
+    {                                                      \
+        .bLength = sizeof(descriptor_type),                \
+        .bDescriptorType = USB_DESC_CS_ENDPOINT,           \
+        .bDescriptorSubtype = USB_MIDI_EP_DESC_MS_GENERAL, \
+        .bNumEmbMIDIJack = num_jacks,                      \
+    }
+
+/* MIDI 2.0 alternate setting of the MIDI streaming interface */
+#define INIT_MS2_IF                                                      \
+    {                                                                    \
+        .bLength = sizeof(struct usb_if_descriptor),                     \
+        .bDescriptorType = USB_DESC_INTERFACE,                           \
+        .bInterfaceNumber = 0x01,                                        \
+        .bAlternateSetting = 0x01,                                       \
+        .bNumEndpoints = 2,                                              \
+        .bInterfaceClass = USB_MIDI_AUDIO_INTERFACE_CLASS,               \
+        .bInterfaceSubClass = USB_MIDI_MIDISTREAMING_INTERFACE_SUBCLASS, \
+        .bInterfaceProtocol = 0x00,                                      \
+        .iInterface = 0x00                                               \
+    }
+
+/* Class specific MIDI 2.0 streaming interface descriptor. No jacks or elements follow. */
+#define INIT_MS2_CS_IF                                       \
+    {                                                        \
+        .bLength = sizeof(struct usb_midi_ms_if_descriptor), \
+        .bDescriptorType = USB_DESC_CS_INTERFACE,            \
+        .bDescriptorSubtype = USB_MIDI_IF_DESC_MS_HEADER,    \
+        .BcdADC = 0x0200,                                    \
+        .wTotalLength = sizeof(struct usb_midi_ms_if_descriptor) \
+    }
+
+/* MIDI 2.0 bulk endpoint */
+#define INIT_UMP_EP(ep_addr)                                \
+    {                                                       \
+        .bLength = sizeof(struct usb_ep_descriptor),        \
+        .bDescriptorType = USB_DESC_ENDPOINT,               \
+        .bEndpointAddress = ep_addr,                        \
+        .bmAttributes = 0x02,                               \
+        .wMaxPacketSize = EP_MAX_PACKET_SIZE,               \
+        .bInterval = 0x00,                                  \
+    }
+
+/* Class specific MIDI 2.0 bulk endpoint, associated with Group Terminal Block 1 */
+#define INIT_UMP_CS_EP                                         \
+    {                                                          \
+        .bLength = sizeof(struct usb_midi2_bulk_ep_descriptor), \
+        .bDescriptorType = USB_DESC_CS_ENDPOINT,               \
+        .bDescriptorSubtype = USB_MIDI_EP_DESC_MS_GENERAL_2_0, \
+        .bNumGrpTrmBlock = 1,                                  \
+        .baAssoGrpTrmBlkID = {1}                               \
+    }
+
+/* A single bidirectional Group Terminal Block with one group per cable */
+#define INIT_GTB_DESCRIPTORS                                                      \
+    {                                                                             \
+        .header = {                                                               \
+            .bLength = sizeof(struct usb_midi2_gtb_header_descriptor),            \
+            .bDescriptorType = USB_MIDI_DESC_CS_GR_TRM_BLOCK,                     \
+            .bDescriptorSubtype = USB_MIDI_GTB_DESC_HEADER,                       \
+            .wTotalLength = sizeof(struct usb_midi2_gtb_descriptors),             \
+        },                                                                        \
+        .block = {                                                                \
+            .bLength = sizeof(struct usb_midi2_gtb_descriptor),                   \
+            .bDescriptorType = USB_MIDI_DESC_CS_GR_TRM_BLOCK,                     \
+            .bDescriptorSubtype = USB_MIDI_GTB_DESC_BLOCK,                        \
+            .bGrpTrmBlkID = 1,                                                    \
+            .bGrpTrmBlkType = USB_MIDI_GTB_TYPE_BIDIRECTIONAL,                    \
+            .nGroupTrm = 0,                                                       \
+            .nNumGroupTrm = MAX(CONFIG_USB_MIDI_NUM_INPUTS, CONFIG_USB_MIDI_NUM_OUTPUTS), \
+            .iBlockItem = 0,                                                      \
+            .bMIDIProtocol = 0x00,                                                \
+            .wMaxInputBandwidth = 0,                                              \
+            .wMaxOutputBandwidth = 0,                                             \
+        }                                                                         \
+    }
+
 #define ELEMENT_ID 0xf0
-#define IDX_WITH_OFFSET(index, offset) (index + offset)
 #define INIT_INPUT_PIN(index, offset)   \
     {                                   \
         .baSourceID = (index + offset), \
@@ -202,6 +292,18 @@ struct jack_string_descriptors jack_string_desc = {
         sizeof(struct usb_ep_descriptor_padded) +                                   \
         sizeof(struct usb_midi_bulk_out_ep_descriptor) +                            \
         sizeof(struct usb_ep_descriptor_padded) +                                   \
-        sizeof(struct usb_midi_bulk_in_ep_descriptor))
+        sizeof(struct usb_midi_bulk_in_ep_descriptor) +                             \
+        MIDI_MS_IF_DESC_SECONDARY_EP_PAIR_SIZE)
+
+#ifdef CONFIG_USB_MIDI_SECONDARY_EP_PAIR
+#define MIDI_MS_IF_DESC_SECONDARY_EP_PAIR_SIZE                    \
+    (                                                             \
+        sizeof(struct usb_ep_descriptor_padded) +                 \
+        sizeof(struct usb_midi_secondary_bulk_out_ep_descriptor) + \
+        sizeof(struct usb_ep_descriptor_padded) +                 \
+        sizeof(struct usb_midi_secondary_bulk_in_ep_descriptor))
+#else
+#define MIDI_MS_IF_DESC_SECONDARY_EP_PAIR_SIZE 0
+#endif
 
 #endif /* ZEPHYR_USB_MIDI_MACROS_H_ */
\ No newline at end of file
@@ -1,3 +1,5 @@
+#include <stddef.h>
+#include <string.h>
 #include "usb_midi_packet.h"
 
 #define SYSEX_START_BYTE 0xF0
@@ -5,6 +7,15 @@
 #define IS_DATA_BYTE(b) (b < 0x80)
 #define IS_STATUS_BYTE(b) (b >= 0x80)
 
+/*
+ * Selects the header byte and the most significant bit of each MIDI byte
+ * of a little endian packet word. A packet word masked with this value equals
+ * the packet header if and only if all three MIDI bytes are data bytes.
+ */
+#define PACKET_HEADER_AND_STATUS_BITS_MASK 0x808080ffU
+/* The maximum number of sysex continuation packets delivered in one callback. */
+#define MAX_SYSEX_RUN_PACKETS 32
+
 static enum usb_midi_error_t channel_msg_cin(uint8_t first_byte, uint8_t *cin)
 {
 	uint8_t high_nibble = first_byte >> 4;
@@ -214,6 +225,49 @@ enum usb_midi_error_t usb_midi_packet_from_midi_bytes(uint8_t *midi_bytes, uint8
 	return USB_MIDI_SUCCESS;
 }
 
+uint32_t usb_midi_packets_from_sysex(const uint8_t *sysex_bytes, uint32_t num_bytes,
+				     uint8_t cable_num, uint8_t *packet_bytes,
+				     uint32_t max_packets, uint32_t *num_packets)
+{
+	/*
+	 * All chunks except the one containing the terminating F7 are
+	 * three bytes long (F0, d, d or d, d, d) and have CIN 0x4. The last
+	 * chunk holds 1, 2 or 3 bytes and has CIN 0x5, 0x6 or 0x7 respectively.
+	 */
+	uint32_t header = (uint32_t)(cable_num & 0xf) << 4;
+	int has_end = num_bytes > 0 && sysex_bytes[num_bytes - 1] == SYSEX_END_BYTE;
+	uint32_t num_end_bytes = has_end ? 1 + (num_bytes - 1) % 3 : 0;
+	uint32_t num_continue_packets = (num_bytes - num_end_bytes) / 3;
+	uint32_t packet_idx = 0;
+
+	if (num_continue_packets > max_packets) {
+		num_continue_packets = max_packets;
+	}
+
+	const uint8_t *src = sysex_bytes;
+	for (; packet_idx < num_continue_packets; packet_idx++) {
+		uint32_t word = header | USB_MIDI_CIN_SYSEX_START_OR_CONTINUE |
+				((uint32_t)src[0] << 8) | ((uint32_t)src[1] << 16) |
+				((uint32_t)src[2] << 24);
+		usb_midi_put_word(word, &packet_bytes[4 * packet_idx]);
+		src += 3;
+	}
+
+	if (num_end_bytes > 0 && packet_idx == (num_bytes - num_end_bytes) / 3 &&
+	    packet_idx < max_packets) {
+		uint32_t word = header | (USB_MIDI_CIN_SYSEX_START_OR_CONTINUE + num_end_bytes);
+		for (uint32_t i = 0; i < num_end_bytes; i++) {
+			word |= (uint32_t)src[i] << (8 * (i + 1));
+		}
+		usb_midi_put_word(word, &packet_bytes[4 * packet_idx]);
+		src += num_end_bytes;
+		packet_idx++;
+	}
+
+	*num_packets = packet_idx;
+	return src - sysex_bytes;
+}
+
 enum usb_midi_error_t usb_midi_packet_from_usb_bytes(uint8_t *packet_bytes,
 						     struct usb_midi_packet_t *packet)
 {
@@ -240,15 +294,271 @@ enum usb_midi_error_t usb_midi_packet_from_usb_bytes(uint8_t *packet_bytes,
 	return USB_MIDI_SUCCESS;
 }
 
-enum usb_midi_error_t usb_midi_parse_packet(uint8_t *packet_bytes,
-					    struct usb_midi_parse_cb_t *parse_cb)
+static struct usb_midi_cable_state_t *cable_state_for(struct usb_midi_parse_cb_t *parse_cb,
+						      uint8_t cable_num)
+{
+	if (parse_cb->cable_states && cable_num < parse_cb->num_cable_states) {
+		return &parse_cb->cable_states[cable_num];
+	}
+	return NULL;
+}
+
+static void byte_stream_flush_sysex(struct usb_midi_cable_state_t *state, uint8_t cable_num,
+				    struct usb_midi_parse_cb_t *parse_cb)
+{
+	if (state->num_sysex_bytes > 0 && parse_cb->sysex_data_cb) {
+		parse_cb->sysex_data_cb(state->sysex_bytes, state->num_sysex_bytes, cable_num);
+	}
+	state->num_sysex_bytes = 0;
+}
+
+void usb_midi_flush_byte_streams(struct usb_midi_parse_cb_t *parse_cb)
+{
+	for (uint8_t i = 0; parse_cb->cable_states && i < parse_cb->num_cable_states; i++) {
+		byte_stream_flush_sysex(&parse_cb->cable_states[i], i, parse_cb);
+	}
+}
+
+/* Ends a sysex message in progress that will never receive its F7. */
+static void cable_state_abort_sysex(struct usb_midi_cable_state_t *state, uint8_t cable_num,
+				    struct usb_midi_parse_cb_t *parse_cb)
+{
+	if (state->sysex_state == USB_MIDI_SYSEX_STATE_ACTIVE) {
+		byte_stream_flush_sysex(state, cable_num, parse_cb);
+		if (parse_cb->sysex_abort_cb) {
+			parse_cb->sysex_abort_cb(cable_num);
+		}
+	}
+	state->num_sysex_bytes = 0;
+	state->sysex_state = USB_MIDI_SYSEX_STATE_IDLE;
+}
+
+void usb_midi_reset_cable_states(struct usb_midi_parse_cb_t *parse_cb)
+{
+	for (uint8_t i = 0; parse_cb->cable_states && i < parse_cb->num_cable_states; i++) {
+		struct usb_midi_cable_state_t *state = &parse_cb->cable_states[i];
+		cable_state_abort_sysex(state, i, parse_cb);
+		memset(state, 0, sizeof(*state));
+	}
+}
+
+/*
+ * Moves the sysex state of a cable to the next state given a sysex packet
+ * or byte, i.e one that starts (F0 ...), continues (d ...) or ends (... F7)
+ * a message. Returns non-zero if the packet or byte should be delivered.
+ */
+static int cable_state_sysex(struct usb_midi_cable_state_t *state, int is_start, int is_end,
+			     uint8_t cable_num, struct usb_midi_parse_cb_t *parse_cb,
+			     enum usb_midi_error_t *error)
+{
+	if (state->sysex_state == USB_MIDI_SYSEX_STATE_ACTIVE && !is_start) {
+		/* The common case, checked first */
+		if (is_end) {
+			state->sysex_state = USB_MIDI_SYSEX_STATE_IDLE;
+		}
+		return 1;
+	}
+
+	if (is_start) {
+		/* A start without an end of the previous message */
+		cable_state_abort_sysex(state, cable_num, parse_cb);
+		state->running_status = 0;
+		state->sysex_state = is_end ? USB_MIDI_SYSEX_STATE_IDLE : USB_MIDI_SYSEX_STATE_ACTIVE;
+		return 1;
+	}
+
+	if (state->sysex_state == USB_MIDI_SYSEX_STATE_IDLE) {
+		/* Data or an end without a start. Report once, then drop until the next start. */
+		*error = USB_MIDI_ERROR_INVALID_MIDI_MSG;
+	}
+	state->sysex_state = is_end ? USB_MIDI_SYSEX_STATE_IDLE : USB_MIDI_SYSEX_STATE_DISCARD;
+	return 0;
+}
+
+/*
+ * Updates the state of a cable given a non-sysex status byte. System common
+ * and channel messages end sysex messages in progress.
+ */
+static void cable_state_status(struct usb_midi_cable_state_t *state, uint8_t status,
+			       uint8_t cable_num, struct usb_midi_parse_cb_t *parse_cb)
+{
+	if (status >= 0xf8) {
+		/* System real time messages may appear anywhere, even in sysex messages. */
+		return;
+	}
+	if (state->sysex_state != USB_MIDI_SYSEX_STATE_IDLE) {
+		cable_state_abort_sysex(state, cable_num, parse_cb);
+	}
+	/* System common messages cancel running status */
+	state->running_status = status < 0xf0 ? status : 0;
+}
+
+/*
+ * Validates a packet that is not a single byte against the state of its
+ * cable and updates the state. Returns non-zero if the packet should be
+ * delivered.
+ */
+static int cable_state_packet(struct usb_midi_cable_state_t *state, uint8_t cin,
+			      uint8_t first_byte, uint8_t cable_num,
+			      struct usb_midi_parse_cb_t *parse_cb, enum usb_midi_error_t *error)
+{
+	/* Preserve the order of the sysex bytes */
+	byte_stream_flush_sysex(state, cable_num, parse_cb);
+	/* e.g a CoreMIDI message interrupted by a complete packet */
+	state->num_msg_bytes = 0;
+
+	switch (cin) {
+	case USB_MIDI_CIN_SYSEX_START_OR_CONTINUE:
+		return cable_state_sysex(state, first_byte == SYSEX_START_BYTE, 0, cable_num,
+					 parse_cb, error);
+	case USB_MIDI_CIN_SYS_COMMON_OR_SYSEX_END_1BYTE:
+		if (first_byte != SYSEX_END_BYTE) {
+			cable_state_status(state, first_byte, cable_num, parse_cb);
+			return 1;
+		}
+		return cable_state_sysex(state, 0, 1, cable_num, parse_cb, error);
+	case USB_MIDI_CIN_SYSEX_END_2BYTE:
+	case USB_MIDI_CIN_SYSEX_END_3BYTE:
+		return cable_state_sysex(state, first_byte == SYSEX_START_BYTE, 1, cable_num,
+					 parse_cb, error);
+	default:
+		cable_state_status(state, first_byte, cable_num, parse_cb);
+		return 1;
+	}
+}
+
+/* The length of a message given its status byte. */
+static uint8_t msg_len_for_status(uint8_t status)
+{
+	switch (status & 0xf0) {
+	case 0xc0:
+	case 0xd0:
+		return 2;
+	case 0xf0:
+		break;
+	default:
+		return 3;
+	}
+	switch (status) {
+	case 0xf1:
+	case 0xf3:
+		return 2;
+	case 0xf2:
+		return 3;
+	default:
+		return 1;
+	}
+}
+
+/*
+ * Parses a byte of a MIDI byte stream. Complete messages are delivered
+ * through the message callback. Sysex data bytes are batched.
+ */
+static enum usb_midi_error_t byte_stream_parse(struct usb_midi_cable_state_t *state,
+					       uint8_t byte, uint8_t cable_num,
+					       struct usb_midi_parse_cb_t *parse_cb)
+{
+	enum usb_midi_error_t error = USB_MIDI_SUCCESS;
+
+	if (byte >= 0xf8) {
+		byte_stream_flush_sysex(state, cable_num, parse_cb);
+		if (parse_cb->message_cb) {
+			parse_cb->message_cb(&byte, 1, cable_num);
+		}
+		return USB_MIDI_SUCCESS;
+	}
+
+	if (byte == SYSEX_START_BYTE || byte == SYSEX_END_BYTE) {
+		int is_start = byte == SYSEX_START_BYTE;
+		state->num_msg_bytes = 0;
+		if (!is_start) {
+			byte_stream_flush_sysex(state, cable_num, parse_cb);
+		}
+		if (cable_state_sysex(state, is_start, !is_start, cable_num, parse_cb, &error)) {
+			if (is_start && parse_cb->sysex_start_cb) {
+				parse_cb->sysex_start_cb(cable_num);
+			} else if (!is_start && parse_cb->sysex_end_cb) {
+				parse_cb->sysex_end_cb(cable_num);
+			}
+		}
+		return error;
+	}
+
+	if (IS_STATUS_BYTE(byte)) {
+		cable_state_status(state, byte, cable_num, parse_cb);
+		state->num_msg_bytes = 0;
+		state->msg_bytes[state->num_msg_bytes++] = byte;
+	} else if (state->sysex_state != USB_MIDI_SYSEX_STATE_IDLE) {
+		if (cable_state_sysex(state, 0, 0, cable_num, parse_cb, &error)) {
+			state->sysex_bytes[state->num_sysex_bytes++] = byte;
+			if (state->num_sysex_bytes == USB_MIDI_BYTE_STREAM_SYSEX_BATCH_SIZE) {
+				byte_stream_flush_sysex(state, cable_num, parse_cb);
+			}
+		}
+		return error;
+	} else {
+		if (state->num_msg_bytes == 0) {
+			if (!state->running_status) {
+				/* A data byte without a status byte */
+				return USB_MIDI_ERROR_INVALID_MIDI_MSG;
+			}
+			state->msg_bytes[state->num_msg_bytes++] = state->running_status;
+		}
+		state->msg_bytes[state->num_msg_bytes++] = byte;
+	}
+
+	if (state->num_msg_bytes == msg_len_for_status(state->msg_bytes[0])) {
+		if (parse_cb->message_cb) {
+			parse_cb->message_cb(state->msg_bytes, state->num_msg_bytes, cable_num);
+		}
+		state->num_msg_bytes = 0;
+	}
+	return USB_MIDI_SUCCESS;
+}
+
+enum usb_midi_error_t usb_midi_parse_byte_stream(struct usb_midi_cable_state_t *state,
+					       const uint8_t *bytes, uint32_t num_bytes,
+					       uint8_t cable_num,
+					       struct usb_midi_parse_cb_t *parse_cb)
+{
+	enum usb_midi_error_t error = USB_MIDI_SUCCESS;
+	for (uint32_t i = 0; i < num_bytes; i++) {
+		enum usb_midi_error_t rc = byte_stream_parse(state, bytes[i], cable_num, parse_cb);
+		if (error == USB_MIDI_SUCCESS) {
+			error = rc;
+		}
+	}
+	byte_stream_flush_sysex(state, cable_num, parse_cb);
+	return error;
+}
+
+/* Inlined into usb_midi_parse_transfer, which parses most packets one by one */
+static inline enum usb_midi_error_t parse_packet(uint8_t *packet_bytes,
+						 struct usb_midi_parse_cb_t *parse_cb)
 {
+	uint8_t cin = packet_bytes[0] & 0x0f;
+	if (cin == USB_MIDI_CIN_MISC || cin == USB_MIDI_CIN_CABLE_EVENT) {
+		/* Reserved. Hosts like Windows pad transfers with all zero packets. */
+		return USB_MIDI_SUCCESS;
+	}
+
 	struct usb_midi_packet_t packet;
 	enum usb_midi_error_t rc = usb_midi_packet_from_usb_bytes(packet_bytes, &packet);
 	if (rc != USB_MIDI_SUCCESS) {
 		return rc;
 	}
 
+	struct usb_midi_cable_state_t *state = cable_state_for(parse_cb, packet.cable_num);
+	if (state) {
+		if (packet.cin == USB_MIDI_CIN_1BYTE_DATA) {
+			return byte_stream_parse(state, packet.bytes[1], packet.cable_num, parse_cb);
+		}
+		if (!cable_state_packet(state, packet.cin, packet.bytes[1], packet.cable_num,
+					parse_cb, &rc)) {
+			return rc;
+		}
+	}
+
 	switch (packet.cin) {
 	case USB_MIDI_CIN_SYSCOM_2BYTE:
 	case USB_MIDI_CIN_SYSCOM_3BYTE:
@@ -281,9 +591,10 @@ enum usb_midi_error_t usb_midi_parse_packet(uint8_t *packet_bytes,
 		 * which seems to imply that a class compliant driver
 		 * should also be able to parse a stream of single MIDI bytes? 
 		 * Or at least deliver these single bytes somehow?
-		 * Ignoring this for now.
 		 * 
-		 * TODO: Understand this better.
+		 * With state for the cable (see usb_midi_parse_cb_t),
+		 * complete messages are reassembled from the single bytes above.
+		 * Without it, the bytes are delivered as follows.
 		 * 
 		 * See https://forum.pjrc.com/index.php?threads/midi-sysex-single-byte-message-issue.23786/
 		 */
@@ -382,4 +693,85 @@ enum usb_midi_error_t usb_midi_parse_packet(uint8_t *packet_bytes,
 	}
 
 	return USB_MIDI_SUCCESS;
-}
\ No newline at end of file
+}
+
+enum usb_midi_error_t usb_midi_parse_packet(uint8_t *packet_bytes,
+					    struct usb_midi_parse_cb_t *parse_cb)
+{
+	return parse_packet(packet_bytes, parse_cb);
+}
+
+static inline int is_sysex_continue_word(uint32_t word)
+{
+	/* CIN 0x4 with three data bytes, i.e d, d, d */
+	return (word & (PACKET_HEADER_AND_STATUS_BITS_MASK & ~0xf0U)) ==
+	       USB_MIDI_CIN_SYSEX_START_OR_CONTINUE;
+}
+
+enum usb_midi_error_t usb_midi_parse_transfer(uint8_t *transfer_bytes, uint32_t num_bytes,
+					      struct usb_midi_parse_cb_t *parse_cb)
+{
+	enum usb_midi_error_t first_error = USB_MIDI_SUCCESS;
+	uint32_t num_packets = num_bytes / 4;
+	uint32_t i = 0;
+
+	while (i < num_packets) {
+		/*
+		 * Anything but sysex continuation packets, i.e CIN 0x4 with
+		 * three data bytes, is parsed a packet at a time. Checking the
+		 * CIN first keeps this loop as tight as usb_midi_parse_packet
+		 * calls on their own.
+		 */
+		while (i < num_packets &&
+		       ((transfer_bytes[4 * i] & 0x0f) != USB_MIDI_CIN_SYSEX_START_OR_CONTINUE ||
+			!is_sysex_continue_word(usb_midi_get_word(&transfer_bytes[4 * i])))) {
+			enum usb_midi_error_t error = parse_packet(&transfer_bytes[4 * i], parse_cb);
+			if (error != USB_MIDI_SUCCESS && first_error == USB_MIDI_SUCCESS) {
+				first_error = error;
+			}
+			i++;
+		}
+		if (i == num_packets) {
+			break;
+		}
+		uint8_t *packet_bytes = &transfer_bytes[4 * i];
+
+		/*
+		 * Fast path. Find the run of d, d, d packets on the same cable
+		 * starting here and gather their data bytes.
+		 */
+		uint8_t cable_num = packet_bytes[0] >> 4;
+		struct usb_midi_cable_state_t *state = cable_state_for(parse_cb, cable_num);
+		int deliver = 1;
+		if (state) {
+			enum usb_midi_error_t error = USB_MIDI_SUCCESS;
+			deliver = cable_state_packet(state, USB_MIDI_CIN_SYSEX_START_OR_CONTINUE,
+						     packet_bytes[1], cable_num, parse_cb, &error);
+			if (error != USB_MIDI_SUCCESS && first_error == USB_MIDI_SUCCESS) {
+				first_error = error;
+			}
+		}
+		uint32_t run_key = usb_midi_get_word(packet_bytes) & PACKET_HEADER_AND_STATUS_BITS_MASK;
+		uint32_t run_end = i + 1;
+		while (run_end < num_packets && run_end - i < MAX_SYSEX_RUN_PACKETS &&
+		       (usb_midi_get_word(&transfer_bytes[4 * run_end]) &
+			PACKET_HEADER_AND_STATUS_BITS_MASK) == run_key) {
+			run_end++;
+		}
+
+		if (deliver && parse_cb->sysex_data_cb) {
+			uint8_t data_bytes[3 * MAX_SYSEX_RUN_PACKETS];
+			uint8_t num_data_bytes = 0;
+			for (uint32_t j = i; j < run_end; j++) {
+				data_bytes[num_data_bytes++] = transfer_bytes[4 * j + 1];
+				data_bytes[num_data_bytes++] = transfer_bytes[4 * j + 2];
+				data_bytes[num_data_bytes++] = transfer_bytes[4 * j + 3];
+			}
+			parse_cb->sysex_data_cb(data_bytes, num_data_bytes, cable_num);
+		}
+		i = run_end;
+	}
+
+	usb_midi_flush_byte_streams(parse_cb);
+	return first_error;
+}
@@ -55,20 +55,122 @@ typedef void (*usb_midi_sysex_data_cb_t)(uint8_t *data_bytes, uint8_t num_data_b
 					 uint8_t cable_num);
 /** Called when a sysex message ends */
 typedef void (*usb_midi_sysex_end_cb_t)(uint8_t cable_num);
+/** Called when a sysex message in progress ends without F7 */
+typedef void (*usb_midi_sysex_abort_cb_t)(uint8_t cable_num);
+
+/* The max number of CIN 0xf sysex bytes delivered in one callback. */
+#define USB_MIDI_BYTE_STREAM_SYSEX_BATCH_SIZE 16
+
+/* Sysex state of a cable */
+enum usb_midi_sysex_state_t {
+	/* No sysex message in progress */
+	USB_MIDI_SYSEX_STATE_IDLE = 0,
+	/* A sysex message is in progress */
+	USB_MIDI_SYSEX_STATE_ACTIVE,
+	/* Dropping the rest of a sysex message whose start was not received */
+	USB_MIDI_SYSEX_STATE_DISCARD
+};
+
+/*
+ * Per cable parser state, used to validate the order of sysex packets and
+ * to reassemble messages sent as single bytes (CIN 0xf). Zero initialize
+ * before use.
+ */
+struct usb_midi_cable_state_t {
+	/* One of usb_midi_sysex_state_t */
+	uint8_t sysex_state;
+	/* The status byte of the last channel message, or 0 */
+	uint8_t running_status;
+	uint8_t msg_bytes[3];
+	uint8_t num_msg_bytes;
+	uint8_t num_sysex_bytes;
+	uint8_t sysex_bytes[USB_MIDI_BYTE_STREAM_SYSEX_BATCH_SIZE];
+};
 
 struct usb_midi_parse_cb_t {
 	usb_midi_message_cb_t message_cb;
 	usb_midi_sysex_start_cb_t sysex_start_cb;
 	usb_midi_sysex_data_cb_t sysex_data_cb;
 	usb_midi_sysex_end_cb_t sysex_end_cb;
+	usb_midi_sysex_abort_cb_t sysex_abort_cb;
+	/*
+	 * Optional state per cable, indexed by cable number. With it, sysex
+	 * data or an end without a start is dropped and reported as
+	 * USB_MIDI_ERROR_INVALID_MIDI_MSG, and a sysex message interrupted by
+	 * a new start or a non real time status byte is aborted. Without it,
+	 * packets are delivered as they are, and single bytes are delivered as
+	 * sysex data (data bytes) or single byte messages (status bytes).
+	 */
+	struct usb_midi_cable_state_t *cable_states;
+	uint8_t num_cable_states;
 };
 
 /**
- * Parses a USB MIDI packet and invokes the appropriate callback.
+ * Parses a USB MIDI packet and invokes the appropriate callback. Packets with
+ * the reserved CINs 0x0 and 0x1, e.g the all zero packets some hosts pad
+ * transfers with, are ignored.
  */
 enum usb_midi_error_t usb_midi_parse_packet(uint8_t *packet_bytes,
 					    struct usb_midi_parse_cb_t *parse_cb);
 
+/**
+ * Parses all USB MIDI packets of a bulk transfer and invokes the appropriate
+ * callbacks. Consecutive sysex continuation packets (three data bytes) on the
+ * same cable are delivered using a single sysex data callback. Parsing continues
+ * past invalid packets, in which case the first error is returned.
+ */
+enum usb_midi_error_t usb_midi_parse_transfer(uint8_t *transfer_bytes, uint32_t num_bytes,
+					      struct usb_midi_parse_cb_t *parse_cb);
+
+/**
+ * Parses a MIDI byte stream, e.g received from a DIN port, which may use
+ * running status. Complete messages are delivered through the message
+ * callback and sysex data bytes are batched, with the last batch delivered
+ * before returning. A message may span several calls. Parsing continues past
+ * invalid bytes, in which case the first error is returned.
+ * @param state The state of the stream. Zero initialize before use.
+ * @param cable_num Passed to the callbacks.
+ */
+enum usb_midi_error_t usb_midi_parse_byte_stream(struct usb_midi_cable_state_t *state,
+					       const uint8_t *bytes, uint32_t num_bytes,
+					       uint8_t cable_num,
+					       struct usb_midi_parse_cb_t *parse_cb);
+
+/**
+ * Delivers sysex bytes received as single bytes (CIN 0xf) that are being
+ * batched. Called by usb_midi_parse_transfer at the end of each transfer.
+ */
+void usb_midi_flush_byte_streams(struct usb_midi_parse_cb_t *parse_cb);
+
+/**
+ * Aborts sysex messages in progress and resets the state of all cables,
+ * e.g after a bus reset.
+ */
+void usb_midi_reset_cable_states(struct usb_midi_parse_cb_t *parse_cb);
+
+/**
+ * Reads a 32 bit little endian word, e.g a USB MIDI packet with the
+ * header in the least significant byte. Compiles to a single word load
+ * on little endian targets.
+ */
+static inline uint32_t usb_midi_get_word(const uint8_t *bytes)
+{
+	return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) |
+	       ((uint32_t)bytes[3] << 24);
+}
+
+/**
+ * Writes a 32 bit little endian word. Compiles to a single word store
+ * on little endian targets.
+ */
+static inline void usb_midi_put_word(uint32_t word, uint8_t *bytes)
+{
+	bytes[0] = word;
+	bytes[1] = word >> 8;
+	bytes[2] = word >> 16;
+	bytes[3] = word >> 24;
+}
+
 /* A USB MIDI event packet. See chapter 4 in the spec. */
 struct usb_midi_packet_t {
 	uint8_t cable_num;
@@ -82,4 +184,21 @@ enum usb_midi_error_t usb_midi_packet_from_midi_bytes(uint8_t *midi_bytes, uint8
 enum usb_midi_error_t usb_midi_packet_from_usb_bytes(uint8_t *packet_bytes,
 						     struct usb_midi_packet_t *packet);
 
+/**
+ * Builds USB MIDI packets from a span of a sysex message without classifying
+ * each chunk. The span may start with F0 and may end with F7, all other bytes
+ * are assumed to be data bytes. If the span does not end with F7, only complete
+ * three byte chunks are encoded and the remaining bytes are left for the next call.
+ * @param sysex_bytes The sysex bytes to encode.
+ * @param num_bytes The number of sysex bytes.
+ * @param cable_num The cable number of the packets, must be smaller than 16.
+ * @param packet_bytes Destination of the packets, 4 bytes per packet.
+ * @param max_packets Write at most this many packets.
+ * @param num_packets Set to the number of written packets.
+ * @return The number of encoded sysex bytes.
+ */
+uint32_t usb_midi_packets_from_sysex(const uint8_t *sysex_bytes, uint32_t num_bytes,
+				     uint8_t cable_num, uint8_t *packet_bytes,
+				     uint32_t max_packets, uint32_t *num_packets);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,291 @@
+#include <errno.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <usb_midi/usb_midi.h>
+#include "usb_midi_rate.h"
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_DECLARE(usb_midi, CONFIG_USB_MIDI_LOG_LEVEL);
+
+/* A message waiting for tokens */
+struct usb_midi_held_msg_t {
+	struct usb_midi_tx_token *token;
+	uint8_t midi_bytes[3];
+	uint8_t num_bytes;
+	/* Reported to the token if the message is discarded */
+	uint8_t num_usb_bytes;
+};
+
+/*
+ * The token bucket of a cable. Token amounts are in bytes times ticks per
+ * second, so that refilling for a number of ticks is a multiplication.
+ */
+struct usb_midi_rate_limiter_t {
+	/* 0 if the cable is not rate limited */
+	uint32_t bytes_per_s;
+	int64_t capacity;
+	/* Negative after sending sysex or priority messages on credit */
+	int64_t level;
+	int64_t refill_ticks;
+	/* A ring of messages waiting for tokens, oldest first */
+	struct usb_midi_held_msg_t held[CONFIG_USB_MIDI_TX_RATE_LIMIT_HOLD_SIZE];
+	uint32_t first_held;
+	uint32_t num_held;
+	/* When the oldest held message was held */
+	int64_t hold_start_ticks;
+	int64_t throttled_ticks;
+	struct usb_midi_rate_limit_stats stats;
+};
+
+static void rate_timer_handler(struct k_timer *timer);
+
+static K_TIMER_DEFINE(rate_timer, rate_timer_handler, NULL);
+static struct k_spinlock rate_lock;
+static struct usb_midi_rate_limiter_t limiters[CONFIG_USB_MIDI_NUM_OUTPUTS];
+/* Incremented when held messages are discarded */
+static uint32_t num_discards;
+
+static int64_t tokens_for_bytes(uint32_t num_bytes)
+{
+	return (int64_t)num_bytes * CONFIG_SYS_CLOCK_TICKS_PER_SEC;
+}
+
+/* Called with rate_lock held. */
+static void refill(struct usb_midi_rate_limiter_t *limiter, int64_t now)
+{
+	limiter->level = MIN(limiter->capacity,
+			     limiter->level + (now - limiter->refill_ticks) * limiter->bytes_per_s);
+	limiter->refill_ticks = now;
+}
+
+/* The number of ticks until the oldest held message can be sent. Called with rate_lock held. */
+static int64_t ticks_until_ready(struct usb_midi_rate_limiter_t *limiter)
+{
+	if (limiter->bytes_per_s == 0) {
+		/* The limit was removed while messages were held */
+		return 0;
+	}
+	int64_t deficit =
+		tokens_for_bytes(limiter->held[limiter->first_held].num_bytes) - limiter->level;
+	return deficit <= 0 ? 0 : (deficit + limiter->bytes_per_s - 1) / limiter->bytes_per_s;
+}
+
+/* Fires the timer in a number of ticks, unless it fires before that. Called with rate_lock held. */
+static void rate_timer_arm(int64_t ticks)
+{
+	k_ticks_t remaining_ticks = k_timer_remaining_ticks(&rate_timer);
+	if (remaining_ticks == 0 || ticks < remaining_ticks) {
+		k_timer_start(&rate_timer, K_TICKS(ticks), K_NO_WAIT);
+	}
+}
+
+/* Removes the oldest held message. Called with rate_lock held. */
+static void pop_held(struct usb_midi_rate_limiter_t *limiter, int64_t now)
+{
+	limiter->first_held = (limiter->first_held + 1) % CONFIG_USB_MIDI_TX_RATE_LIMIT_HOLD_SIZE;
+	limiter->num_held--;
+	if (limiter->num_held == 0) {
+		limiter->throttled_ticks += now - limiter->hold_start_ticks;
+	}
+}
+
+/* Enqueues the held messages that there are tokens for. */
+static void rate_timer_handler(struct k_timer *timer)
+{
+	int64_t next_ticks = INT64_MAX;
+	int num_added = 0;
+
+	for (int cable_number = 0; cable_number < CONFIG_USB_MIDI_NUM_OUTPUTS; cable_number++) {
+		struct usb_midi_rate_limiter_t *limiter = &limiters[cable_number];
+		while (1) {
+			k_spinlock_key_t key = k_spin_lock(&rate_lock);
+			if (limiter->num_held == 0) {
+				k_spin_unlock(&rate_lock, key);
+				break;
+			}
+			refill(limiter, k_uptime_ticks());
+			int64_t ticks = ticks_until_ready(limiter);
+			if (ticks > 0) {
+				next_ticks = MIN(next_ticks, ticks);
+				k_spin_unlock(&rate_lock, key);
+				break;
+			}
+			struct usb_midi_held_msg_t msg = limiter->held[limiter->first_held];
+			uint32_t prev_num_discards = num_discards;
+			k_spin_unlock(&rate_lock, key);
+
+			/* Without the lock, since this may send a full buffer */
+			int rc = usb_midi_tx_buffer_add_unlimited(cable_number, msg.midi_bytes, msg.token);
+			if (rc == -1) {
+				/* Full. Send what has been enqueued so far and try again. */
+				usb_midi_tx_buffer_send();
+				num_added = 0;
+				rc = usb_midi_tx_buffer_add_unlimited(cable_number, msg.midi_bytes,
+								      msg.token);
+			}
+			if (rc == -1) {
+				/* The endpoint is busy with a full buffer. Retry on the next tick. */
+				next_ticks = 1;
+				break;
+			}
+			if (rc != 0) {
+				LOG_ERR("Failed to send held message with error %d", rc);
+			} else {
+				num_added++;
+			}
+
+			key = k_spin_lock(&rate_lock);
+			/* Unless the message was discarded while being enqueued */
+			if (num_discards == prev_num_discards) {
+				if (limiter->bytes_per_s > 0) {
+					limiter->level -= tokens_for_bytes(msg.num_bytes);
+				}
+				pop_held(limiter, k_uptime_ticks());
+			}
+			k_spin_unlock(&rate_lock, key);
+		}
+	}
+
+	if (next_ticks != INT64_MAX) {
+		k_spinlock_key_t key = k_spin_lock(&rate_lock);
+		rate_timer_arm(next_ticks);
+		k_spin_unlock(&rate_lock, key);
+	}
+	if (num_added > 0) {
+		usb_midi_tx_buffer_send();
+	}
+}
+
+int usb_midi_rate_limit_admit(uint8_t cable_number, const uint8_t *midi_bytes, uint8_t num_bytes,
+			      struct usb_midi_tx_token *token)
+{
+	if (cable_number >= CONFIG_USB_MIDI_NUM_OUTPUTS) {
+		return 0;
+	}
+	struct usb_midi_rate_limiter_t *limiter = &limiters[cable_number];
+	int rc = 0;
+
+	k_spinlock_key_t key = k_spin_lock(&rate_lock);
+	/* Also hold messages after the limit was removed, until the held ones are sent */
+	if (limiter->bytes_per_s > 0 || limiter->num_held > 0) {
+		int64_t now = k_uptime_ticks();
+		refill(limiter, now);
+		if (limiter->num_held == 0 && limiter->level >= tokens_for_bytes(num_bytes)) {
+			rc = 0;
+		} else if (limiter->num_held == CONFIG_USB_MIDI_TX_RATE_LIMIT_HOLD_SIZE) {
+			limiter->stats.num_rejected++;
+			rc = -ENOMEM;
+		} else {
+			if (limiter->num_held == 0) {
+				limiter->hold_start_ticks = now;
+			}
+			struct usb_midi_held_msg_t *msg =
+				&limiter->held[(limiter->first_held + limiter->num_held) %
+					       CONFIG_USB_MIDI_TX_RATE_LIMIT_HOLD_SIZE];
+			msg->token = token;
+			msg->num_bytes = num_bytes;
+			for (int i = 0; i < 3; i++) {
+				msg->midi_bytes[i] = midi_bytes[i];
+			}
+			msg->num_usb_bytes = usb_midi_tx_num_usb_bytes(cable_number, msg->midi_bytes);
+			limiter->num_held++;
+			limiter->stats.num_held++;
+			limiter->stats.max_held = MAX(limiter->stats.max_held, limiter->num_held);
+			rate_timer_arm(ticks_until_ready(limiter));
+			rc = 1;
+		}
+	}
+	k_spin_unlock(&rate_lock, key);
+	return rc;
+}
+
+void usb_midi_rate_limit_charge(uint8_t cable_number, uint32_t num_bytes)
+{
+	if (cable_number >= CONFIG_USB_MIDI_NUM_OUTPUTS) {
+		return;
+	}
+	struct usb_midi_rate_limiter_t *limiter = &limiters[cable_number];
+	k_spinlock_key_t key = k_spin_lock(&rate_lock);
+	if (limiter->bytes_per_s > 0) {
+		refill(limiter, k_uptime_ticks());
+		limiter->level -= tokens_for_bytes(num_bytes);
+	}
+	k_spin_unlock(&rate_lock, key);
+}
+
+void usb_midi_rate_limit_discard(int status)
+{
+	for (int cable_number = 0; cable_number < CONFIG_USB_MIDI_NUM_OUTPUTS; cable_number++) {
+		struct usb_midi_rate_limiter_t *limiter = &limiters[cable_number];
+		while (1) {
+			k_spinlock_key_t key = k_spin_lock(&rate_lock);
+			if (limiter->num_held == 0) {
+				k_spin_unlock(&rate_lock, key);
+				break;
+			}
+			struct usb_midi_tx_token *token = limiter->held[limiter->first_held].token;
+			uint8_t num_usb_bytes = limiter->held[limiter->first_held].num_usb_bytes;
+			pop_held(limiter, k_uptime_ticks());
+			num_discards++;
+			k_spin_unlock(&rate_lock, key);
+
+			/* Without the lock, since the callback may send more messages */
+			if (token && token->cb) {
+				token->cb(token, num_usb_bytes, status);
+			}
+		}
+	}
+}
+
+int usb_midi_tx_rate_limit_set(uint8_t cable_number, uint32_t bytes_per_s, uint32_t burst_bytes)
+{
+	/* A burst must fit the longest message */
+	if (cable_number >= CONFIG_USB_MIDI_NUM_OUTPUTS || (bytes_per_s > 0 && burst_bytes < 3)) {
+		return -EINVAL;
+	}
+	struct usb_midi_rate_limiter_t *limiter = &limiters[cable_number];
+	k_spinlock_key_t key = k_spin_lock(&rate_lock);
+	limiter->bytes_per_s = bytes_per_s;
+	limiter->capacity = tokens_for_bytes(burst_bytes);
+	limiter->level = limiter->capacity;
+	limiter->refill_ticks = k_uptime_ticks();
+	if (limiter->num_held > 0) {
+		/* The held messages may be sendable sooner, or right away without a limit */
+		rate_timer_arm(ticks_until_ready(limiter));
+	}
+	k_spin_unlock(&rate_lock, key);
+	return 0;
+}
+
+int usb_midi_tx_rate_limit_stats_get(uint8_t cable_number, struct usb_midi_rate_limit_stats *stats)
+{
+	if (cable_number >= CONFIG_USB_MIDI_NUM_OUTPUTS) {
+		return -EINVAL;
+	}
+	struct usb_midi_rate_limiter_t *limiter = &limiters[cable_number];
+	k_spinlock_key_t key = k_spin_lock(&rate_lock);
+	*stats = limiter->stats;
+	int64_t throttled_ticks = limiter->throttled_ticks;
+	if (limiter->num_held > 0) {
+		throttled_ticks += k_uptime_ticks() - limiter->hold_start_ticks;
+	}
+	stats->num_currently_held = limiter->num_held;
+	k_spin_unlock(&rate_lock, key);
+	stats->throttled_us = k_ticks_to_us_floor64(throttled_ticks);
+	return 0;
+}
+
+int usb_midi_tx_rate_limit_stats_reset(uint8_t cable_number)
+{
+	if (cable_number >= CONFIG_USB_MIDI_NUM_OUTPUTS) {
+		return -EINVAL;
+	}
+	struct usb_midi_rate_limiter_t *limiter = &limiters[cable_number];
+	k_spinlock_key_t key = k_spin_lock(&rate_lock);
+	memset(&limiter->stats, 0, sizeof(limiter->stats));
+	limiter->throttled_ticks = 0;
+	/* Time held from now on counts */
+	limiter->hold_start_ticks = k_uptime_ticks();
+	k_spin_unlock(&rate_lock, key);
+	return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef ZEPHYR_USB_MIDI_RATE_H_
+#define ZEPHYR_USB_MIDI_RATE_H_
+
+#include <stdint.h>
+#include <usb_midi/usb_midi.h>
+
+#ifdef CONFIG_USB_MIDI_TX_RATE_LIMIT
+/*
+ * Holds a message if its cable is out of tokens or already has held messages.
+ * Held messages are enqueued with usb_midi_tx_buffer_add_unlimited when tokens
+ * are available. Returns 0 if the message can be sent now, in which case
+ * usb_midi_rate_limit_charge must be called once it has been, 1 if it was held
+ * and -ENOMEM if the hold queue of the cable is full.
+ */
+int usb_midi_rate_limit_admit(uint8_t cable_number, const uint8_t *midi_bytes, uint8_t num_bytes,
+			      struct usb_midi_tx_token *token);
+/*
+ * Takes tokens for bytes sent on a cable. Also for bytes that are never held,
+ * i.e sysex and priority messages, which may leave the bucket in debt.
+ */
+void usb_midi_rate_limit_charge(uint8_t cable_number, uint32_t num_bytes);
+/* Drops all held messages, e.g when the device is reset. */
+void usb_midi_rate_limit_discard(int status);
+/* Like usb_midi_tx_buffer_add_with_token, without rate limiting. In usb_midi.c. */
+int usb_midi_tx_buffer_add_unlimited(uint8_t cable_number, uint8_t *midi_bytes,
+				     struct usb_midi_tx_token *token);
+/* The number of USB bytes a message is enqueued as, 8 for sysex as UMP. In usb_midi.c. */
+uint8_t usb_midi_tx_num_usb_bytes(uint8_t cable_number, uint8_t *midi_bytes);
+#else
+static inline int usb_midi_rate_limit_admit(uint8_t cable_number, const uint8_t *midi_bytes,
+					    uint8_t num_bytes, struct usb_midi_tx_token *token)
+{
+	return 0;
+}
+
+static inline void usb_midi_rate_limit_charge(uint8_t cable_number, uint32_t num_bytes)
+{
+}
+
+static inline void usb_midi_rate_limit_discard(int status)
+{
+}
+#endif
+
+#endif
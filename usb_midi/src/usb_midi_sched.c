@@ -0,0 +1,220 @@
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <usb_midi/usb_midi.h>
+#include "usb_midi_packet.h"
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_DECLARE(usb_midi, CONFIG_USB_MIDI_LOG_LEVEL);
+
+/* A message waiting to be sent */
+struct usb_midi_sched_entry_t {
+	uint64_t deadline_cycles;
+	/* Keeps messages with the same deadline in the order they were scheduled */
+	uint32_t seq;
+	uint8_t cable_number;
+	uint8_t midi_bytes[3];
+};
+
+/* The max number of due messages the timer handler takes from the heap at a time */
+#define SCHED_BATCH_SIZE 8
+
+static void sched_timer_handler(struct k_timer *timer);
+
+static K_TIMER_DEFINE(sched_timer, sched_timer_handler, NULL);
+static struct k_spinlock sched_lock;
+
+/* A binary min heap ordered by deadline, then by seq. */
+static struct usb_midi_sched_entry_t heap[CONFIG_USB_MIDI_TX_SCHED_SIZE];
+static uint32_t heap_size;
+static uint32_t next_seq;
+/* Messages taken from the heap by the timer handler and not yet enqueued. They keep their slots. */
+static uint32_t num_in_flight;
+/* Incremented by usb_midi_tx_at_clear, so that messages in flight are not put back */
+static uint32_t clear_count;
+
+static int entry_is_before(const struct usb_midi_sched_entry_t *a,
+			   const struct usb_midi_sched_entry_t *b)
+{
+	if (a->deadline_cycles != b->deadline_cycles) {
+		return a->deadline_cycles < b->deadline_cycles;
+	}
+	/* Wraps around correctly as long as fewer than 2^31 messages are waiting */
+	return (int32_t)(a->seq - b->seq) < 0;
+}
+
+static void heap_swap(uint32_t i, uint32_t j)
+{
+	struct usb_midi_sched_entry_t tmp = heap[i];
+	heap[i] = heap[j];
+	heap[j] = tmp;
+}
+
+static void heap_push(const struct usb_midi_sched_entry_t *entry)
+{
+	uint32_t i = heap_size++;
+	heap[i] = *entry;
+	while (i > 0 && entry_is_before(&heap[i], &heap[(i - 1) / 2])) {
+		heap_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void heap_pop()
+{
+	heap[0] = heap[--heap_size];
+	uint32_t i = 0;
+	while (1) {
+		uint32_t first = i;
+		uint32_t left = 2 * i + 1;
+		uint32_t right = left + 1;
+		if (left < heap_size && entry_is_before(&heap[left], &heap[first])) {
+			first = left;
+		}
+		if (right < heap_size && entry_is_before(&heap[right], &heap[first])) {
+			first = right;
+		}
+		if (first == i) {
+			break;
+		}
+		heap_swap(i, first);
+		i = first;
+	}
+}
+
+/* Arms the timer for the earliest message. Called with sched_lock held. */
+static void sched_timer_arm(k_timeout_t retry_timeout)
+{
+	if (heap_size == 0) {
+		k_timer_stop(&sched_timer);
+		return;
+	}
+	if (!K_TIMEOUT_EQ(retry_timeout, K_NO_WAIT)) {
+		k_timer_start(&sched_timer, retry_timeout, K_NO_WAIT);
+		return;
+	}
+	k_ticks_t ticks = k_cyc_to_ticks_ceil64(heap[0].deadline_cycles);
+	k_timer_start(&sched_timer, K_TIMEOUT_ABS_TICKS(ticks), K_NO_WAIT);
+}
+
+/* Takes the messages due by batch_end off the heap. Called with sched_lock held. */
+static uint32_t sched_batch_pop(struct usb_midi_sched_entry_t *batch, uint64_t batch_end)
+{
+	uint32_t num_due = 0;
+	while (num_due < SCHED_BATCH_SIZE && heap_size > 0 && heap[0].deadline_cycles <= batch_end) {
+		batch[num_due++] = heap[0];
+		heap_pop();
+	}
+	num_in_flight = num_due;
+	return num_due;
+}
+
+/*
+ * Enqueues a batch of messages. Called without sched_lock held, since the TX
+ * functions take the TX lock. Returns the number of messages done with, the
+ * rest could not be enqueued because the endpoint is busy with a full buffer.
+ */
+static uint32_t sched_batch_add(struct usb_midi_sched_entry_t *batch, uint32_t num_due,
+				int *num_added)
+{
+	for (uint32_t i = 0; i < num_due; i++) {
+		int rc = usb_midi_tx_buffer_add(batch[i].cable_number, batch[i].midi_bytes);
+		if (rc == -1) {
+			/* Full. Send what has been enqueued so far and try again. */
+			usb_midi_tx_buffer_send();
+			*num_added = 0;
+			rc = usb_midi_tx_buffer_add(batch[i].cable_number, batch[i].midi_bytes);
+		}
+		if (rc == -1) {
+			return i;
+		}
+		if (rc != 0) {
+			LOG_ERR("Failed to send scheduled message with error %d", rc);
+		} else {
+			(*num_added)++;
+		}
+	}
+	return num_due;
+}
+
+static void sched_timer_handler(struct k_timer *timer)
+{
+	/* Messages due within the batch window go in the same transfer. */
+	uint64_t batch_end = k_cycle_get_64() +
+			     k_us_to_cyc_ceil64(CONFIG_USB_MIDI_TX_SCHED_BATCH_US);
+	k_timeout_t retry_timeout = K_NO_WAIT;
+	struct usb_midi_sched_entry_t batch[SCHED_BATCH_SIZE];
+	uint32_t num_due;
+	int num_added = 0;
+
+	do {
+		k_spinlock_key_t key = k_spin_lock(&sched_lock);
+		num_due = sched_batch_pop(batch, batch_end);
+		uint32_t batch_clear_count = clear_count;
+		k_spin_unlock(&sched_lock, key);
+
+		uint32_t num_done = sched_batch_add(batch, num_due, &num_added);
+
+		key = k_spin_lock(&sched_lock);
+		if (num_done < num_due) {
+			/*
+			 * The endpoint is busy with a full buffer. The rest go back
+			 * with their seq, so they keep their order, and are retried
+			 * on the next tick.
+			 */
+			for (uint32_t i = num_done; clear_count == batch_clear_count && i < num_due;
+			     i++) {
+				heap_push(&batch[i]);
+			}
+			retry_timeout = K_TICKS(1);
+		}
+		num_in_flight = 0;
+		k_spin_unlock(&sched_lock, key);
+	} while (num_due == SCHED_BATCH_SIZE && K_TIMEOUT_EQ(retry_timeout, K_NO_WAIT));
+
+	k_spinlock_key_t key = k_spin_lock(&sched_lock);
+	sched_timer_arm(retry_timeout);
+	k_spin_unlock(&sched_lock, key);
+
+	if (num_added > 0) {
+		usb_midi_tx_buffer_send();
+	}
+}
+
+int usb_midi_tx_at(uint8_t cable_number, uint8_t *midi_bytes, uint64_t deadline_cycles)
+{
+	struct usb_midi_packet_t packet;
+	if (usb_midi_packet_from_midi_bytes(midi_bytes, cable_number, &packet) != USB_MIDI_SUCCESS ||
+	    midi_bytes[0] < 0x80 || midi_bytes[0] == 0xf0 || midi_bytes[0] == 0xf7) {
+		/* Parts of longer sysex messages can not be scheduled on their own. */
+		return -EINVAL;
+	}
+
+	struct usb_midi_sched_entry_t entry = {
+		.deadline_cycles = deadline_cycles,
+		.cable_number = cable_number,
+		.midi_bytes = {midi_bytes[0], midi_bytes[1], midi_bytes[2]},
+	};
+	int rc = 0;
+	k_spinlock_key_t key = k_spin_lock(&sched_lock);
+	if (heap_size + num_in_flight == CONFIG_USB_MIDI_TX_SCHED_SIZE) {
+		rc = -ENOMEM;
+	} else {
+		entry.seq = next_seq++;
+		heap_push(&entry);
+		if (heap[0].seq == entry.seq) {
+			/* The new message is the earliest */
+			sched_timer_arm(K_NO_WAIT);
+		}
+	}
+	k_spin_unlock(&sched_lock, key);
+	return rc;
+}
+
+void usb_midi_tx_at_clear()
+{
+	k_spinlock_key_t key = k_spin_lock(&sched_lock);
+	heap_size = 0;
+	clear_count++;
+	sched_timer_arm(K_NO_WAIT);
+	k_spin_unlock(&sched_lock, key);
+}
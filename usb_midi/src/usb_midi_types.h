@@ -2,8 +2,24 @@
 #define ZEPHYR_USB_MIDI_TYPES_H_
 
 #include <zephyr/init.h>
+#include <zephyr/sys/util.h>
 #include <zephyr/usb/usb_device.h>
 
+#ifdef CONFIG_USB_MIDI_SECONDARY_EP_PAIR
+#define USB_MIDI_NUM_EP_PAIRS 2
+/* Cables with this number and above are carried by the secondary endpoint pair. */
+#define USB_MIDI_SECONDARY_FIRST_CABLE CONFIG_USB_MIDI_SECONDARY_EP_PAIR_FIRST_CABLE
+#else
+#define USB_MIDI_NUM_EP_PAIRS 1
+#define USB_MIDI_SECONDARY_FIRST_CABLE 16
+#endif
+
+/* The number of input and output jacks carried by each endpoint pair. */
+#define USB_MIDI_PRIMARY_NUM_INPUTS MIN(CONFIG_USB_MIDI_NUM_INPUTS, USB_MIDI_SECONDARY_FIRST_CABLE)
+#define USB_MIDI_PRIMARY_NUM_OUTPUTS MIN(CONFIG_USB_MIDI_NUM_OUTPUTS, USB_MIDI_SECONDARY_FIRST_CABLE)
+#define USB_MIDI_SECONDARY_NUM_INPUTS (CONFIG_USB_MIDI_NUM_INPUTS - USB_MIDI_PRIMARY_NUM_INPUTS)
+#define USB_MIDI_SECONDARY_NUM_OUTPUTS (CONFIG_USB_MIDI_NUM_OUTPUTS - USB_MIDI_PRIMARY_NUM_OUTPUTS)
+
 /** 
  * MS (MIDI streaming) Class-Specific Interface Descriptor Subtypes. 
  * See table A.1 in the spec. 
@@ -22,7 +38,30 @@ enum usb_midi_if_desc_subtype {
  */
 enum usb_midi_ep_desc_subtype {
 	USB_MIDI_EP_DESC_UNDEFINED =  0x00,
-	USB_MIDI_EP_DESC_MS_GENERAL = 0x01
+	USB_MIDI_EP_DESC_MS_GENERAL = 0x01,
+	/* See table A-2 in the USB MIDI 2.0 spec. */
+	USB_MIDI_EP_DESC_MS_GENERAL_2_0 = 0x02
+};
+
+/** 
+ * Group Terminal Block descriptor type and subtypes. 
+ * See tables A-3 and A-4 in the USB MIDI 2.0 spec. 
+ */
+#define USB_MIDI_DESC_CS_GR_TRM_BLOCK 0x26
+enum usb_midi_gtb_desc_subtype {
+	USB_MIDI_GTB_DESC_UNDEFINED = 0x00,
+	USB_MIDI_GTB_DESC_HEADER =    0x01,
+	USB_MIDI_GTB_DESC_BLOCK =     0x02
+};
+
+/** 
+ * Group Terminal Block types. 
+ * See table 5-6 in the USB MIDI 2.0 spec. 
+ */
+enum usb_midi_gtb_type {
+	USB_MIDI_GTB_TYPE_BIDIRECTIONAL = 0x00,
+	USB_MIDI_GTB_TYPE_IN_ONLY =       0x01,
+	USB_MIDI_GTB_TYPE_OUT_ONLY =      0x02
 };
 
 /** 
@@ -158,7 +197,7 @@ struct usb_midi_bulk_out_ep_descriptor {
 	uint8_t bDescriptorType;
 	uint8_t bDescriptorSubtype;
 	uint8_t bNumEmbMIDIJack;
-	uint8_t BaAssocJackID[CONFIG_USB_MIDI_NUM_INPUTS];
+	uint8_t BaAssocJackID[USB_MIDI_PRIMARY_NUM_INPUTS];
 } __packed;
 
 /** 
@@ -170,7 +209,31 @@ struct usb_midi_bulk_in_ep_descriptor {
 	uint8_t bDescriptorType;
 	uint8_t bDescriptorSubtype;
 	uint8_t bNumEmbMIDIJack;
-	uint8_t BaAssocJackID[CONFIG_USB_MIDI_NUM_OUTPUTS];
+	uint8_t BaAssocJackID[USB_MIDI_PRIMARY_NUM_OUTPUTS];
+} __packed;
+
+/** 
+ * Class-Specific MS Bulk Data Endpoint Descriptor of the
+ * secondary OUT endpoint.
+ */
+struct usb_midi_secondary_bulk_out_ep_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bDescriptorSubtype;
+	uint8_t bNumEmbMIDIJack;
+	uint8_t BaAssocJackID[USB_MIDI_SECONDARY_NUM_INPUTS];
+} __packed;
+
+/** 
+ * Class-Specific MS Bulk Data Endpoint Descriptor of the
+ * secondary IN endpoint.
+ */
+struct usb_midi_secondary_bulk_in_ep_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bDescriptorSubtype;
+	uint8_t bNumEmbMIDIJack;
+	uint8_t BaAssocJackID[USB_MIDI_SECONDARY_NUM_OUTPUTS];
 } __packed;
 
 #define USB_MIDI_ELEMENT_CAPS_COUNT 1
@@ -194,6 +257,63 @@ struct usb_midi_element_descriptor {
 	uint8_t iElement;
 } __packed;
 
+/** 
+ * Class-Specific MS Bulk Data Endpoint Descriptor of the MIDI 2.0
+ * alternate setting. See table 5-5 in the USB MIDI 2.0 spec. 
+ */
+struct usb_midi2_bulk_ep_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	/** MS_GENERAL_2_0 */
+	uint8_t bDescriptorSubtype;
+	/** Number of Group Terminal Blocks associated with this endpoint. */
+	uint8_t bNumGrpTrmBlock;
+	uint8_t baAssoGrpTrmBlkID[1];
+} __packed;
+
+/** 
+ * Group Terminal Block Header Descriptor. 
+ * See table 5-7 in the USB MIDI 2.0 spec. 
+ */
+struct usb_midi2_gtb_header_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bDescriptorSubtype;
+	/** Total number of bytes of this header and all Group Terminal Block descriptors. */
+	uint16_t wTotalLength;
+} __packed;
+
+/** 
+ * Group Terminal Block Descriptor. 
+ * See table 5-8 in the USB MIDI 2.0 spec. 
+ */
+struct usb_midi2_gtb_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bDescriptorSubtype;
+	uint8_t bGrpTrmBlkID;
+	/** Bidirectional, IN only or OUT only. */
+	uint8_t bGrpTrmBlkType;
+	/** The first group of this block. */
+	uint8_t nGroupTrm;
+	/** The number of groups of this block. */
+	uint8_t nNumGroupTrm;
+	uint8_t iBlockItem;
+	/** 0x00 means unknown, i.e negotiated using MIDI-CI. */
+	uint8_t bMIDIProtocol;
+	uint16_t wMaxInputBandwidth;
+	uint16_t wMaxOutputBandwidth;
+} __packed;
+
+/** 
+ * The Group Terminal Block descriptors returned on request by the
+ * MIDI 2.0 alternate setting. 
+ */
+struct usb_midi2_gtb_descriptors {
+	struct usb_midi2_gtb_header_descriptor header;
+	struct usb_midi2_gtb_descriptor block;
+} __packed;
+
 /** 
  * A complete set of descriptors for a USB MIDI device without physical jacks. 
  */
@@ -209,6 +329,21 @@ struct usb_midi_config {
 	struct usb_midi_bulk_out_ep_descriptor out_cs_ep;
 	struct usb_ep_descriptor_padded in_ep;
 	struct usb_midi_bulk_in_ep_descriptor in_cs_ep;
+#ifdef CONFIG_USB_MIDI_SECONDARY_EP_PAIR
+	struct usb_ep_descriptor_padded secondary_out_ep;
+	struct usb_midi_secondary_bulk_out_ep_descriptor secondary_out_cs_ep;
+	struct usb_ep_descriptor_padded secondary_in_ep;
+	struct usb_midi_secondary_bulk_in_ep_descriptor secondary_in_cs_ep;
+#endif
+#ifdef CONFIG_USB_MIDI_2_0
+	/* MIDI 2.0 alternate setting of the MIDI streaming interface */
+	struct usb_if_descriptor ms2_if;
+	struct usb_midi_ms_if_descriptor ms2_cs_if;
+	struct usb_ep_descriptor ump_out_ep;
+	struct usb_midi2_bulk_ep_descriptor ump_out_cs_ep;
+	struct usb_ep_descriptor ump_in_ep;
+	struct usb_midi2_bulk_ep_descriptor ump_in_cs_ep;
+#endif
 } __packed;
 
 #endif
\ No newline at end of file
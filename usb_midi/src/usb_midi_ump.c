@@ -0,0 +1,339 @@
+#include "usb_midi_ump.h"
+
+#define SYSEX_START_BYTE 0xF0
+#define SYSEX_END_BYTE	 0xF7
+
+/* The first word of a UMP, holding the message type and the group. */
+#define UMP_HEADER(mt, group) (((uint32_t)(mt) << 28) | ((uint32_t)((group) & 0xf) << 24))
+
+uint8_t usb_midi_ump_num_words(uint32_t first_word)
+{
+	switch (first_word >> 28) {
+	case 0x0:
+	case 0x1:
+	case 0x2:
+	case 0x6:
+	case 0x7:
+		return 1;
+	case 0x3:
+	case 0x4:
+	case 0x8:
+	case 0x9:
+	case 0xa:
+		return 2;
+	case 0xb:
+	case 0xc:
+		return 3;
+	default:
+		return 4;
+	}
+}
+
+/*
+ * Packs UMP bytes, given in the order they appear in the spec,
+ * into 32 bit words. The first byte is the most significant byte
+ * of the first word.
+ */
+static void pack_ump_words(const uint8_t *ump_bytes, int num_words, uint32_t *words)
+{
+	for (int i = 0; i < num_words; i++) {
+		const uint8_t *b = &ump_bytes[4 * i];
+		words[i] = ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) |
+			   (uint32_t)b[3];
+	}
+}
+
+static void sysex7_packet(uint8_t group, uint8_t status, const uint8_t *data_bytes,
+			  uint8_t num_data_bytes, uint32_t *words)
+{
+	uint8_t ump_bytes[8] = {0};
+	ump_bytes[0] = (USB_MIDI_UMP_MT_SYSEX7 << 4) | (group & 0xf);
+	ump_bytes[1] = (status << 4) | num_data_bytes;
+	for (int i = 0; i < num_data_bytes; i++) {
+		ump_bytes[2 + i] = data_bytes[i];
+	}
+	pack_ump_words(ump_bytes, 2, words);
+}
+
+static void sysex8_packet(uint8_t group, uint8_t status, uint8_t stream_id,
+			  const uint8_t *data_bytes, uint8_t num_data_bytes, uint32_t *words)
+{
+	uint8_t ump_bytes[16] = {0};
+	ump_bytes[0] = (USB_MIDI_UMP_MT_DATA128 << 4) | (group & 0xf);
+	/* The byte count includes the stream ID */
+	ump_bytes[1] = (status << 4) | (num_data_bytes + 1);
+	ump_bytes[2] = stream_id;
+	for (int i = 0; i < num_data_bytes; i++) {
+		ump_bytes[3 + i] = data_bytes[i];
+	}
+	pack_ump_words(ump_bytes, 4, words);
+}
+
+static uint8_t sysex_status(int is_first, int is_last)
+{
+	if (is_first) {
+		return is_last ? USB_MIDI_UMP_SYSEX_COMPLETE : USB_MIDI_UMP_SYSEX_START;
+	}
+	return is_last ? USB_MIDI_UMP_SYSEX_END : USB_MIDI_UMP_SYSEX_CONTINUE;
+}
+
+enum usb_midi_error_t usb_midi_ump_from_midi1_bytes(uint8_t *midi_bytes, uint8_t group,
+						    uint32_t *words, uint8_t *num_words)
+{
+	struct usb_midi_packet_t packet;
+	enum usb_midi_error_t error = usb_midi_packet_from_midi_bytes(midi_bytes, group, &packet);
+	if (error != USB_MIDI_SUCCESS) {
+		return error;
+	}
+
+	uint32_t midi_word = ((uint32_t)packet.bytes[1] << 16) | ((uint32_t)packet.bytes[2] << 8) |
+			     packet.bytes[3];
+
+	switch (packet.cin) {
+	case USB_MIDI_CIN_NOTE_ON:
+	case USB_MIDI_CIN_NOTE_OFF:
+	case USB_MIDI_CIN_POLY_KEYPRESS:
+	case USB_MIDI_CIN_CONTROL_CHANGE:
+	case USB_MIDI_CIN_PROGRAM_CHANGE:
+	case USB_MIDI_CIN_CHANNEL_PRESSURE:
+	case USB_MIDI_CIN_PITCH_BEND_CHANGE:
+		words[0] = UMP_HEADER(USB_MIDI_UMP_MT_MIDI1_CHANNEL_VOICE, group) | midi_word;
+		*num_words = 1;
+		return USB_MIDI_SUCCESS;
+	case USB_MIDI_CIN_SYSCOM_2BYTE:
+	case USB_MIDI_CIN_SYSCOM_3BYTE:
+	case USB_MIDI_CIN_1BYTE_DATA:
+		words[0] = UMP_HEADER(USB_MIDI_UMP_MT_SYSTEM, group) | midi_word;
+		*num_words = 1;
+		return USB_MIDI_SUCCESS;
+	case USB_MIDI_CIN_SYS_COMMON_OR_SYSEX_END_1BYTE:
+		if (packet.bytes[1] != SYSEX_END_BYTE) {
+			/* Tune request */
+			words[0] = UMP_HEADER(USB_MIDI_UMP_MT_SYSTEM, group) | midi_word;
+			*num_words = 1;
+			return USB_MIDI_SUCCESS;
+		}
+		break;
+	default:
+		break;
+	}
+
+	/* A sysex chunk. F0 and F7 are implied by the sysex7 status. */
+	uint32_t num_sysex_bytes = 0;
+	uint32_t num_packets = 0;
+	num_sysex_bytes = usb_midi_ump_from_sysex7(&packet.bytes[1], packet.num_midi_bytes, group,
+						   words, 1, 1, &num_packets);
+	if (num_sysex_bytes != packet.num_midi_bytes) {
+		return USB_MIDI_ERROR_INVALID_MIDI_MSG;
+	}
+	*num_words = 2;
+	return USB_MIDI_SUCCESS;
+}
+
+uint32_t usb_midi_ump_from_sysex7(const uint8_t *sysex_bytes, uint32_t num_bytes, uint8_t group,
+				  uint32_t *words, uint32_t max_packets, int flush,
+				  uint32_t *num_words)
+{
+	int has_start = num_bytes > 0 && sysex_bytes[0] == SYSEX_START_BYTE;
+	int has_end = num_bytes > (uint32_t)has_start && sysex_bytes[num_bytes - 1] == SYSEX_END_BYTE;
+	const uint8_t *data = sysex_bytes + has_start;
+	const uint8_t *data_end = sysex_bytes + num_bytes - has_end;
+	uint32_t packet_idx = 0;
+
+	while (packet_idx < max_packets) {
+		uint32_t num_remaining = data_end - data;
+		int is_last = has_end && num_remaining <= USB_MIDI_UMP_SYSEX7_MAX_BYTES;
+		int is_short = !is_last && num_remaining < USB_MIDI_UMP_SYSEX7_MAX_BYTES;
+		if (is_short) {
+			int has_bytes = num_remaining > 0 || (packet_idx == 0 && has_start);
+			if (!flush || !has_bytes) {
+				/* Incomplete chunk. Wait for more bytes. */
+				break;
+			}
+		}
+		uint8_t num_data_bytes =
+			(is_last || is_short) ? num_remaining : USB_MIDI_UMP_SYSEX7_MAX_BYTES;
+		uint8_t status = sysex_status(packet_idx == 0 && has_start, is_last);
+		sysex7_packet(group, status, data, num_data_bytes, &words[2 * packet_idx]);
+		data += num_data_bytes;
+		packet_idx++;
+		if (is_last) {
+			/* Account for the F7 */
+			data += 1;
+			break;
+		}
+		if (is_short) {
+			break;
+		}
+	}
+
+	*num_words = 2 * packet_idx;
+	return packet_idx == 0 ? 0 : data - sysex_bytes;
+}
+
+uint32_t usb_midi_ump_from_sysex8(const uint8_t *data_bytes, uint32_t num_bytes, uint8_t group,
+				  uint8_t stream_id, int is_start, int is_end, uint32_t *words,
+				  uint32_t max_packets, uint32_t *num_words)
+{
+	const uint8_t *data = data_bytes;
+	const uint8_t *data_end = data_bytes + num_bytes;
+	uint32_t packet_idx = 0;
+
+	while (packet_idx < max_packets) {
+		uint32_t num_remaining = data_end - data;
+		int is_last = is_end && num_remaining <= USB_MIDI_UMP_SYSEX8_MAX_BYTES;
+		if (!is_last && num_remaining < USB_MIDI_UMP_SYSEX8_MAX_BYTES) {
+			/* Incomplete chunk. Wait for more bytes. */
+			break;
+		}
+		uint8_t num_data_bytes = is_last ? num_remaining : USB_MIDI_UMP_SYSEX8_MAX_BYTES;
+		uint8_t status = sysex_status(packet_idx == 0 && is_start, is_last);
+		sysex8_packet(group, status, stream_id, data, num_data_bytes, &words[4 * packet_idx]);
+		data += num_data_bytes;
+		packet_idx++;
+		if (is_last) {
+			break;
+		}
+	}
+
+	*num_words = 4 * packet_idx;
+	return data - data_bytes;
+}
+
+void usb_midi_ump_midi2_channel_voice(uint8_t group, uint8_t status, uint8_t index, uint8_t extra,
+				      uint32_t data, uint32_t *words)
+{
+	words[0] = UMP_HEADER(USB_MIDI_UMP_MT_MIDI2_CHANNEL_VOICE, group) |
+		   ((uint32_t)status << 16) | ((uint32_t)index << 8) | extra;
+	words[1] = data;
+}
+
+static uint8_t system_msg_num_bytes(uint8_t status)
+{
+	switch (status) {
+	case 0xf1: /* MIDI Time Code Quarter Frame */
+	case 0xf3: /* Song Select */
+		return 2;
+	case 0xf2: /* Song Position Pointer */
+		return 3;
+	default:
+		return 1;
+	}
+}
+
+static enum usb_midi_error_t parse_ump(uint32_t *words, uint8_t num_words,
+				       struct usb_midi_ump_parse_cb_t *parse_cb)
+{
+	uint8_t mt = words[0] >> 28;
+	uint8_t group = (words[0] >> 24) & 0xf;
+	uint8_t ump_bytes[16];
+	for (int i = 0; i < num_words; i++) {
+		ump_bytes[4 * i] = words[i] >> 24;
+		ump_bytes[4 * i + 1] = words[i] >> 16;
+		ump_bytes[4 * i + 2] = words[i] >> 8;
+		ump_bytes[4 * i + 3] = words[i];
+	}
+
+	switch (mt) {
+	case USB_MIDI_UMP_MT_UTILITY:
+		if (words[0] == 0) {
+			/* NOOP */
+			return USB_MIDI_SUCCESS;
+		}
+		break;
+	case USB_MIDI_UMP_MT_SYSTEM:
+		if (parse_cb->midi1.message_cb) {
+			parse_cb->midi1.message_cb(&ump_bytes[1], system_msg_num_bytes(ump_bytes[1]),
+						   group);
+		}
+		return USB_MIDI_SUCCESS;
+	case USB_MIDI_UMP_MT_MIDI1_CHANNEL_VOICE: {
+		uint8_t high_nibble = ump_bytes[1] >> 4;
+		uint8_t num_bytes = (high_nibble == 0xc || high_nibble == 0xd) ? 2 : 3;
+		if (high_nibble < 0x8 || high_nibble > 0xe) {
+			return USB_MIDI_ERROR_INVALID_MIDI_MSG;
+		}
+		if (parse_cb->midi1.message_cb) {
+			parse_cb->midi1.message_cb(&ump_bytes[1], num_bytes, group);
+		}
+		return USB_MIDI_SUCCESS;
+	}
+	case USB_MIDI_UMP_MT_SYSEX7: {
+		uint8_t status = ump_bytes[1] >> 4;
+		uint8_t num_data_bytes = ump_bytes[1] & 0xf;
+		if (status > USB_MIDI_UMP_SYSEX_END ||
+		    num_data_bytes > USB_MIDI_UMP_SYSEX7_MAX_BYTES) {
+			return USB_MIDI_ERROR_INVALID_MIDI_MSG;
+		}
+		int is_first = status == USB_MIDI_UMP_SYSEX_COMPLETE ||
+			       status == USB_MIDI_UMP_SYSEX_START;
+		int is_last = status == USB_MIDI_UMP_SYSEX_COMPLETE ||
+			      status == USB_MIDI_UMP_SYSEX_END;
+		if (is_first && parse_cb->midi1.sysex_start_cb) {
+			parse_cb->midi1.sysex_start_cb(group);
+		}
+		if (num_data_bytes > 0 && parse_cb->midi1.sysex_data_cb) {
+			parse_cb->midi1.sysex_data_cb(&ump_bytes[2], num_data_bytes, group);
+		}
+		if (is_last && parse_cb->midi1.sysex_end_cb) {
+			parse_cb->midi1.sysex_end_cb(group);
+		}
+		return USB_MIDI_SUCCESS;
+	}
+	case USB_MIDI_UMP_MT_DATA128: {
+		uint8_t status = ump_bytes[1] >> 4;
+		uint8_t num_bytes = ump_bytes[1] & 0xf;
+		if (status > USB_MIDI_UMP_SYSEX_END) {
+			/* Mixed data set. */
+			break;
+		}
+		if (num_bytes == 0 || num_bytes > USB_MIDI_UMP_SYSEX8_MAX_BYTES + 1) {
+			return USB_MIDI_ERROR_INVALID_MIDI_MSG;
+		}
+		if (parse_cb->sysex8_cb) {
+			/* The byte count includes the stream ID */
+			parse_cb->sysex8_cb(&ump_bytes[3], num_bytes - 1, status, ump_bytes[2],
+					    group);
+		}
+		return USB_MIDI_SUCCESS;
+	}
+	default:
+		break;
+	}
+
+	/* MIDI 2.0 channel voice messages, utility messages etc. */
+	if (parse_cb->ump_cb) {
+		parse_cb->ump_cb(words, num_words);
+	}
+	return USB_MIDI_SUCCESS;
+}
+
+enum usb_midi_error_t usb_midi_ump_parse_transfer(uint8_t *transfer_bytes, uint32_t num_bytes,
+						  struct usb_midi_ump_parse_cb_t *parse_cb)
+{
+	enum usb_midi_error_t first_error = USB_MIDI_SUCCESS;
+	uint32_t num_transfer_words = num_bytes / 4;
+	uint32_t i = 0;
+
+	while (i < num_transfer_words) {
+		uint32_t words[USB_MIDI_UMP_MAX_WORDS];
+		words[0] = usb_midi_get_word(&transfer_bytes[4 * i]);
+		uint8_t num_words = usb_midi_ump_num_words(words[0]);
+		if (i + num_words > num_transfer_words) {
+			/* Truncated UMP */
+			return first_error == USB_MIDI_SUCCESS ? USB_MIDI_ERROR_INVALID_MIDI_MSG
+							       : first_error;
+		}
+		for (int j = 1; j < num_words; j++) {
+			words[j] = usb_midi_get_word(&transfer_bytes[4 * (i + j)]);
+		}
+
+		enum usb_midi_error_t error = parse_ump(words, num_words, parse_cb);
+		if (error != USB_MIDI_SUCCESS && first_error == USB_MIDI_SUCCESS) {
+			first_error = error;
+		}
+		i += num_words;
+	}
+
+	return first_error;
+}
@@ -0,0 +1,116 @@
+#ifndef ZEPHYR_USB_MIDI_UMP_H_
+#define ZEPHYR_USB_MIDI_UMP_H_
+
+#include <stdint.h>
+#include "usb_midi_packet.h"
+
+/* UMP message types. See table 4 in the UMP and MIDI 2.0 protocol spec. */
+enum usb_midi_ump_mt_t {
+	/* Utility messages */
+	USB_MIDI_UMP_MT_UTILITY = 0x0,
+	/* System real time and system common messages */
+	USB_MIDI_UMP_MT_SYSTEM = 0x1,
+	/* MIDI 1.0 channel voice messages */
+	USB_MIDI_UMP_MT_MIDI1_CHANNEL_VOICE = 0x2,
+	/* Data messages, including 7 bit system exclusive */
+	USB_MIDI_UMP_MT_SYSEX7 = 0x3,
+	/* MIDI 2.0 channel voice messages */
+	USB_MIDI_UMP_MT_MIDI2_CHANNEL_VOICE = 0x4,
+	/* Data messages, including 8 bit system exclusive and mixed data sets */
+	USB_MIDI_UMP_MT_DATA128 = 0x5
+};
+
+/* Status of 7 and 8 bit system exclusive packets */
+enum usb_midi_ump_sysex_status_t {
+	USB_MIDI_UMP_SYSEX_COMPLETE = 0x0,
+	USB_MIDI_UMP_SYSEX_START = 0x1,
+	USB_MIDI_UMP_SYSEX_CONTINUE = 0x2,
+	USB_MIDI_UMP_SYSEX_END = 0x3
+};
+
+/* The max number of data bytes of a sysex7 packet. */
+#define USB_MIDI_UMP_SYSEX7_MAX_BYTES 6
+/* The max number of data bytes, excluding the stream ID, of a sysex8 packet. */
+#define USB_MIDI_UMP_SYSEX8_MAX_BYTES 13
+/* The max number of 32 bit words of a UMP */
+#define USB_MIDI_UMP_MAX_WORDS 4
+
+/** Called when a sysex8 packet has been parsed */
+typedef void (*usb_midi_sysex8_cb_t)(uint8_t *data_bytes, uint8_t num_data_bytes, uint8_t status,
+				     uint8_t stream_id, uint8_t group);
+/** Called when a UMP not delivered through other callbacks has been parsed */
+typedef void (*usb_midi_ump_cb_t)(uint32_t *words, uint8_t num_words);
+
+struct usb_midi_ump_parse_cb_t {
+	/*
+	 * MIDI 1.0 channel voice, system and sysex7 messages are delivered
+	 * through these callbacks. The group is passed as cable number.
+	 */
+	struct usb_midi_parse_cb_t midi1;
+	usb_midi_sysex8_cb_t sysex8_cb;
+	usb_midi_ump_cb_t ump_cb;
+};
+
+/**
+ * Returns the number of 32 bit words of a UMP given its first word.
+ */
+uint8_t usb_midi_ump_num_words(uint32_t first_word);
+
+/**
+ * Builds a UMP from a MIDI message of the form accepted by
+ * usb_midi_packet_from_midi_bytes. Channel voice messages become MIDI 1.0
+ * channel voice UMPs, system messages become system UMPs and sysex chunks
+ * become sysex7 UMPs.
+ * @param midi_bytes 3 MIDI bytes.
+ * @param group The UMP group, must be smaller than 16.
+ * @param words Destination of the UMP, at least 2 words.
+ * @param num_words Set to the number of words of the UMP.
+ */
+enum usb_midi_error_t usb_midi_ump_from_midi1_bytes(uint8_t *midi_bytes, uint8_t group,
+						    uint32_t *words, uint8_t *num_words);
+
+/**
+ * Builds sysex7 UMPs from a span of a sysex message. The span may start with
+ * F0 and may end with F7, all other bytes are assumed to be data bytes. If the
+ * span does not end with F7, only complete 6 byte chunks are encoded and the
+ * remaining bytes are left for the next call, unless flush is non-zero. Then
+ * the remaining bytes are sent in a shorter start or continue packet, which
+ * is how MIDI 1.0 sysex chunks of less than 6 bytes are converted.
+ * @return The number of encoded sysex bytes.
+ */
+uint32_t usb_midi_ump_from_sysex7(const uint8_t *sysex_bytes, uint32_t num_bytes, uint8_t group,
+				  uint32_t *words, uint32_t max_packets, int flush,
+				  uint32_t *num_words);
+
+/**
+ * Builds sysex8 UMPs, carrying 13 data bytes per 16 byte packet, from a span
+ * of a message. If the span does not end the message, only complete 13 byte
+ * chunks are encoded and the remaining bytes are left for the next call.
+ * @param is_start Non-zero if the span starts the message.
+ * @param is_end Non-zero if the span ends the message.
+ * @return The number of encoded data bytes.
+ */
+uint32_t usb_midi_ump_from_sysex8(const uint8_t *data_bytes, uint32_t num_bytes, uint8_t group,
+				  uint8_t stream_id, int is_start, int is_end, uint32_t *words,
+				  uint32_t max_packets, uint32_t *num_words);
+
+/**
+ * Builds a MIDI 2.0 channel voice UMP.
+ * @param status Status byte including the channel, e.g 0x90 for note on on channel 1.
+ * @param index Note number, controller index etc, depending on the status.
+ * @param extra Attribute type, controller bank etc, depending on the status.
+ * @param data 32 bit data word, e.g a 32 bit controller value.
+ * @param words Destination of the 2 word UMP.
+ */
+void usb_midi_ump_midi2_channel_voice(uint8_t group, uint8_t status, uint8_t index, uint8_t extra,
+				      uint32_t data, uint32_t *words);
+
+/**
+ * Parses UMPs transferred as little endian 32 bit words and invokes the
+ * appropriate callbacks. Parsing continues past invalid packets, in which
+ * case the first error is returned.
+ */
+enum usb_midi_error_t usb_midi_ump_parse_transfer(uint8_t *transfer_bytes, uint32_t num_bytes,
+						  struct usb_midi_ump_parse_cb_t *parse_cb);
+
+#endif